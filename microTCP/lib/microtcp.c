@@ -1,18 +1,28 @@
-/* Georgios Gerasimos Leventopoulos csd4152 
-   Konstantinos Anemozalis csd4149      
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
    Theofanis Tsesmetzis csd4142             */
 
 #include "microtcp.h"
 #include "../utils/crc32.h"
+#include "../utils/crc32c.h"
+#include "../utils/hash64.h"
+#include "microtcp_capture.h"
+#include "microtcp_io.h"
+#include "microtcp_metrics.h"
+#include "microtcp_trace.h"
+#include "microtcp_uring.h"
 #include "util.h"
 
+#include <sys/time.h>
+#include <pthread.h>
+
 #define TRUE 1
 #define ACK htons(4096)
 #define SYN htons(16384)
 #define FIN htons(32768)
 #define SYN_ACK htons(20480)
 #define FIN_ACK htons(36864)
-/* 
+/*
 ACK    	 4096	 0001000000000000  2^12
 RST		 8192    0010000000000000  2^13
 SYN    	 16384   0100000000000000  2^14
@@ -20,18 +30,1814 @@ FIN      32768   1000000000000000  2^15
 SYN_ACK  20480   0101000000000000  2^14 + 2^12
 FIN_ACK  36864	 1001000000000000  2^15 + 2^12
 */
+
+#define SEGMENT_LEN (MICROTCP_MAX_MSS + sizeof(microtcp_header_t))
+
+/* The sequence state of each side fills one cache line, a segment touches only the first two of the socket */
+_Static_assert(offsetof(microtcp_sock_t, ack_number) == MICROTCP_CACHE_LINE,
+               "the sequence state of the sending side outgrew its cache line");
+_Static_assert(offsetof(microtcp_sock_t, sd) == 2 * MICROTCP_CACHE_LINE,
+               "the sequence state of the receiving side outgrew its cache line");
+
+/* future_use0 of SYN and SYN_ACK: the options of the connection */
+#define OPT_MESSAGES htonl(1)
+#define OPT_WINDOW htonl(2)     /* The window field advertises the free space of the receive buffer */
+#define OPT_STREAMS htonl(4)    /* Multiplexed, comes with OPT_MESSAGES */
+#define OPT_FEC htonl(8)        /* Repair segments, comes with OPT_MESSAGES */
+/* future_use0 of the other segments */
+#define SEG_SACK htonl(1)       /* The ACK also acknowledges the message that starts at future_use1 */
+#define SEG_FORWARD htonl(2)    /* The receiver should not wait for anything before seq */
+#define SEG_REPAIR htonl(4)     /* The XOR of a block of messages, see struct microtcp_fec */
+#define SEG_RECOVERED htonl(8)  /* The message was rebuilt from a repair segment */
+/* Data of a multiplexed connection: future_use1 is the offset in the stream, future_use2 the stream */
+/*
+ * future_use1 of SYN: the checksums the client accepts, one bit per
+ * microtcp_checksum_t. future_use1 of SYN_ACK: the one the server chose.
+ */
+#define CHECKSUM_BIT(c) (1u << (c))
+
+/*
+ * The checksum and the I/O of every segment, taken from the socket unless
+ * the build fixes them (see MICROTCP_FIXED_CHECKSUM and MICROTCP_SYSCALL_IO
+ * in microtcp.h). Fixed, they are constants and the branches on them in
+ * sendSegmentExtra() and receiveSegment() fold away.
+ */
+#if defined(MICROTCP_SYSCALL_IO) && defined(MICROTCP_URING)
+#error "MICROTCP_SYSCALL_IO and MICROTCP_URING exclude each other"
+#endif
+#ifdef MICROTCP_FIXED_CHECKSUM
+#define SOCKET_CHECKSUM(socket) ((microtcp_checksum_t)(MICROTCP_FIXED_CHECKSUM))
+#else
+#define SOCKET_CHECKSUM(socket) ((socket)->checksum)
+#endif
+#ifdef MICROTCP_SYSCALL_IO
+#define SOCKET_URING(socket) ((struct microtcp_uring *)NULL)
+#else
+#define SOCKET_URING(socket) ((socket)->uring)
+#endif
+
+/* Segments with SYN are checked with CRC-32, the algorithm is not known yet */
+#define CHECKSUM_OF(socket, control) (((control) & SYN) ? MICROTCP_CHECKSUM_CRC32 : SOCKET_CHECKSUM(socket))
+
+/*
+ * Header prediction: a segment with only the ACK flag and no options, the
+ * common case of an established connection. Such segments skip the
+ * dispatch of handleIncoming().
+ */
+#define IS_PLAIN(h) ((h)->control == ACK && (h)->future_use0 == 0)
+
+/* Path MTU probing */
+#define PMTU_MIN_STEP 64            /* The search stops when it has narrowed the size down to this */
+#define PMTU_BLACK_HOLE_TIMEOUTS 2  /* Consecutive timeouts after which large segments are suspected */
+#define PMTU_FLOOR (576 - 28 - sizeof(microtcp_header_t)) /* Fits the 576 bytes every IPv4 host accepts (RFC 1122) */
+
+/* The window field counts units of 4 bytes, so it covers the largest receive buffer */
+#define WINDOW_SHIFT 2
+#define MAX_WINDOW (0xffffu << WINDOW_SHIFT)
+
+#define UDP_RCVBUF_LEN 212992  /* The default of Linux, the UDP socket never asks for less */
+#define NO_WAIT UINT64_MAX      /* receiveSegment() returns at once if nothing has arrived */
+#define MAX_OOO_MESSAGES 64
+#define FEC_CACHE_LEN (2 * MICROTCP_FEC_MAX_BLOCK) /* Received messages kept for the repair of their block */
+#define FEC_ADAPT_MESSAGES 64   /* Acknowledged messages per update of the loss estimate */
+#define FEC_STREAM_PREFIX (2 * sizeof(uint32_t)) /* The XOR of the stream offsets and ids */
+#define RACK_SLOTS 512          /* Segments in flight whose send times sendStream() keeps for RACK */
+#define TLP_MIN_US 10000        /* The probe timeout never goes below this, as in Linux */
+#define AUTOTUNE_MIN_ROUND_US 1000  /* Scheduling noise swamps the rate over shorter rounds */
+#define AUTOTUNE_GRANULE 4096       /* Receive buffers grow in whole pages */
+#define RATE_MIN_INTERVAL_US 1000   /* Scheduling noise swamps delivery rate samples over less */
+#define RATE_WINDOW_SAMPLES 8       /* send_rate is the highest sample of the last 8 to 16 */
+
+/* Logs an error and records it in the trace with the errno of the moment */
+#define reportError(socket, M, ...) do {                                              \
+        TRACE_EVENT(LOG_LEVEL_ERROR, TRACE_ERROR, (socket)->sd, (socket)->seq_number,  \
+                    (socket)->ack_number, __LINE__, errno);                            \
+        LOG_ERROR(M, ##__VA_ARGS__);                                                   \
+    } while (0)
+
+/* State of the optional CSV time series of a connection */
+struct microtcp_sampler {
+    FILE *fp;
+    uint64_t start_us;
+    uint64_t interval_us;
+    uint64_t next_us;
+    uint64_t last_us;
+    uint64_t last_bytes_send;
+    uint64_t last_bytes_received;
+};
+
+/* A sent message waiting for its ACK, in message mode */
+struct microtcp_message {
+    uint32_t seq;
+    size_t length;
+    uint64_t sent_us;           /* Last transmission */
+    uint64_t deadline_us;       /* Abandoned after it, 0 never */
+    int acked;
+    int abandoned;
+    int retransmitted;          /* No RTT samples from it (Karn) */
+    int sacks_after;            /* Later messages acknowledged while it was not */
+    uint32_t stream;            /* On a multiplexed connection */
+    uint32_t offset;
+    int fec;                    /* FEC_NONE, FEC_OPEN or FEC_REPAIRED */
+    uint32_t repair_end;        /* With FEC_REPAIRED, the end of its block */
+    struct microtcp_message *next;
+    uint8_t data[];
+};
+
+/* State of message mode, see microtcp_set_message_mode() */
+struct microtcp_messages {
+    uint64_t lifetime_us;
+    /* Sender */
+    struct microtcp_message *head;
+    struct microtcp_message *tail;
+    uint32_t una;               /* Cumulative ACK of the peer */
+    int queued;                 /* Messages from the first one not acknowledged or abandoned on */
+    uint32_t recover;           /* No cwnd reduction for a loss before this is acknowledged */
+    uint64_t timer_us;          /* Start of the retransmission timer */
+    int timeouts;
+    uint64_t rack_sent_us;      /* RACK: the last transmission of the latest message delivered */
+    uint32_t rack_seq;          /* That message, it breaks ties between messages sent together */
+    uint32_t rack_sacked;       /* The highest message SACKed */
+    uint64_t rack_us;           /* The RACK timer, 0 if not armed */
+    uint64_t last_us;           /* The last new message or ACK, the tail loss probe starts from it */
+    int probing;                /* A tail loss probe is unanswered */
+    /* Receiver: messages above ack_number that were delivered out of order */
+    uint32_t ooo_start[MAX_OOO_MESSAGES];
+    uint32_t ooo_end[MAX_OOO_MESSAGES];
+    int ooo_count;
+};
+
+/* How a message is covered by forward error correction */
+enum { FEC_NONE, FEC_OPEN, FEC_REPAIRED };
+
+/* A received message, kept until the repair segment of its block has had time to arrive */
+struct microtcp_fec_entry {
+    uint32_t seq;
+    size_t length;              /* 0 if unused */
+    uint32_t offset;            /* Of a multiplexed connection */
+    uint32_t stream;
+    size_t capacity;
+    uint8_t *data;
+};
+
+/*
+ * State of forward error correction, see microtcp_set_fec(). After every
+ * block of messages the sender sends a repair segment: seq is the first
+ * message of the block, future_use1 the end of the last one, future_use2
+ * their number and the data the XOR of the messages, padded to the
+ * longest. On a multiplexed connection the data start with the XOR of the
+ * stream offsets and ids. A receiver that misses one message of a block
+ * rebuilds it from the others and the repair.
+ */
+struct microtcp_fec {
+    int max_block;
+    int block;                  /* Messages per repair segment, adapted to the loss */
+    /* Sender: the open block */
+    uint32_t block_start;
+    int count;
+    uint64_t opened_us;
+    size_t parity_len;
+    uint8_t parity[SEGMENT_LEN]; /* Zero past parity_len */
+    /* Sender: messages lost, rebuilt or not, out of those acknowledged lately */
+    double loss;
+    uint32_t acked;
+    uint32_t lost;
+    /* Receiver */
+    struct microtcp_fec_entry cache[FEC_CACHE_LEN];
+    int next_entry;
+};
+
+/* Data of a stream that arrived, kept in stream order until they are read */
+struct microtcp_chunk {
+    uint32_t offset;            /* Of data[start] in the stream */
+    size_t start;
+    size_t length;              /* From start */
+    struct microtcp_chunk *next;
+    uint8_t data[];
+};
+
+/* A stream of a multiplexed connection */
+struct microtcp_stream {
+    /* Sender: pending[pending_start, pending_start + pending_len) are not sent yet */
+    uint8_t *pending;           /* MICROTCP_STREAM_BUFFER_LEN bytes, allocated by the first send */
+    size_t pending_start;
+    size_t pending_len;
+    uint32_t send_offset;       /* Of the first pending byte in the stream */
+    /* Receiver */
+    struct microtcp_chunk *chunks; /* In offset order */
+    uint32_t read_offset;       /* Of the next byte for the application */
+};
+
+/* State of a multiplexed connection, see microtcp_set_streams() */
+struct microtcp_streams {
+    struct microtcp_stream stream[MICROTCP_MAX_STREAMS];
+    int next_send;              /* The round robins go on from these */
+    int next_read;
+    size_t pending;             /* Bytes of all the streams not sent yet */
+    size_t buffered;            /* Bytes of all the streams received and not read yet */
+};
+
+/*
+ * State of the send buffer, see microtcp_set_send_buffer(). The data are
+ * a ring, start is the oldest byte not acknowledged yet and microtcp_send()
+ * appends after start + len. While the sender thread runs the socket is
+ * its own, the application only sees the snapshot in stats.
+ */
+struct microtcp_sendbuf {
+    uint8_t *data;              /* Allocated by the first send */
+    size_t size;
+    size_t start;
+    size_t len;
+    int nonblocking;
+    int running;                /* The sender thread has started and has not been joined */
+    int closing;                /* The sender thread sends what is left and exits */
+    int failed;
+    microtcp_stats_t stats;     /* Of the socket, as the sender thread last left it */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Data added, space freed, uncorked or closing */
+};
+
+/* Writes a row of the time series if the sampling interval has passed */
+static void sampleStats(microtcp_sock_t *socket){
+    struct microtcp_sampler *s = socket->sampler;
+    uint64_t now;
+    double elapsed;
+
+    if (s == NULL)
+        return;
+    now = io_now_us();
+    if (now < s->next_us)
+        return;
+    elapsed = now > s->last_us ? (now - s->last_us) : 1;
+    fprintf(s->fp, "%f,%" PRIu64 ",%" PRIu64 ",%f,%f,%zu,%zu,%zu,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            (now - s->start_us) * 1e-6, socket->bytes_send, socket->bytes_received,
+            (socket->bytes_send - s->last_bytes_send) * 8 / elapsed,
+            (socket->bytes_received - s->last_bytes_received) * 8 / elapsed,
+            socket->cwnd, socket->ssthresh, socket->flight_size, socket->curr_win_size,
+            socket->srtt_us, socket->rto_us, socket->retransmissions, socket->dup_acks);
+    s->last_us = now;
+    s->last_bytes_send = socket->bytes_send;
+    s->last_bytes_received = socket->bytes_received;
+    s->next_us = now + s->interval_us;
+}
+
+/* Sets the receive timeout of the UDP socket, 0 blocks forever */
+static int setTimeout(microtcp_sock_t *socket, uint64_t timeout_us){
+    struct timeval tv;
+    if (socket->timeout_us == timeout_us)
+        return 0;
+    tv.tv_sec = timeout_us / 1000000;
+    tv.tv_usec = timeout_us % 1000000;
+    if (io_setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval)) < 0){
+        reportError(socket, "Setting the receive timeout: %s", strerror(errno));
+        return -1;
+    }
+    socket->timeout_us = timeout_us;
+    return 0;
+}
+
+static void setState(microtcp_sock_t *socket, mircotcp_state_t state){
+    TRACE_EVENT(LOG_LEVEL_INFO, TRACE_STATE, socket->sd, socket->seq_number,
+                socket->ack_number, socket->state, state);
+    socket->state = state;
+}
+
+static void traceCwnd(microtcp_sock_t *socket, uint32_t una){
+    TRACE_EVENT(LOG_LEVEL_DEBUG, TRACE_CWND, socket->sd, una, 0, socket->ssthresh, socket->cwnd);
+}
+
+/* The free space of the receive buffer, the data the streams keep count against it */
+static size_t freeSpace(microtcp_sock_t *socket){
+    size_t used = socket->buf_fill_level + (socket->streams ? socket->streams->buffered : 0);
+
+    return used < socket->recvbuf_len ? socket->recvbuf_len - used : 0;
+}
+
+/* Copies a segment on the wire to the pcap capture, which runs while microtcp_capture_active is set */
+static void captureSegment(microtcp_sock_t *socket, int outgoing, const uint8_t *segment, size_t length){
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+
+    if (socket->local_port == 0 && io_getsockname(socket->sd, (struct sockaddr *)&local, &len) == 0)
+        socket->local_port = ntohs(local.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&local)->sin6_port
+                                                               : ((struct sockaddr_in *)&local)->sin_port);
+    microtcp_capture_segment(outgoing, socket->local_port, socket->address, socket->size, segment, length);
+}
+
+/* Builds a segment with our current ack number and sends it to the peer */
+static int sendSegmentExtra(microtcp_sock_t *socket, uint32_t seq, uint16_t control, const void *data, size_t length,
+                            uint32_t future_use0, uint32_t future_use1, uint32_t future_use2){
+    uint8_t segment[SEGMENT_LEN];
+    uint8_t *out;
+    microtcp_header_t header;
+    ssize_t sent;
+
+    /* Every segment advertises the free space in recvbuf, rounded down */
+    socket->advertised_window = min(freeSpace(socket), MAX_WINDOW);
+    socket->advertised_window &= ~(size_t)((1 << WINDOW_SHIFT) - 1);
+    initializeHeader(&header, htonl(seq), htonl(socket->ack_number), control,
+                     htons(socket->advertised_window >> WINDOW_SHIFT), htonl(length),
+                     future_use0, future_use1, future_use2);
+    if (SOCKET_URING(socket)){
+        out = microtcp_uring_send_buffer(SOCKET_URING(socket));
+        if (out == NULL){
+            reportError(socket, "Waiting for a send buffer: %s", strerror(errno));
+            return -1;
+        }
+        insertToBuffer(out, &header, sizeof(microtcp_header_t), (void *)data, 0, length, CHECKSUM_OF(socket, control));
+        if (microtcp_capture_active)
+            captureSegment(socket, 1, out, sizeof(microtcp_header_t) + length);
+        sent = microtcp_uring_send(SOCKET_URING(socket), sizeof(microtcp_header_t) + length, socket->address, socket->size,
+                                   socket->batching && length > 0);
+    }
+    else {
+        insertToBuffer(segment, &header, sizeof(microtcp_header_t), (void *)data, 0, length, CHECKSUM_OF(socket, control));
+        sent = io_sendto(socket->sd, segment, sizeof(microtcp_header_t) + length, 0, socket->address, socket->size);
+        if (microtcp_capture_active && sent >= 0)
+            captureSegment(socket, 1, segment, sent);
+    }
+    if (sent < 0){
+        if (errno == EMSGSIZE && length > 0)
+            return 0; /* Larger than the MTU of the interface, as good as lost on the path */
+        reportError(socket, "Sending a segment: %s", strerror(errno));
+        return -1;
+    }
+    TRACE_EVENT(LOG_LEVEL_TRACE, TRACE_SEGMENT_SENT, socket->sd, seq, socket->ack_number, length, ntohs(control));
+    socket->packets_send++;
+    socket->bytes_send += length;
+    return 0;
+}
+
+static int sendSegment(microtcp_sock_t *socket, uint32_t seq, uint16_t control, const void *data, size_t length){
+    return sendSegmentExtra(socket, seq, control, data, length, 0, 0, 0);
+}
+
+static int sendAck(microtcp_sock_t *socket){
+    return sendSegment(socket, socket->seq_number, ACK, NULL, 0);
+}
+
+static ssize_t receiveDatagram(microtcp_sock_t *socket, uint8_t *segment, uint64_t timeout_us){
+    if (SOCKET_URING(socket))
+        return microtcp_uring_recv(SOCKET_URING(socket), segment, SEGMENT_LEN,
+                                   timeout_us == NO_WAIT ? MICROTCP_URING_NO_WAIT : timeout_us);
+    return io_recvfrom(socket->sd, segment, SEGMENT_LEN, timeout_us == NO_WAIT ? MSG_DONTWAIT : 0, NULL, NULL);
+}
+
+static uint64_t threadCpuUs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Polls for a datagram without sleeping for the busy poll budget, or less
+ * if timeout_us is shorter. Returns like receiveDatagram() with NO_WAIT.
+ */
+static ssize_t busyPoll(microtcp_sock_t *socket, uint8_t *segment, uint64_t timeout_us){
+    uint64_t budget = socket->busy_poll_us;
+    uint64_t cpu = threadCpuUs();
+    uint64_t start = io_now_us();
+    ssize_t received;
+
+    if (timeout_us > 0 && timeout_us < budget)
+        budget = timeout_us;
+    do{
+        received = receiveDatagram(socket, segment, NO_WAIT);
+    } while (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && io_now_us() - start < budget);
+    socket->busy_poll_cpu_us += threadCpuUs() - cpu;
+    if (received >= 0)
+        socket->busy_poll_hits++;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        socket->busy_poll_misses++;
+    return received;
+}
+
+/*
+ * Waits for the next segment with a valid checksum, at most timeout_us
+ * (0 forever, NO_WAIT not at all), after spinning for the busy poll budget.
+ * Returns its length (header included), 0 on timeout or -1 on error.
+ */
+static ssize_t receiveSegment(microtcp_sock_t *socket, uint8_t *segment, uint64_t timeout_us){
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    ssize_t received;
+
+    if (SOCKET_URING(socket) == NULL && timeout_us != NO_WAIT && setTimeout(socket, timeout_us) < 0)
+        return -1;
+    while (TRUE){
+        received = -1;
+        errno = EAGAIN;
+        if (socket->busy_poll_us > 0 && timeout_us != NO_WAIT)
+            received = busyPoll(socket, segment, timeout_us);
+        /* Out of budget, the blocking wait still gets the whole timeout */
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            received = receiveDatagram(socket, segment, timeout_us);
+        if (received < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (received < (ssize_t)sizeof(microtcp_header_t)
+            || ntohl(h->data_len) != received - sizeof(microtcp_header_t)
+            || !hasValidCheckSum(segment, received, CHECKSUM_OF(socket, h->control)))
+            continue; /* Corrupted, the peer will send it again */
+        socket->packets_received++;
+        if (microtcp_capture_active)
+            captureSegment(socket, 0, segment, received);
+        TRACE_EVENT(LOG_LEVEL_TRACE, TRACE_SEGMENT_RECEIVED, socket->sd, ntohl(h->seq_number),
+                    ntohl(h->ack_number), received - sizeof(microtcp_header_t), ntohs(h->control));
+        return received;
+    }
+}
+
+/* RTT estimation and RTO calculation of RFC 6298 */
+static void updateRtt(microtcp_sock_t *socket, uint64_t sample_us){
+    uint64_t diff;
+    if (socket->srtt_us == 0){
+        socket->srtt_us = sample_us;
+        socket->rttvar_us = sample_us / 2;
+    }
+    else{
+        diff = socket->srtt_us > sample_us ? socket->srtt_us - sample_us : sample_us - socket->srtt_us;
+        socket->rttvar_us = (3 * socket->rttvar_us + diff) / 4;
+        socket->srtt_us = (7 * socket->srtt_us + sample_us) / 8;
+    }
+    if (socket->min_rtt_us == 0 || sample_us < socket->min_rtt_us)
+        socket->min_rtt_us = sample_us;
+    socket->rto_us = socket->srtt_us + 4 * socket->rttvar_us;
+    if (socket->rto_us < MICROTCP_ACK_TIMEOUT_US)
+        socket->rto_us = MICROTCP_ACK_TIMEOUT_US;
+    if (socket->rto_us > MICROTCP_MAX_RTO_US)
+        socket->rto_us = MICROTCP_MAX_RTO_US;
+}
+
+/*
+ * The delivery rate, a windowed maximum like the bottleneck bandwidth of
+ * BBR. Each sample is what the peer acknowledged over at least an RTT,
+ * shorter intervals measure how the ACKs bunch up rather than the path.
+ * The samples go into windows of RATE_WINDOW_SAMPLES, and the maximum of
+ * the current and the previous window is the rate, so it follows a path
+ * that gets slower instead of keeping its best moment forever.
+ */
+static void updateDeliveryRate(microtcp_sock_t *socket, uint64_t sample){
+    if (++socket->rate_samples > RATE_WINDOW_SAMPLES){
+        socket->rate_max[1] = socket->rate_max[0];
+        socket->rate_max[0] = 0;
+        socket->rate_samples = 1;
+    }
+    socket->rate_max[0] = max(socket->rate_max[0], sample);
+    socket->send_rate = max(socket->rate_max[0], socket->rate_max[1]);
+}
+
+/* The shortest interval of a delivery rate sample */
+static uint64_t rateInterval(microtcp_sock_t *socket){
+    return max(max(socket->srtt_us, socket->min_rtt_us), RATE_MIN_INTERVAL_US);
+}
+
+/*
+ * Starts the interval of the delivery rate sample afresh unless the last
+ * send ended less than an interval ago. Small writes so add up to one
+ * sample like a single large one, while an application that paused does
+ * not drag the sample down.
+ */
+static void startRateSample(microtcp_sock_t *socket, uint64_t now){
+    if (socket->rate_start_us != 0 && now - socket->rate_idle_us < rateInterval(socket))
+        return;
+    socket->rate_seq = socket->seq_number;
+    socket->rate_start_us = now;
+}
+
+/*
+ * Time based loss detection of RACK (RFC 8985). Once a segment sent after
+ * another has been acknowledged, the earlier one is lost if its ACK has not
+ * come a reordering window after the RTT. The window is a quarter of the
+ * smallest RTT. Returns when that is for a segment sent at sent_us.
+ */
+static uint64_t rackDeadline(microtcp_sock_t *socket, uint64_t sent_us){
+    return sent_us + socket->srtt_us + min(socket->min_rtt_us / 4, socket->srtt_us);
+}
+
+/*
+ * The probe timeout of RFC 8985 7.2. After this long without an ACK the
+ * last segment is sent again, so the loss of the tail of a burst shows up
+ * in an RTT or two instead of a full RTO.
+ */
+static uint64_t probeTimeout(microtcp_sock_t *socket){
+    return max(2 * socket->srtt_us, TLP_MIN_US);
+}
+
+/* The segment size the MTU of the interface towards the peer allows */
+static size_t localMss(microtcp_sock_t *socket){
+    size_t headers = (socket->address->sa_family == AF_INET6 ? 40 : 20) + 8 + sizeof(microtcp_header_t);
+    int mtu = io_path_mtu(socket->address, socket->size);
+
+    if (mtu <= 0 || (size_t)mtu <= headers)
+        return MICROTCP_MSS;
+    return min((size_t)mtu - headers, MICROTCP_MAX_MSS);
+}
+
+/*
+ * The receive buffers of all the connections count against one budget.
+ * It is checked before each growth without a lock, so connections growing
+ * at the same moment may overshoot it by a buffer each.
+ */
+static size_t recvbufMemory;
+static size_t memoryLimit = MICROTCP_MEMORY_LIMIT;
+
+static microtcp_memory_pressure_t memoryPressure(void){
+    size_t used = __atomic_load_n(&recvbufMemory, __ATOMIC_RELAXED);
+    size_t limit = __atomic_load_n(&memoryLimit, __ATOMIC_RELAXED);
+
+    if (used >= limit)
+        return MICROTCP_MEMORY_EXHAUSTED;
+    return used >= limit / 4 * 3 ? MICROTCP_MEMORY_PRESSURE : MICROTCP_MEMORY_OK;
+}
+
+/* Resizes recvbuf keeping its data and counts the difference against the budget */
+static int resizeRecvbuf(microtcp_sock_t *socket, size_t length){
+    size_t old = socket->recvbuf ? socket->recvbuf_len : 0;
+    uint8_t *recvbuf;
+
+    recvbuf = realloc(socket->recvbuf, length);
+    if (recvbuf == NULL)
+        return -1;
+    socket->recvbuf = recvbuf;
+    socket->recvbuf_len = length;
+    /* Wraps around for a smaller buffer, which subtracts */
+    __atomic_add_fetch(&recvbufMemory, length - old, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void freeRecvbuf(microtcp_sock_t *socket){
+    if (socket->recvbuf)
+        __atomic_sub_fetch(&recvbufMemory, socket->recvbuf_len, __ATOMIC_RELAXED);
+    free(socket->recvbuf);
+    socket->recvbuf = NULL;
+    socket->buf_start = 0;
+    socket->buf_fill_level = 0;
+}
+
+/* The buffer of the handshake, what autotuning shrinks back to */
+static size_t initialRecvbuf(microtcp_sock_t *socket){
+    return max(MICROTCP_RECVBUF_LEN, MICROTCP_WIN_SEGMENTS * socket->max_mss);
+}
+
+/*
+ * A receive buffer of length cut down to what the budget has left, the
+ * buffer of the connection itself counted as free. Never below
+ * MICROTCP_RECVBUF_LEN, so every connection can make progress.
+ */
+static size_t budgetRecvbuf(microtcp_sock_t *socket, size_t length){
+    size_t used = __atomic_load_n(&recvbufMemory, __ATOMIC_RELAXED);
+    size_t limit = __atomic_load_n(&memoryLimit, __ATOMIC_RELAXED);
+    size_t own = socket->recvbuf ? socket->recvbuf_len : 0;
+    size_t room;
+
+    used = used > own ? used - own : 0;
+    room = limit > used ? limit - used : 0;
+    if (length <= room)
+        return length;
+    return max(room / AUTOTUNE_GRANULE * AUTOTUNE_GRANULE, MICROTCP_RECVBUF_LEN);
+}
+
+/* A full window of large datagrams overflows the default UDP buffer, counted with their overhead */
+static void sizeUdpRcvbuf(microtcp_sock_t *socket){
+    int udpRcvbuf = max(UDP_RCVBUF_LEN, 2 * socket->recvbuf_len);
+
+    io_setsockopt(socket->sd, SOL_SOCKET, SO_RCVBUF, &udpRcvbuf, sizeof(int));
+}
+
+/*
+ * Gives back what the drained receive buffer has grown beyond its initial
+ * size, either because it sat idle or because the budget ran out. Under
+ * pressure it goes below the initial size too, down to what the budget
+ * has left. An ACK tells the peer of the smaller window at once.
+ */
+static void shrinkRecvbuf(microtcp_sock_t *socket){
+    size_t length = initialRecvbuf(socket);
+
+    if (memoryPressure() != MICROTCP_MEMORY_OK)
+        length = budgetRecvbuf(socket, length);
+    if (socket->buf_fill_level > 0 || socket->recvbuf_len <= length)
+        return;
+    if (resizeRecvbuf(socket, length) < 0)
+        return;
+    socket->buf_start = 0;
+    socket->recvbuf_shrunk++;
+    socket->autotune_us = 0;
+    if (socket->flow_control && socket->state == ESTABLISHED)
+        sendAck(socket);
+}
+
+/*
+ * Receive buffer autotuning, in the spirit of the dynamic right sizing of
+ * Linux. Once per RTT, the data delivered in order over it give the rate of
+ * the peer, and the buffer grows to twice the rate times the RTT. A sender
+ * held back by the window can so double it every RTT, while one held back
+ * by anything else leaves the buffer alone.
+ * Called when the application asks for data, never while recvbuf is in use.
+ */
+static void autotuneRecvbuf(microtcp_sock_t *socket){
+    microtcp_memory_pressure_t pressure;
+    uint64_t now;
+    uint64_t rtt;
+    uint64_t elapsed;
+    size_t target;
+    size_t room;
+    size_t used;
+
+    if (!socket->autotune || socket->recvbuf == NULL || socket->state != ESTABLISHED)
+        return;
+    pressure = memoryPressure();
+    if (pressure == MICROTCP_MEMORY_EXHAUSTED)
+        shrinkRecvbuf(socket);
+    now = io_now_us();
+    if (socket->autotune_us == 0){
+        socket->autotune_us = now;
+        socket->autotune_seq = socket->ack_number;
+        return;
+    }
+    rtt = socket->srtt_us ? socket->srtt_us : socket->handshake_rtt_us ? socket->handshake_rtt_us : socket->rto_us;
+    rtt = max(rtt, AUTOTUNE_MIN_ROUND_US);
+    elapsed = now - socket->autotune_us;
+    if (elapsed < rtt)
+        return;
+    target = 2 * (uint64_t)(socket->ack_number - socket->autotune_seq) * rtt / elapsed;
+    socket->receive_rate = max(socket->receive_rate,
+                               (uint64_t)(socket->ack_number - socket->autotune_seq) * 1000000 / elapsed);
+    socket->autotune_us = now;
+    socket->autotune_seq = socket->ack_number;
+    if (target <= socket->recvbuf_len || socket->recvbuf_len >= MICROTCP_RECVBUF_MAX
+        || pressure != MICROTCP_MEMORY_OK)
+        return;
+
+    /* Only as far as the budget stays out of pressure */
+    used = __atomic_load_n(&recvbufMemory, __ATOMIC_RELAXED);
+    room = __atomic_load_n(&memoryLimit, __ATOMIC_RELAXED) / 4 * 3;
+    room = room > used ? room - used : 0;
+    target = min(min(target, MICROTCP_RECVBUF_MAX), socket->recvbuf_len + room);
+    target = target / AUTOTUNE_GRANULE * AUTOTUNE_GRANULE;
+    if (target <= socket->recvbuf_len || resizeRecvbuf(socket, target) < 0)
+        return;
+    socket->recvbuf_grown++;
+    sizeUdpRcvbuf(socket);
+}
+
+/* How long a wait for the peer blocks before a grown, idle receive buffer shrinks, 0 forever */
+static uint64_t idleWait(microtcp_sock_t *socket){
+    return socket->recvbuf_len > initialRecvbuf(socket) && socket->buf_fill_level == 0 ? MICROTCP_RECVBUF_IDLE_US : 0;
+}
+
+/*
+ * The receive buffer for a peer the metrics cache knows: the bandwidth-
+ * delay product at the rate that peer sent at before, so a short transfer
+ * does not spend its RTTs opening the window. Autotuning takes it further,
+ * starting at twice that overshoots a short bottleneck queue in slow start.
+ */
+static size_t warmRecvbuf(microtcp_sock_t *socket, const struct microtcp_metrics *m){
+    size_t target;
+
+    if (!socket->autotune || memoryPressure() != MICROTCP_MEMORY_OK)
+        return initialRecvbuf(socket);
+    target = min(m->receive_rate * m->srtt_us / 1000000, MICROTCP_RECVBUF_MAX);
+    return max(target / AUTOTUNE_GRANULE * AUTOTUNE_GRANULE, initialRecvbuf(socket));
+}
+
+/*
+ * Starts the sender from what earlier connections learned about the peer:
+ * the RTT and the RTO that follows from it, and a cwnd of half the
+ * bandwidth-delay product they saw, in case the path is busier now, but
+ * not above the ssthresh their losses left. ssthresh itself stays, a
+ * random loss would otherwise hold every later connection to congestion
+ * avoidance.
+ */
+static void warmStart(microtcp_sock_t *socket, const struct microtcp_metrics *m){
+    size_t bdp;
+    size_t limit;
+
+    socket->srtt_us = m->srtt_us;
+    socket->rttvar_us = m->rttvar_us;
+    socket->min_rtt_us = m->srtt_us; /* Until a sample of this connection is smaller */
+    socket->rto_us = socket->srtt_us + 4 * socket->rttvar_us;
+    if (socket->rto_us < MICROTCP_ACK_TIMEOUT_US)
+        socket->rto_us = MICROTCP_ACK_TIMEOUT_US;
+    if (socket->rto_us > MICROTCP_MAX_RTO_US)
+        socket->rto_us = MICROTCP_MAX_RTO_US;
+    bdp = m->send_rate * m->srtt_us / 1000000;
+    limit = m->ssthresh > 0 ? min(m->ssthresh, socket->ssthresh) : socket->ssthresh;
+    socket->cwnd = max(socket->cwnd, min(bdp / 2, limit));
+    socket->warm_start = 1;
+}
+
+/* Leaves what the connection learned about the path to the next one to the peer */
+static void saveMetrics(microtcp_sock_t *socket){
+    struct microtcp_metrics m;
+
+    if (!socket->metrics)
+        return;
+    /* A receiver that sent no data only has the RTT of the handshake */
+    m.srtt_us = socket->srtt_us ? socket->srtt_us : socket->handshake_rtt_us;
+    m.rttvar_us = socket->srtt_us ? socket->rttvar_us : socket->handshake_rtt_us / 2;
+    /* Without a loss ssthresh is still the initial one and says nothing */
+    m.ssthresh = socket->retransmissions > 0 ? socket->ssthresh : 0;
+    m.send_rate = socket->send_rate;
+    m.receive_rate = socket->receive_rate;
+    microtcp_metrics_save(socket->address, socket->size, &m, io_now_us());
+}
+
+/*
+ * Uses the smaller of the two segment sizes of the handshake and sizes the
+ * receive buffer, the window and the initial cwnd after it. A peer that
+ * advertises none gets MICROTCP_MSS. A peer the metrics cache knows gets
+ * a warm start.
+ */
+static int useMss(microtcp_sock_t *socket, size_t local, size_t peer){
+    struct microtcp_metrics m;
+    int known;
+    size_t length;
+
+    if (peer == 0)
+        peer = MICROTCP_MSS;
+    socket->max_mss = min(min(local, peer), MICROTCP_MAX_MSS);
+    socket->mss = socket->max_mss;
+    socket->pmtu_high = socket->max_mss + 1;
+    socket->pmtu_probe_us = 0;
+
+    known = socket->metrics && microtcp_metrics_lookup(socket->address, socket->size, &m, io_now_us());
+    length = budgetRecvbuf(socket, known ? warmRecvbuf(socket, &m) : initialRecvbuf(socket));
+    if (resizeRecvbuf(socket, length) < 0){
+        reportError(socket, "Allocating a receive buffer of %zu bytes", length);
+        return -1;
+    }
+    sizeUdpRcvbuf(socket);
+    socket->init_win_size = socket->recvbuf_len;
+    socket->curr_win_size = socket->recvbuf_len;
+    socket->cwnd = MICROTCP_INIT_CWND_SEGMENTS * socket->mss;
+    socket->ssthresh = max(MICROTCP_INIT_SSTHRESH, socket->init_win_size);
+    if (known)
+        warmStart(socket, &m);
+
+    /* The buffers of the ring hold the largest segment of the connection */
+    if (socket->use_uring && socket->uring == NULL){
+        socket->uring = microtcp_uring_create(socket->sd, socket->max_mss + sizeof(microtcp_header_t));
+        if (socket->uring == NULL){
+            LOG_INFO("io_uring is not available, using plain system calls");
+            socket->use_uring = 0;
+        }
+    }
+    return 0;
+}
+
+static void setMss(microtcp_sock_t *socket, size_t mss, uint32_t una){
+    TRACE_EVENT(LOG_LEVEL_INFO, TRACE_MSS, socket->sd, una, 0, socket->mss, mss);
+    socket->mss = mss;
+}
+
+/*
+ * Packetization layer path MTU discovery (RFC 4821, RFC 8899), a binary
+ * search between mss, which is known to go through, and pmtu_high, which
+ * is not. Probes are ordinary data segments of the probed size, so a lost
+ * probe is sent again like any other segment.
+ * Returns the size of the next probe or 0 if none is due.
+ */
+static size_t pmtuProbeSize(microtcp_sock_t *socket){
+    if (socket->mss >= socket->max_mss || io_now_us() < socket->pmtu_probe_us)
+        return 0;
+    if (socket->pmtu_high <= socket->mss + PMTU_MIN_STEP)
+        socket->pmtu_high = socket->max_mss + 1; /* The raise timer expired, the path may have changed */
+    return (socket->mss + socket->pmtu_high) / 2;
+}
+
+static void pmtuProbeDone(microtcp_sock_t *socket, size_t size, int acked, uint32_t una){
+    if (acked)
+        setMss(socket, size, una);
+    else
+        socket->pmtu_high = size;
+    /* Keep searching right away, or look again after a while once the search is over */
+    socket->pmtu_probe_us = socket->pmtu_high <= socket->mss + PMTU_MIN_STEP ? io_now_us() + MICROTCP_PMTU_RAISE_US : 0;
+}
+
+/*
+ * Large segments keep getting lost, maybe the path cannot carry them. The
+ * first fallback is MICROTCP_MSS, if that is lost too PMTU_FLOOR, and the
+ * search goes up again from there.
+ */
+static void pmtuBlackHole(microtcp_sock_t *socket, uint32_t una){
+    size_t base = min(MICROTCP_MSS, socket->max_mss);
+
+    if (socket->mss <= base)
+        base = min(PMTU_FLOOR, socket->max_mss);
+    if (socket->mss <= base)
+        return;
+    socket->pmtu_high = socket->mss;
+    socket->pmtu_probe_us = 0;
+    setMss(socket, base, una);
+}
+
+/*
+ * A part of the data of sendStream(), which are the held back bytes
+ * followed by the buffer. A part that spans both is copied to scratch.
+ */
+static const uint8_t *streamBytes(const uint8_t *held, size_t heldLen, const uint8_t *buffer,
+                                  size_t offset, size_t length, uint8_t *scratch){
+    if (offset >= heldLen)
+        return buffer + (offset - heldLen);
+    if (offset + length <= heldLen)
+        return held + offset;
+    memcpy(scratch, held + offset, heldLen - offset);
+    memcpy(scratch + (heldLen - offset), buffer, length - (heldLen - offset));
+    return scratch;
+}
+
+/* Moves ack_number past the messages that were delivered out of order and are now contiguous */
+static void advanceMessages(microtcp_sock_t *socket){
+    struct microtcp_messages *m = socket->messages;
+    int i, j = 0;
+    int moved = 1;
+
+    while (moved){
+        moved = 0;
+        for (i = 0; i < m->ooo_count; i++){
+            if (m->ooo_start[i] == socket->ack_number){
+                socket->ack_number = m->ooo_end[i];
+                moved = 1;
+            }
+        }
+    }
+    for (i = 0; i < m->ooo_count; i++){
+        if (SEQ_GT(m->ooo_end[i], socket->ack_number)){
+            m->ooo_start[j] = m->ooo_start[i];
+            m->ooo_end[j] = m->ooo_end[i];
+            j++;
+        }
+    }
+    m->ooo_count = j;
+}
+
+/* Keeps a copy of a new message of the peer for the repair of its block */
+static void fecRemember(microtcp_sock_t *socket, const uint8_t *segment){
+    struct microtcp_fec *f = socket->fec;
+    struct microtcp_fec_entry *e = &f->cache[f->next_entry];
+    const microtcp_header_t *h = (const microtcp_header_t *)segment;
+    size_t length = ntohl(h->data_len);
+    uint8_t *data;
+
+    if (e->capacity < length){
+        data = realloc(e->data, length);
+        if (data == NULL)
+            return; /* Its block cannot be repaired, the sender will send it again */
+        e->data = data;
+        e->capacity = length;
+    }
+    e->seq = ntohl(h->seq_number);
+    e->length = length;
+    e->offset = ntohl(h->future_use1);
+    e->stream = ntohl(h->future_use2);
+    memcpy(e->data, segment + sizeof(microtcp_header_t), length);
+    f->next_entry = (f->next_entry + 1) % FEC_CACHE_LEN;
+}
+
+/*
+ * Rebuilds in place the message of the block of a repair segment that is
+ * missing, if only one is. Returns 1 if segment now holds the message.
+ */
+static int fecRebuild(microtcp_sock_t *socket, uint8_t *segment){
+    struct microtcp_fec *f = socket->fec;
+    struct microtcp_fec_entry *e;
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    uint8_t *data = segment + sizeof(microtcp_header_t);
+    uint32_t start = ntohl(h->seq_number);
+    uint32_t end = ntohl(h->future_use1);
+    uint32_t missing = start;
+    uint32_t word;
+    size_t parityLen = ntohl(h->data_len);
+    size_t prefix = socket->streams ? FEC_STREAM_PREFIX : 0;
+    size_t covered = 0;
+    size_t length, i;
+    int found = 0;
+    int moved = 1;
+    int j;
+
+    if (!SEQ_GT(end, socket->ack_number) || parityLen < prefix)
+        return 0; /* Everything before end has arrived or was abandoned */
+    for (j = 0; j < FEC_CACHE_LEN; j++){
+        e = &f->cache[j];
+        if (e->length == 0 || SEQ_LT(e->seq, start) || !SEQ_LT(e->seq, end))
+            continue;
+        if (prefix + e->length > parityLen)
+            return 0;
+        if (prefix){
+            word = htonl(e->offset);
+            for (i = 0; i < sizeof(uint32_t); i++)
+                data[i] ^= ((uint8_t *)&word)[i];
+            word = htonl(e->stream);
+            for (i = 0; i < sizeof(uint32_t); i++)
+                data[sizeof(uint32_t) + i] ^= ((uint8_t *)&word)[i];
+        }
+        for (i = 0; i < e->length; i++)
+            data[prefix + i] ^= e->data[i];
+        covered += e->length;
+        found++;
+    }
+    if ((uint32_t)found + 1 != ntohl(h->future_use2))
+        return 0; /* Nothing is missing, or too much to rebuild */
+
+    /* The missing message is the gap the others leave */
+    while (moved){
+        moved = 0;
+        for (j = 0; j < FEC_CACHE_LEN; j++){
+            e = &f->cache[j];
+            if (e->length > 0 && e->seq == missing && SEQ_LT(missing, end)){
+                missing += e->length;
+                moved = 1;
+            }
+        }
+    }
+    length = (end - start) - covered;
+    if (length == 0 || prefix + length > parityLen)
+        return 0;
+    h->seq_number = htonl(missing);
+    h->data_len = htonl(length);
+    h->future_use0 = SEG_RECOVERED;
+    h->future_use1 = 0;
+    h->future_use2 = 0;
+    if (prefix){
+        memcpy(&h->future_use1, data, sizeof(uint32_t));
+        memcpy(&h->future_use2, data + sizeof(uint32_t), sizeof(uint32_t));
+        memmove(data, data + prefix, length);
+    }
+    return 1;
+}
+
+/*
+ * Takes a message of the peer in message mode and acknowledges it.
+ * Returns 1 if it is new and should be delivered, 0 if it is a duplicate
+ * or there is no room to remember it.
+ */
+static int receiveMessage(microtcp_sock_t *socket, uint8_t *segment, int room){
+    struct microtcp_messages *m = socket->messages;
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    uint32_t seq = ntohl(h->seq_number);
+    uint32_t end = seq + ntohl(h->data_len);
+    int isNew = SEQ_GT(end, socket->ack_number);
+    int i;
+
+    for (i = 0; i < m->ooo_count && isNew; i++)
+        if (m->ooo_start[i] == seq)
+            isNew = 0;
+    if (isNew){
+        if (!room || (seq != socket->ack_number && m->ooo_count == MAX_OOO_MESSAGES))
+            return 0; /* Not acknowledged, the peer will send it again */
+        if (seq == socket->ack_number){
+            socket->ack_number = end;
+            advanceMessages(socket);
+        }
+        else{
+            m->ooo_start[m->ooo_count] = seq;
+            m->ooo_end[m->ooo_count] = end;
+            m->ooo_count++;
+        }
+        socket->bytes_received += end - seq;
+        if (socket->fec)
+            fecRemember(socket, segment);
+        if (h->future_use0 & SEG_RECOVERED)
+            socket->fec_recovered++;
+    }
+    /* The sender counts a rebuilt message as lost when it estimates the loss rate */
+    sendSegmentExtra(socket, socket->seq_number, ACK, NULL, 0,
+                     SEG_SACK | (isNew ? h->future_use0 & SEG_RECOVERED : 0), htonl(seq), 0);
+    return isNew;
+}
+
+/* Room for length more bytes after the data in recvbuf, moving them to its start if needed */
+static uint8_t *recvbufTail(microtcp_sock_t *socket, size_t length){
+    if (socket->buf_start + socket->buf_fill_level + length > socket->recvbuf_len){
+        memmove(socket->recvbuf, socket->recvbuf + socket->buf_start, socket->buf_fill_level);
+        socket->buf_start = 0;
+    }
+    return socket->recvbuf + socket->buf_start + socket->buf_fill_level;
+}
+
+/*
+ * Called when the application has taken data. Once the window has opened
+ * by enough to be worth a segment of the peer (RFC 1122 4.2.3.3), an ACK
+ * tells the peer about it.
+ */
+static void windowUpdate(microtcp_sock_t *socket){
+    if (socket->flow_control && socket->state == ESTABLISHED
+        && freeSpace(socket) >= socket->advertised_window + min(socket->recvbuf_len / 2, socket->mss)){
+        socket->window_updates++;
+        sendAck(socket);
+    }
+}
+
+/* Removes length bytes from the start of the data in recvbuf */
+static void consumeRecvbuf(microtcp_sock_t *socket, size_t length){
+    socket->buf_fill_level -= length;
+    socket->buf_start = socket->buf_fill_level > 0 ? socket->buf_start + length : 0;
+    windowUpdate(socket);
+}
+
+/*
+ * Takes a message of a multiplexed connection and keeps its data with its
+ * stream in offset order. The data of a stream behind a lost message wait
+ * for it, those of the other streams do not.
+ */
+static void receiveStreamData(microtcp_sock_t *socket, uint8_t *segment){
+    struct microtcp_streams *st = socket->streams;
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    size_t length = ntohl(h->data_len);
+    uint32_t id = ntohl(h->future_use2);
+    struct microtcp_chunk *chunk = NULL;
+    struct microtcp_chunk **pos;
+
+    /* Room for one message past the window, the one a sender with nothing in flight may send */
+    if (id < MICROTCP_MAX_STREAMS && st->buffered + length <= socket->recvbuf_len + socket->mss)
+        chunk = malloc(sizeof(struct microtcp_chunk) + length);
+    if (!receiveMessage(socket, segment, chunk != NULL)){
+        free(chunk);
+        return;
+    }
+    chunk->offset = ntohl(h->future_use1);
+    chunk->start = 0;
+    chunk->length = length;
+    memcpy(chunk->data, segment + sizeof(microtcp_header_t), length);
+    for (pos = &st->stream[id].chunks; *pos != NULL && SEQ_LT((*pos)->offset, chunk->offset); pos = &(*pos)->next)
+        ;
+    chunk->next = *pos;
+    *pos = chunk;
+    st->buffered += length;
+}
+
+/*
+ * Handles a segment of the peer that is not an ACK for our data: data,
+ * FIN or a retransmitted SYN_ACK. In order data are kept in recvbuf until
+ * microtcp_recv() asks for them.
+ * Returns 1 if the segment was consumed or 0 if the sender should look at it.
+ */
+static int handleIncoming(microtcp_sock_t *socket, uint8_t *segment){
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    uint32_t seq = ntohl(h->seq_number);
+    size_t length = ntohl(h->data_len);
+    uint32_t messageLength = length;
+    uint8_t *tail;
+
+    if (h->control == SYN_ACK){
+        /* Our last ACK of the handshake got lost */
+        sendAck(socket);
+        return 1;
+    }
+    if (socket->messages && (h->future_use0 & SEG_REPAIR)){
+        /* A lost message rebuilt from the repair is handled as if it had arrived */
+        if (socket->fec && fecRebuild(socket, segment))
+            return handleIncoming(socket, segment);
+        return 1;
+    }
+    if (socket->messages && (h->future_use0 & SEG_FORWARD)){
+        /* The peer abandoned the messages before seq */
+        if (SEQ_GT(seq, socket->ack_number)){
+            socket->ack_number = seq;
+            advanceMessages(socket);
+        }
+        sendAck(socket);
+        return 1;
+    }
+    if (h->control == FIN_ACK){
+        /* In message mode the peer sends its FIN only after all its messages are acknowledged or abandoned */
+        if ((seq == socket->ack_number || (socket->messages && SEQ_GT(seq, socket->ack_number)))
+            && socket->state == ESTABLISHED){
+            socket->ack_number = seq + 1;
+            setState(socket, CLOSING_BY_PEER);
+        }
+        sendAck(socket);
+        return 1;
+    }
+    if (length == 0)
+        return 0;
+
+    if (socket->streams){
+        receiveStreamData(socket, segment);
+        return 1;
+    }
+    if (socket->messages){
+        /* Messages are kept in recvbuf after their length */
+        if (receiveMessage(socket, segment, socket->buf_fill_level + sizeof(uint32_t) + length <= socket->recvbuf_len)){
+            tail = recvbufTail(socket, sizeof(uint32_t) + length);
+            memcpy(tail, &messageLength, sizeof(uint32_t));
+            memcpy(tail + sizeof(uint32_t), segment + sizeof(microtcp_header_t), length);
+            socket->buf_fill_level += sizeof(uint32_t) + length;
+        }
+        return 1;
+    }
+
+    if (seq == socket->ack_number && socket->buf_fill_level + length <= socket->recvbuf_len){
+        memcpy(recvbufTail(socket, length), segment + sizeof(microtcp_header_t), length);
+        socket->buf_fill_level += length;
+        socket->ack_number += length;
+        socket->bytes_received += length;
+    }
+    /* Out of order or no room, ACK what we expect so the peer sends it again */
+    sendAck(socket);
+    return 1;
+}
+
+/* Transmits a queued message again */
+static int resendMessage(microtcp_sock_t *socket, struct microtcp_message *msg, int fast){
+    TRACE_EVENT(LOG_LEVEL_DEBUG, TRACE_RETRANSMIT, socket->sd, msg->seq, 0, msg->length, fast);
+    socket->retransmissions++;
+    socket->packets_lost++;
+    socket->bytes_lost += msg->length;
+    msg->retransmitted = 1;
+    msg->sacks_after = 0;
+    msg->sent_us = io_now_us();
+    return sendSegmentExtra(socket, msg->seq, ACK, msg->data, msg->length, 0, htonl(msg->offset), htonl(msg->stream));
+}
+
+/* Frees the messages at the head of the queue that need nothing more */
+static void popMessages(microtcp_sock_t *socket){
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+
+    while ((msg = m->head) != NULL && (msg->acked || msg->abandoned)){
+        m->head = msg->next;
+        if (m->head == NULL)
+            m->tail = NULL;
+        m->queued--;
+        free(msg);
+    }
+}
+
+/* Where the receiver can move its ack_number to, skipping the abandoned messages */
+static uint32_t forwardPoint(microtcp_sock_t *socket){
+    return socket->messages->head ? socket->messages->head->seq : socket->seq_number;
+}
+
+static int sendForward(microtcp_sock_t *socket){
+    return sendSegmentExtra(socket, forwardPoint(socket), ACK, NULL, 0, SEG_FORWARD, 0, 0);
+}
+
+/* Abandons the messages whose lifetime is over */
+static void expireMessages(microtcp_sock_t *socket, uint64_t now){
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+    int expired = 0;
+
+    for (msg = m->head; msg != NULL; msg = msg->next){
+        if (!msg->acked && !msg->abandoned && msg->deadline_us != 0 && now >= msg->deadline_us){
+            msg->abandoned = 1;
+            socket->flight_size -= msg->length;
+            socket->messages_expired++;
+            expired = 1;
+        }
+    }
+    popMessages(socket);
+    if (expired && SEQ_GT(forwardPoint(socket), m->una))
+        sendForward(socket);
+}
+
+/*
+ * Whether a message that a later one overtook may still be rebuilt by the
+ * peer, so its loss is not counted yet. That is until its repair segment
+ * is sent and a message after its block is acknowledged.
+ */
+static int fecWaits(struct microtcp_message *msg, uint32_t sacked){
+    return msg->fec == FEC_OPEN || (msg->fec == FEC_REPAIRED && SEQ_LT(sacked, msg->repair_end));
+}
+
+/*
+ * Counts an acknowledged message for the loss estimate, and adapts the
+ * block size to it every FEC_ADAPT_MESSAGES: one repair segment per
+ * 1 / (4 * loss) messages, so that a block rarely loses more than the one
+ * message the repair can rebuild.
+ */
+static void fecCountLoss(microtcp_sock_t *socket, int lost){
+    struct microtcp_fec *f = socket->fec;
+    int block;
+
+    f->acked++;
+    f->lost += lost;
+    if (f->acked < FEC_ADAPT_MESSAGES)
+        return;
+    f->loss = 0.75 * f->loss + 0.25 * f->lost / f->acked;
+    block = f->loss * 4 * f->max_block > 1 ? (int)(1 / (4 * f->loss)) : f->max_block;
+    f->block = max(1, min(block, f->max_block));
+    f->acked = 0;
+    f->lost = 0;
+}
+
+/* Sends the repair segment of the open block */
+static int fecRepair(microtcp_sock_t *socket){
+    struct microtcp_fec *f = socket->fec;
+    struct microtcp_message *msg;
+    int result;
+
+    for (msg = socket->messages->head; msg != NULL; msg = msg->next){
+        if (msg->fec == FEC_OPEN){
+            msg->fec = FEC_REPAIRED;
+            msg->repair_end = socket->seq_number;
+        }
+    }
+    result = sendSegmentExtra(socket, f->block_start, ACK, f->parity, f->parity_len,
+                              SEG_REPAIR, htonl(socket->seq_number), htonl(f->count));
+    socket->fec_repairs++;
+    memset(f->parity, 0, f->parity_len);
+    f->parity_len = 0;
+    f->count = 0;
+    return result;
+}
+
+/* Adds a new message to the open block, which is repaired once it is full */
+static int fecProtect(microtcp_sock_t *socket, struct microtcp_message *msg){
+    struct microtcp_fec *f = socket->fec;
+    size_t prefix = socket->streams ? FEC_STREAM_PREFIX : 0;
+    uint32_t word;
+    size_t i;
+
+    if (f->count == 0){
+        f->block_start = msg->seq;
+        f->opened_us = msg->sent_us;
+    }
+    if (prefix){
+        word = htonl(msg->offset);
+        for (i = 0; i < sizeof(uint32_t); i++)
+            f->parity[i] ^= ((uint8_t *)&word)[i];
+        word = htonl(msg->stream);
+        for (i = 0; i < sizeof(uint32_t); i++)
+            f->parity[sizeof(uint32_t) + i] ^= ((uint8_t *)&word)[i];
+    }
+    for (i = 0; i < msg->length; i++)
+        f->parity[prefix + i] ^= msg->data[i];
+    f->parity_len = max(f->parity_len, prefix + msg->length);
+    msg->fec = FEC_OPEN;
+    if (++f->count >= f->block)
+        return fecRepair(socket);
+    return 0;
+}
+
+/* A block that stays open this long is repaired as it is, the peer should not wait for the rest */
+static uint64_t fecDelay(microtcp_sock_t *socket){
+    return (socket->srtt_us ? socket->srtt_us : socket->rto_us) / 4;
+}
+
+/*
+ * Loss detection of message mode. A message is lost once a message sent
+ * after it is acknowledged and its RACK deadline has passed, or once three
+ * later messages are. The RACK timer covers the messages not yet past
+ * their deadline. Every lost message is sent again at once, and cwnd is
+ * reduced once per window.
+ */
+static void messageRack(microtcp_sock_t *socket, uint64_t now){
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+    uint64_t deadline;
+
+    m->rack_us = 0;
+    for (msg = m->head; msg != NULL; msg = msg->next){
+        if (msg->acked || msg->abandoned || fecWaits(msg, m->rack_sacked))
+            continue;
+        /* Only messages sent before the latest one delivered, ties broken by sequence */
+        if (msg->sent_us > m->rack_sent_us || (msg->sent_us == m->rack_sent_us && !SEQ_LT(msg->seq, m->rack_seq)))
+            continue;
+        deadline = rackDeadline(socket, msg->sent_us);
+        if (msg->sacks_after < 3 && (socket->srtt_us == 0 || now < deadline)){
+            if (socket->srtt_us > 0 && (m->rack_us == 0 || deadline < m->rack_us))
+                m->rack_us = deadline;
+            continue;
+        }
+        if (SEQ_GEQ(msg->seq, m->recover)){
+            socket->ssthresh = max(socket->flight_size / 2, 2 * socket->mss);
+            socket->cwnd = socket->ssthresh;
+            m->recover = socket->seq_number;
+            traceCwnd(socket, m->una);
+        }
+        resendMessage(socket, msg, 1);
+    }
+}
+
+/* Processes an ACK of the peer in message mode */
+static void messageAck(microtcp_sock_t *socket, microtcp_header_t *h){
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+    uint32_t ack = ntohl(h->ack_number);
+    uint32_t sacked = ntohl(h->future_use1);
+    int isSack = (h->future_use0 & SEG_SACK) != 0;
+    uint64_t now = io_now_us();
+    size_t acked = 0;
+
+    if (socket->flow_control && SEQ_GEQ(ack, m->una) && SEQ_LEQ(ack, socket->seq_number))
+        socket->curr_win_size = (size_t)ntohs(h->window) << WINDOW_SHIFT;
+    if (SEQ_GT(ack, m->una) && SEQ_LEQ(ack, socket->seq_number)){
+        m->una = ack;
+        m->timer_us = now;
+        m->timeouts = 0;
+    }
+    for (msg = m->head; msg != NULL; msg = msg->next){
+        if (msg->acked || msg->abandoned)
+            continue;
+        if (SEQ_LEQ(msg->seq + msg->length, m->una) || (isSack && msg->seq == sacked)){
+            msg->acked = 1;
+            acked += msg->length;
+            socket->flight_size -= msg->length;
+            /* An ACK sooner than any RTT after a retransmission is for the original (RFC 8985 6.2) */
+            if ((!msg->retransmitted || now - msg->sent_us >= socket->min_rtt_us)
+                && (msg->sent_us > m->rack_sent_us || (msg->sent_us == m->rack_sent_us && SEQ_GT(msg->seq, m->rack_seq)))){
+                m->rack_sent_us = msg->sent_us;
+                m->rack_seq = msg->seq;
+            }
+            if (isSack && msg->seq == sacked && (h->future_use0 & SEG_RECOVERED)){
+                /* Lost all the same, the loss tells about congestion like a fast retransmit */
+                msg->retransmitted = 1;
+                if (SEQ_GEQ(msg->seq, m->recover)){
+                    socket->ssthresh = max(socket->flight_size / 2, 2 * socket->mss);
+                    socket->cwnd = socket->ssthresh;
+                    m->recover = socket->seq_number;
+                    traceCwnd(socket, m->una);
+                }
+            }
+            if (socket->fec)
+                fecCountLoss(socket, msg->retransmitted);
+            if (!msg->retransmitted)
+                updateRtt(socket, now - msg->sent_us);
+        }
+        else if (isSack && SEQ_LT(msg->seq, sacked) && !fecWaits(msg, sacked))
+            msg->sacks_after++;
+    }
+    if (isSack && SEQ_GT(sacked, m->rack_sacked))
+        m->rack_sacked = sacked;
+    messageRack(socket, now);
+    if (acked > 0){
+        m->last_us = now;
+        m->probing = 0;
+        if (socket->cwnd < socket->ssthresh)
+            socket->cwnd += min(acked, socket->mss); /* Slow start */
+        else
+            socket->cwnd += max(1, socket->mss * socket->mss / socket->cwnd); /* Congestion avoidance */
+        traceCwnd(socket, m->una);
+    }
+    popMessages(socket);
+}
+
+/* When the tail loss probe of message mode is due, 0 if it is not armed */
+static uint64_t messageProbeAt(microtcp_sock_t *socket){
+    struct microtcp_messages *m = socket->messages;
+
+    if (m->probing || socket->srtt_us == 0 || !SEQ_LT(m->una, socket->seq_number))
+        return 0;
+    return m->last_us + probeTimeout(socket);
+}
+
+/* The retransmission timer of message mode, covers the oldest outstanding message */
+static int messageTimeout(microtcp_sock_t *socket, uint64_t now){
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+    struct microtcp_message *last = NULL;
+
+    if (m->rack_us != 0 && now >= m->rack_us)
+        messageRack(socket, now);
+    if (!SEQ_LT(m->una, socket->seq_number))
+        return 0;
+    if (now - m->timer_us < socket->rto_us){
+        if (messageProbeAt(socket) == 0 || now < messageProbeAt(socket))
+            return 0;
+        /* Tail loss probe: the last message again, its SACK makes RACK find what is missing */
+        for (msg = m->head; msg != NULL; msg = msg->next)
+            if (!msg->acked && !msg->abandoned)
+                last = msg;
+        m->probing = 1;
+        if (last == NULL)
+            return 0;
+        TRACE_EVENT(LOG_LEVEL_DEBUG, TRACE_RETRANSMIT, socket->sd, last->seq, 0, last->length, 2);
+        socket->tail_probes++;
+        last->retransmitted = 1;
+        last->sent_us = now;
+        return sendSegmentExtra(socket, last->seq, ACK, last->data, last->length, 0, htonl(last->offset),
+                                htonl(last->stream));
+    }
+    if (++m->timeouts > MICROTCP_MAX_RETRIES){
+        reportError(socket, "microtcp_send(): the peer does not answer");
+        setState(socket, INVALID);
+        return -1;
+    }
+    socket->ssthresh = max(socket->flight_size / 2, 2 * socket->mss);
+    socket->cwnd = socket->mss;
+    socket->rto_us = min(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+    m->recover = socket->seq_number;
+    m->timer_us = now;
+    traceCwnd(socket, m->una);
+    for (msg = m->head; msg != NULL; msg = msg->next)
+        if (!msg->acked && !msg->abandoned)
+            return resendMessage(socket, msg, 0);
+    /* Only abandoned messages or our last FORWARD are missing */
+    return sendForward(socket);
+}
+
+/*
+ * Processes what the peer sent and the timers of message mode. If wait is
+ * set, waits for a segment up to the next timer.
+ */
+static int pollMessages(microtcp_sock_t *socket, int wait){
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+    uint64_t now = io_now_us();
+    uint64_t timeout = NO_WAIT;
+    ssize_t received;
+    int idle = 0;
+
+    expireMessages(socket, now);
+    if (messageTimeout(socket, now) < 0)
+        return -1;
+    if (socket->fec && socket->fec->count > 0 && now - socket->fec->opened_us >= fecDelay(socket)
+        && fecRepair(socket) < 0){
+        setState(socket, INVALID);
+        return -1;
+    }
+    if (wait && !SEQ_LT(m->una, socket->seq_number)){
+        /* No timer is running, wait for the peer or until the receive buffer is idle */
+        timeout = idleWait(socket);
+        idle = timeout != 0;
+    }
+    else if (wait){
+        timeout = m->timer_us + socket->rto_us > now ? m->timer_us + socket->rto_us - now : 1;
+        for (msg = m->head; msg != NULL; msg = msg->next)
+            if (msg->deadline_us > now && msg->deadline_us - now < timeout)
+                timeout = msg->deadline_us - now;
+        if (socket->fec && socket->fec->count > 0)
+            timeout = min(timeout, max(socket->fec->opened_us + fecDelay(socket) - now, 1));
+        if (m->rack_us != 0)
+            timeout = min(timeout, m->rack_us > now ? m->rack_us - now : 1);
+        if (messageProbeAt(socket) != 0)
+            timeout = min(timeout, messageProbeAt(socket) > now ? messageProbeAt(socket) - now : 1);
+    }
+    while ((received = receiveSegment(socket, segment, timeout)) > 0){
+        if (!handleIncoming(socket, segment) && (h->control & ACK))
+            messageAck(socket, h);
+        timeout = NO_WAIT;
+    }
+    if (received < 0){
+        reportError(socket, "microtcp_send(): %s", strerror(errno));
+        setState(socket, INVALID);
+        return -1;
+    }
+    /* Nothing at all arrived over the whole wait */
+    if (idle && timeout != NO_WAIT)
+        shrinkRecvbuf(socket);
+    sampleStats(socket);
+    return 0;
+}
+
+/*
+ * Whether a message of length bytes has to wait for the window. The peer
+ * also remembers only MAX_OOO_MESSAGES that arrive after a missing one, so
+ * no more are sent past the first one not acknowledged, however small.
+ */
+static int messageWaits(microtcp_sock_t *socket, size_t length){
+    return socket->flight_size > 0 && (socket->flight_size + length > min(socket->cwnd, socket->curr_win_size)
+                                       || socket->messages->queued >= MAX_OOO_MESSAGES);
+}
+
+/* Queues a message for retransmission and sends it, the window has room for it */
+static ssize_t postMessage(microtcp_sock_t *socket, const void *buffer, size_t length, uint64_t lifetime_us,
+                           uint32_t stream, uint32_t offset){
+    struct microtcp_messages *m = socket->messages;
+    struct microtcp_message *msg;
+    uint64_t now;
+
+    msg = malloc(sizeof(struct microtcp_message) + length);
+    if (msg == NULL){
+        reportError(socket, "microtcp_send(): allocating the message");
+        return -1;
+    }
+    now = io_now_us();
+    memset(msg, 0, sizeof(struct microtcp_message));
+    memcpy(msg->data, buffer, length);
+    msg->seq = socket->seq_number;
+    msg->length = length;
+    msg->sent_us = now;
+    msg->deadline_us = lifetime_us ? now + lifetime_us : 0;
+    msg->stream = stream;
+    msg->offset = offset;
+    if (!SEQ_LT(m->una, socket->seq_number))
+        m->timer_us = now; /* Nothing was outstanding */
+    m->last_us = now;
+    if (m->tail)
+        m->tail->next = msg;
+    else
+        m->head = msg;
+    m->tail = msg;
+
+    if (sendSegmentExtra(socket, msg->seq, ACK, msg->data, length, 0, htonl(offset), htonl(stream)) < 0){
+        setState(socket, INVALID);
+        return -1;
+    }
+    socket->seq_number += length;
+    socket->flight_size += length;
+    m->queued++;
+    if (socket->fec && fecProtect(socket, msg) < 0){
+        setState(socket, INVALID);
+        return -1;
+    }
+    return length;
+}
+
+static ssize_t sendMessage(microtcp_sock_t *socket, const void *buffer, size_t length, uint64_t lifetime_us){
+    if (length == 0 || length > socket->mss){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER)
+        return -1;
+
+    /* Wait only while the window is full */
+    if (pollMessages(socket, 0) < 0)
+        return -1;
+    while (messageWaits(socket, length))
+        if (pollMessages(socket, 1) < 0)
+            return -1;
+    return postMessage(socket, buffer, length, lifetime_us, 0, 0);
+}
+
+/* Waits until every message is acknowledged or abandoned */
+static int flushMessages(microtcp_sock_t *socket){
+    while (SEQ_LT(socket->messages->una, socket->seq_number))
+        if (pollMessages(socket, 1) < 0)
+            return -1;
+    return 0;
+}
+
+static void freeMessages(microtcp_sock_t *socket){
+    struct microtcp_message *msg;
+
+    if (socket->messages == NULL)
+        return;
+    while ((msg = socket->messages->head) != NULL){
+        socket->messages->head = msg->next;
+        free(msg);
+    }
+    free(socket->messages);
+    socket->messages = NULL;
+}
+
+/*
+ * Sends the pending data of the streams, a segment of each stream with
+ * data in turn, while the window has room. If wait is set, waits for the
+ * window until everything is sent.
+ */
+static int pumpStreams(microtcp_sock_t *socket, int wait){
+    struct microtcp_streams *st = socket->streams;
+    struct microtcp_stream *s;
+    size_t length;
+    int id;
+
+    if (pollMessages(socket, 0) < 0)
+        return -1;
+    while (st->pending > 0){
+        for (id = st->next_send; st->stream[id].pending_len == 0; id = (id + 1) % MICROTCP_MAX_STREAMS)
+            ;
+        s = &st->stream[id];
+        /* The repair segments of FEC also carry the stream and offset */
+        length = min(s->pending_len, socket->mss - (socket->fec ? FEC_STREAM_PREFIX : 0));
+        if (messageWaits(socket, length)){
+            if (!wait)
+                return 0;
+            if (pollMessages(socket, 1) < 0)
+                return -1;
+            continue;
+        }
+        if (postMessage(socket, s->pending + s->pending_start, length, 0, id, s->send_offset) < 0)
+            return -1;
+        s->send_offset += length;
+        s->pending_start += length;
+        s->pending_len -= length;
+        if (s->pending_len == 0)
+            s->pending_start = 0;
+        st->pending -= length;
+        st->next_send = (id + 1) % MICROTCP_MAX_STREAMS;
+    }
+    return 0;
+}
+
+/* Copies the data of the first stream in turn that has some in order, returns 0 if none has */
+static size_t readStreams(microtcp_sock_t *socket, int *stream, uint8_t *buffer, size_t length){
+    struct microtcp_streams *st = socket->streams;
+    struct microtcp_stream *s = NULL;
+    struct microtcp_chunk *chunk = NULL;
+    size_t copied;
+    int id = *stream;
+    int i;
+
+    for (i = 0; i < MICROTCP_MAX_STREAMS && chunk == NULL; i++){
+        if (*stream == MICROTCP_ANY_STREAM)
+            id = (st->next_read + i) % MICROTCP_MAX_STREAMS;
+        s = &st->stream[id];
+        if (s->chunks != NULL && s->chunks->offset == s->read_offset)
+            chunk = s->chunks;
+        else if (*stream != MICROTCP_ANY_STREAM)
+            return 0;
+    }
+    if (chunk == NULL)
+        return 0;
+
+    copied = min(length, chunk->length);
+    memcpy(buffer, chunk->data + chunk->start, copied);
+    chunk->start += copied;
+    chunk->offset += copied;
+    chunk->length -= copied;
+    s->read_offset += copied;
+    if (chunk->length == 0){
+        s->chunks = chunk->next;
+        free(chunk);
+    }
+    st->buffered -= copied;
+    if (*stream == MICROTCP_ANY_STREAM)
+        st->next_read = (id + 1) % MICROTCP_MAX_STREAMS;
+    *stream = id;
+    windowUpdate(socket);
+    return copied;
+}
+
+static void freeStreams(microtcp_sock_t *socket){
+    struct microtcp_chunk *chunk;
+    int i;
+
+    if (socket->streams == NULL)
+        return;
+    for (i = 0; i < MICROTCP_MAX_STREAMS; i++){
+        free(socket->streams->stream[i].pending);
+        while ((chunk = socket->streams->stream[i].chunks) != NULL){
+            socket->streams->stream[i].chunks = chunk->next;
+            free(chunk);
+        }
+    }
+    free(socket->streams);
+    socket->streams = NULL;
+}
+
+static void freeFec(microtcp_sock_t *socket){
+    int i;
+
+    if (socket->fec == NULL)
+        return;
+    for (i = 0; i < FEC_CACHE_LEN; i++)
+        free(socket->fec->cache[i].data);
+    free(socket->fec);
+    socket->fec = NULL;
+}
+
+/* The snapshot of microtcp_get_stats() */
+static void copyStats(const microtcp_sock_t *socket, microtcp_stats_t *stats){
+    stats->state = socket->state;
+    stats->packets_send = socket->packets_send;
+    stats->packets_received = socket->packets_received;
+    stats->packets_lost = socket->packets_lost;
+    stats->bytes_send = socket->bytes_send;
+    stats->bytes_received = socket->bytes_received;
+    stats->bytes_lost = socket->bytes_lost;
+    stats->retransmissions = socket->retransmissions;
+    stats->tail_probes = socket->tail_probes;
+    stats->dup_acks = socket->dup_acks;
+    stats->messages_expired = socket->messages_expired;
+    stats->segments_predicted = socket->segments_predicted;
+    stats->window_probes = socket->window_probes;
+    stats->window_updates = socket->window_updates;
+    stats->fec_repairs = socket->fec_repairs;
+    stats->fec_recovered = socket->fec_recovered;
+    stats->srtt_us = socket->srtt_us;
+    stats->rttvar_us = socket->rttvar_us;
+    stats->rto_us = socket->rto_us;
+    stats->send_rate = socket->send_rate;
+    stats->receive_rate = socket->receive_rate;
+    stats->warm_start = socket->warm_start;
+    stats->cwnd = socket->cwnd;
+    stats->ssthresh = socket->ssthresh;
+    stats->flight_size = socket->flight_size;
+    stats->curr_win_size = socket->curr_win_size;
+    stats->flow_control = socket->flow_control;
+    stats->checksum = socket->checksum;
+    stats->mss = socket->mss;
+    stats->max_mss = socket->max_mss;
+    stats->io_uring = socket->use_uring;
+    stats->busy_poll_cpu_us = socket->busy_poll_cpu_us;
+    stats->busy_poll_hits = socket->busy_poll_hits;
+    stats->busy_poll_misses = socket->busy_poll_misses;
+    stats->fec_block = socket->fec ? socket->fec->block : 0;
+    stats->recvbuf_len = socket->recvbuf_len;
+    stats->recvbuf_grown = socket->recvbuf_grown;
+    stats->recvbuf_shrunk = socket->recvbuf_shrunk;
+}
+
+/* Waits until the sender thread has sent everything in the send buffer and has exited */
+static int drainSendBuffer(microtcp_sock_t *socket){
+    struct microtcp_sendbuf *sb = socket->sendbuf;
+
+    if (sb == NULL || !sb->running)
+        return 0;
+    pthread_mutex_lock(&sb->lock);
+    sb->closing = 1;
+    pthread_cond_broadcast(&sb->cond);
+    pthread_mutex_unlock(&sb->lock);
+    pthread_join(sb->thread, NULL);
+    sb->running = 0;
+    sb->closing = 0;
+    return sb->failed ? -1 : 0;
+}
+
+static int freeSendBuffer(microtcp_sock_t *socket){
+    struct microtcp_sendbuf *sb = socket->sendbuf;
+    int result;
+
+    if (sb == NULL)
+        return 0;
+    result = drainSendBuffer(socket);
+    pthread_mutex_destroy(&sb->lock);
+    pthread_cond_destroy(&sb->cond);
+    free(sb->data);
+    free(sb);
+    socket->sendbuf = NULL;
+    return result;
+}
+
+/* microtcp_recv() in message mode */
+static ssize_t recvMessage(microtcp_sock_t *socket, void *buffer, size_t length){
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    ssize_t received;
+    uint32_t messageLength;
+    size_t copied;
+
+    /* Messages that arrived while we were sending */
+    if (socket->buf_fill_level > 0){
+        memcpy(&messageLength, socket->recvbuf + socket->buf_start, sizeof(uint32_t));
+        copied = min(length, messageLength);
+        memcpy(buffer, socket->recvbuf + socket->buf_start + sizeof(uint32_t), copied);
+        consumeRecvbuf(socket, sizeof(uint32_t) + messageLength);
+        return copied;
+    }
+    if (socket->state != ESTABLISHED)
+        return -1; /* The peer has closed the connection */
+
+    while (TRUE){
+        received = receiveSegment(socket, segment, idleWait(socket));
+        if (received < 0){
+            reportError(socket, "microtcp_recv(): %s", strerror(errno));
+            return -1;
+        }
+        if (received == 0){
+            shrinkRecvbuf(socket);
+            continue;
+        }
+        if (received > (ssize_t)sizeof(microtcp_header_t) && !(h->future_use0 & SEG_REPAIR)){
+            if (!receiveMessage(socket, segment, 1))
+                continue;
+            copied = min(length, received - sizeof(microtcp_header_t));
+            memcpy(buffer, segment + sizeof(microtcp_header_t), copied);
+            sampleStats(socket);
+            return copied;
+        }
+        if (!handleIncoming(socket, segment) && (h->control & ACK))
+            messageAck(socket, h);
+        if (socket->buf_fill_level > 0)
+            return recvMessage(socket, buffer, length);
+        if (socket->state == CLOSING_BY_PEER)
+            return -1;
+    }
+}
+
 microtcp_sock_t microtcp_socket(int domain, int type, int protocol){
     microtcp_sock_t new_socket;
-    new_socket.sd = socket(domain, type, protocol); /* sd is the underline UDP socket descriptor */
+    int pmtuDiscover = IP_PMTUDISC_PROBE;
+    memset(&new_socket, 0, sizeof(microtcp_sock_t));
+#ifdef MICROTCP_URING
+    type |= MICROTCP_SOCK_URING;
+#endif
+#ifdef MICROTCP_SYSCALL_IO
+    type &= ~MICROTCP_SOCK_URING;
+#endif
+    new_socket.use_uring = (type & MICROTCP_SOCK_URING) != 0;
+    type &= ~MICROTCP_SOCK_URING;
+#ifdef MICROTCP_FIXED_CHECKSUM
+    new_socket.checksum = SOCKET_CHECKSUM(&new_socket);
+#endif
+    new_socket.sd = io_socket(domain, type, protocol); /* sd is the underline UDP socket descriptor */
     if (new_socket.sd != -1){
         new_socket.state = UNKNOWN;                   /* Initialize the socket state as UNKNOWN */
         new_socket.init_win_size = MICROTCP_WIN_SIZE; /* The window size negotiated at the 3-way handshake */
         new_socket.curr_win_size = MICROTCP_WIN_SIZE; /* The current window size */
         new_socket.cwnd = MICROTCP_INIT_CWND;         /* Congestion Window = 4200 */
         new_socket.ssthresh = MICROTCP_INIT_SSTHRESH; /* ssthresh = 8192 */
+        new_socket.rto_us = MICROTCP_ACK_TIMEOUT_US;
+        new_socket.mss = MICROTCP_MSS;                /* Until the handshake agrees on one */
+        new_socket.max_mss = MICROTCP_MSS;
+        new_socket.recvbuf_len = MICROTCP_RECVBUF_LEN;
+        new_socket.autotune = 1;
+        new_socket.metrics = 1;
+        /* Set DF but ignore ICMP, the path MTU is found by probing */
+        if (domain == AF_INET)
+            io_setsockopt(new_socket.sd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtuDiscover, sizeof(int));
     }
     else{
-        perror("Error in mircotcp_socket()\n");
+        LOG_ERROR("microtcp_socket(): %s", strerror(errno));
         new_socket.state = INVALID;
     }
     return new_socket;
@@ -39,401 +1845,1265 @@ microtcp_sock_t microtcp_socket(int domain, int type, int protocol){
 
 /* returns 0 on success or -1 on failure. */
 int microtcp_bind(microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
-    int result = bind(socket->sd, address, address_len); /* Result is either 0 or -1 */
+    int result = io_bind(socket->sd, address, address_len); /* Result is either 0 or -1 */
     if (result == -1){
-        perror("Error in microtcp_bind()\n");
-        socket->state = INVALID;
+        reportError(socket, "microtcp_bind(): %s", strerror(errno));
+        setState(socket, INVALID);
     }
     return result;
 }
 
 /* Client. Attempts to connect to server. Returns 0 on success or -1 on failure. */
 int microtcp_connect(microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
-    // if(socket->state != UNKNOWN) return -1;
-    microtcp_header_t sendToServer, receiveFromServer;
-    int isPacketSent, isPacketReceived;
-    socket->address = address;
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *receiveFromServer = (microtcp_header_t *)segment;
+    ssize_t isPacketReceived;
+    uint32_t isn, offer, options;
+    size_t mss;
+    int tries = 0;
+    uint64_t synSent;
+
+    socket->address = (struct sockaddr *)address;
     socket->size = address_len;
+    socket->buf_start = 0;
+    socket->buf_fill_level = 0;
+    if (resizeRecvbuf(socket, MICROTCP_RECVBUF_LEN) < 0){
+        reportError(socket, "microtcp_connect(): allocating the receive buffer");
+        setState(socket, INVALID);
+        return -1;
+    }
 
     /* Creating and sending the first SYN packet to the server */
-    int N = getRandom(500);
-    initializeHeader(&sendToServer, htons(N), 0, SYN, 0, 0, 0, 0, 0);
-    isPacketSent = sendto(socket->sd, (void *)&sendToServer, sizeof(microtcp_header_t), 0, address, address_len);
-    if (isPacketSent == -1){
-        perror("Error in microtcp_connect(), while sending the 1st packet.\n");
-        socket->state = INVALID;
+    isn = io_random();
+    socket->seq_number = isn;
+    socket->ack_number = 0;
+#ifdef MICROTCP_FIXED_CHECKSUM
+    offer = htonl(CHECKSUM_BIT(SOCKET_CHECKSUM(socket))); /* The only one we speak */
+#else
+    offer = htonl(CHECKSUM_BIT(MICROTCP_CHECKSUM_CRC32) | CHECKSUM_BIT(socket->checksum));
+#endif
+    mss = localMss(socket);
+    options = (socket->messages ? OPT_MESSAGES : 0) | (socket->streams ? OPT_STREAMS : 0)
+              | (socket->fec ? OPT_FEC : 0) | OPT_WINDOW;
+    if (sendSegmentExtra(socket, isn, SYN, NULL, 0, options, offer, htonl(mss)) < 0){
+        reportError(socket, "microtcp_connect(): sending the SYN");
+        setState(socket, INVALID);
         return -1;
     }
+    synSent = io_now_us();
 
-    printf("\nClient: We just sent an SYN to server\n");
+    /* Waiting a response SYN_ACK packet from server, the SYN is sent again on timeout */
+    while (TRUE){
+        isPacketReceived = receiveSegment(socket, segment, socket->rto_us);
+        if (isPacketReceived < 0){
+            reportError(socket, "microtcp_connect(): receiving from the server: %s", strerror(errno));
+            setState(socket, INVALID);
+            return -1;
+        }
+        if (isPacketReceived == 0){
+            if (++tries > MICROTCP_MAX_RETRIES){
+                reportError(socket, "microtcp_connect(): the server does not answer");
+                setState(socket, INVALID);
+                return -1;
+            }
+            socket->rto_us = min(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+            sendSegmentExtra(socket, isn, SYN, NULL, 0, options, offer, htonl(mss));
+            continue;
+        }
+        if (receiveFromServer->control == SYN_ACK && ntohl(receiveFromServer->ack_number) == isn + 1)
+            break;
+    }
+    /* Not from a SYN sent again, its SYN_ACK cannot be told apart (Karn) */
+    if (tries == 0)
+        socket->handshake_rtt_us = io_now_us() - synSent;
 
-    /* Waiting a response SYN_ACK packet from server */
-    isPacketReceived = recvfrom(socket->sd, &receiveFromServer, sizeof(microtcp_header_t), 0, address, &address_len);
-    if (isPacketReceived == -1){
-        perror("Error in microtcp_connect(), while receiving packet from server.\n");
-        socket->state = INVALID;
+    /* The server answers with the option if either side asked for message mode */
+    if (!(receiveFromServer->future_use0 & OPT_MESSAGES))
+        freeMessages(socket);
+    else if (socket->messages == NULL && microtcp_set_message_mode(socket, 0) < 0){
+        setState(socket, INVALID);
         return -1;
     }
-    if (hasValidCheckSum(&receiveFromServer) != 0){
-        socket->state = INVALID;
-        perror("Error on checksum in microtcp_connect()\n");
+    if (!(receiveFromServer->future_use0 & OPT_STREAMS))
+        freeStreams(socket);
+    else if (socket->streams == NULL && microtcp_set_streams(socket) < 0){
+        setState(socket, INVALID);
         return -1;
     }
-    if (receiveFromServer.control != SYN_ACK){
-        socket->state = INVALID;
-        perror("The recieved packet should be SYN_ACK.\n");
+    if (!(receiveFromServer->future_use0 & OPT_FEC))
+        freeFec(socket);
+    else if (socket->fec == NULL && microtcp_set_fec(socket, MICROTCP_FEC_BLOCK) < 0){
+        setState(socket, INVALID);
         return -1;
     }
 
-    /* Sending the last ACK packet to establish te connection.  */
-    initializeHeader(&sendToServer, receiveFromServer.ack_number, htons(ntohl(receiveFromServer.seq_number) + 1), ACK, 0, 0, 0, 0, 0); //check the window!!!
-    isPacketSent = sendto(socket->sd, (void *)&sendToServer, sizeof(microtcp_header_t), 0, address, address_len);
-    if (isPacketSent == -1){
-        perror("Error in microtcp_connect(), while sending the 2nd packet.\n");
-        socket->state = INVALID;
+    /*
+     * The checksum the server chose, a server that does not know the option
+     * sends 0 (CRC-32). Anything we did not offer, a buggy or hostile server
+     * turning off the integrity check for instance, fails the handshake.
+     */
+    socket->checksum = ntohl(receiveFromServer->future_use1);
+    if (socket->checksum >= MICROTCP_CHECKSUM_COUNT || !(ntohl(offer) & CHECKSUM_BIT(socket->checksum))){
+        reportError(socket, "microtcp_connect(): the server chose checksum %d, which was not offered", socket->checksum);
+        setState(socket, INVALID);
         return -1;
     }
-    else{
-        printf("Client: We just sent an ACK to server as an answer to SYN,ACK\n");
-        socket->ack_number = ntohl(sendToServer.ack_number);
-        socket->seq_number = ntohl(sendToServer.seq_number);
-        socket->state = ESTABLISHED;
-        printf("Connection set to established (done from client)!\n\n");
-        return 0; /* success */
+
+    /* The segment size of the server is in future_use2 */
+    if (useMss(socket, mss, ntohl(receiveFromServer->future_use2)) < 0){
+        setState(socket, INVALID);
+        return -1;
+    }
+
+    /* A server that knows flow control answers with the option and its window */
+    socket->flow_control = (receiveFromServer->future_use0 & OPT_WINDOW) != 0;
+    if (socket->flow_control)
+        socket->curr_win_size = (size_t)ntohs(receiveFromServer->window) << WINDOW_SHIFT;
+
+    /* Sending the last ACK packet to establish te connection.  */
+    socket->seq_number = isn + 1;
+    socket->ack_number = ntohl(receiveFromServer->seq_number) + 1;
+    if (socket->messages){
+        socket->messages->una = socket->seq_number;
+        socket->messages->rack_sacked = socket->seq_number;
+    }
+    if (sendAck(socket) < 0){
+        reportError(socket, "microtcp_connect(): sending the ACK of the SYN_ACK");
+        setState(socket, INVALID);
+        return -1;
     }
+    setState(socket, ESTABLISHED);
+    return 0; /* success */
 }
 
 /* Server. Waits for client to connect. Returns 0 on success or -1 on failure. */
 int microtcp_accept(microtcp_sock_t *socket, struct sockaddr *address, socklen_t address_len){
-    int isPacketSent, isPacketReceived;
-    microtcp_header_t sendToClient;
-    microtcp_header_t receiveFromClient;
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *receiveFromClient = (microtcp_header_t *)segment;
+    ssize_t isPacketReceived;
+    uint32_t isn;
+    uint32_t options;
+    size_t mss;
+    int tries = 0;
+    int synAcks = 1;
+    uint64_t synAckSent;
+
     socket->address = address;
     socket->size = address_len;
+    socket->buf_start = 0;
+    socket->buf_fill_level = 0;
+    if (resizeRecvbuf(socket, MICROTCP_RECVBUF_LEN) < 0){
+        reportError(socket, "microtcp_accept(): allocating the receive buffer");
+        setState(socket, INVALID);
+        return -1;
+    }
+    setState(socket, LISTEN);
+
+    /* Recieves the first SYN packet from client. Anything else is ignored. */
+    if (setTimeout(socket, 0) < 0){
+        setState(socket, INVALID);
+        return -1;
+    }
+    while (TRUE){
+        socket->size = address_len;
+        isPacketReceived = io_recvfrom(socket->sd, segment, SEGMENT_LEN, 0, address, &socket->size);
+        if (isPacketReceived == -1){
+            reportError(socket, "microtcp_accept(): receiving from the client: %s", strerror(errno));
+            setState(socket, INVALID);
+            return -1;
+        }
+        if (isPacketReceived == sizeof(microtcp_header_t)
+            && hasValidCheckSum(segment, isPacketReceived, MICROTCP_CHECKSUM_CRC32)
+            && receiveFromClient->control == SYN){
+            socket->packets_received++;
+            if (microtcp_capture_active)
+                captureSegment(socket, 0, segment, isPacketReceived);
+            break;
+        }
+    }
 
-    /* Recieves the first SYN packet from client. */
-    isPacketReceived = recvfrom(socket->sd, &receiveFromClient, sizeof(microtcp_header_t), 0, address, &address_len);
-    if (isPacketReceived == -1){
-        perror("Error in microtcp_accept(), while receiving packet from client.\n");
-        socket->state = INVALID;
+    /* Message mode, streams and FEC are used if either side asks for them */
+    if ((receiveFromClient->future_use0 & OPT_MESSAGES) && socket->messages == NULL
+        && microtcp_set_message_mode(socket, 0) < 0){
+        setState(socket, INVALID);
         return -1;
     }
-    if (hasValidCheckSum(&receiveFromClient) != 0){
-        socket->state = INVALID;
-        perror("Error on checksum");
+    if ((receiveFromClient->future_use0 & OPT_STREAMS) && socket->streams == NULL
+        && microtcp_set_streams(socket) < 0){
+        setState(socket, INVALID);
         return -1;
     }
-    if (receiveFromClient.control != SYN){
-        socket->state = INVALID;
-        perror("The received packet should be SYN");
+    if ((receiveFromClient->future_use0 & OPT_FEC) && socket->fec == NULL
+        && microtcp_set_fec(socket, MICROTCP_FEC_BLOCK) < 0){
+        setState(socket, INVALID);
         return -1;
     }
 
-    /* Creates and sends back the SYN_ACK packet to the client. */
-    int N = getRandom(500);
-    initializeHeader(&sendToClient, htons(N), htons(ntohl(receiveFromClient.seq_number) + 1), SYN_ACK, 0, 0, 0, 0, 0); //check the window!!!
-    isPacketSent = sendto(socket->sd, (void *)&sendToClient, sizeof(microtcp_header_t), 0, address, address_len);
-    if (isPacketSent == -1){
-        perror("Error in microtcp_connect(), while sending the 1st packet.\n");
-        socket->state = INVALID;
+    /* Our checksum if the client accepts it too, CRC-32 otherwise */
+    if (!(ntohl(receiveFromClient->future_use1) & CHECKSUM_BIT(socket->checksum)))
+        socket->checksum = MICROTCP_CHECKSUM_CRC32;
+#ifdef MICROTCP_FIXED_CHECKSUM
+    if (socket->checksum != SOCKET_CHECKSUM(socket)){
+        reportError(socket, "microtcp_accept(): the client does not accept checksum %d", SOCKET_CHECKSUM(socket));
+        setState(socket, INVALID);
         return -1;
     }
-    printf("\nServer: We just sent an SYN,ACK to client as an answer to the SYN\n");
+#endif
 
-    /* Recieves the ACK packet from the client. That is the end of our connection. */
-    isPacketReceived = recvfrom(socket->sd, &receiveFromClient, sizeof(microtcp_header_t), 0, address, &address_len);
-    if (isPacketReceived == -1) {
-        perror("Error in microtcp_connect(), while receiving packet from server.\n");
-        socket->state = INVALID;
+    socket->flow_control = (receiveFromClient->future_use0 & OPT_WINDOW) != 0;
+    options = (socket->messages ? OPT_MESSAGES : 0) | (socket->streams ? OPT_STREAMS : 0)
+              | (socket->fec ? OPT_FEC : 0) | (socket->flow_control ? OPT_WINDOW : 0);
+
+    /* Each side advertises the segment size of its interface in future_use2 */
+    mss = localMss(socket);
+    if (useMss(socket, mss, ntohl(receiveFromClient->future_use2)) < 0){
+        setState(socket, INVALID);
         return -1;
     }
-    if (hasValidCheckSum(&receiveFromClient) != 0){
-        socket->state = INVALID;
-        perror("Error on checksum");
+
+    /* Creates and sends back the SYN_ACK packet to the client. */
+    isn = io_random();
+    socket->seq_number = isn;
+    socket->ack_number = ntohl(receiveFromClient->seq_number) + 1;
+    if (sendSegmentExtra(socket, isn, SYN_ACK, NULL, 0, options, htonl(socket->checksum), htonl(mss)) < 0){
+        reportError(socket, "microtcp_accept(): sending the SYN_ACK");
+        setState(socket, INVALID);
         return -1;
     }
-    if (receiveFromClient.control != ACK){
-        socket->state = INVALID;
-        perror("The recieved packet should be ACK");
-        return -1;
+    synAckSent = io_now_us();
+
+    /* Recieves the ACK packet from the client. That is the end of our connection. */
+    while (TRUE){
+        isPacketReceived = receiveSegment(socket, segment, socket->rto_us);
+        if (isPacketReceived < 0){
+            reportError(socket, "microtcp_accept(): receiving from the client: %s", strerror(errno));
+            setState(socket, INVALID);
+            return -1;
+        }
+        if (isPacketReceived == 0 || receiveFromClient->control == SYN){
+            /* Our SYN_ACK or the ACK of the client got lost */
+            if (isPacketReceived == 0 && ++tries > MICROTCP_MAX_RETRIES){
+                reportError(socket, "microtcp_accept(): the client does not answer");
+                setState(socket, INVALID);
+                return -1;
+            }
+            if (isPacketReceived == 0)
+                socket->rto_us = min(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+            sendSegmentExtra(socket, isn, SYN_ACK, NULL, 0, options, htonl(socket->checksum), htonl(mss));
+            synAcks++;
+            continue;
+        }
+        if ((receiveFromClient->control & ACK) && ntohl(receiveFromClient->ack_number) == isn + 1)
+            break;
+    }
+    if (synAcks == 1)
+        socket->handshake_rtt_us = io_now_us() - synAckSent;
+    socket->seq_number = isn + 1;
+    if (socket->messages){
+        socket->messages->una = socket->seq_number;
+        socket->messages->rack_sacked = socket->seq_number;
     }
-    printf("Connection set to established (done from server)\n\n");
+    if (socket->flow_control)
+        socket->curr_win_size = (size_t)ntohs(receiveFromClient->window) << WINDOW_SHIFT;
+    setState(socket, ESTABLISHED);
+    /* The ACK may already carry data if the plain ACK of the client got lost */
+    handleIncoming(socket, segment);
     return 0;
 }
 
+/*
+ * TIME_WAIT of the side that closed first, after the ACK of the FIN of
+ * the peer. If that ACK is lost, the peer sends its FIN again one RTO
+ * later and has to find us still here, otherwise it retries for minutes.
+ * Every FIN answered starts the wait over, twice as long.
+ */
+static void timeWait(microtcp_sock_t *socket){
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    uint64_t wait_us = socket->rto_us + 2 * socket->srtt_us;
+
+    while (receiveSegment(socket, segment, wait_us) > 0)
+        if (h->control == FIN_ACK){
+            sendAck(socket);
+            /* The peer backs off, its next FIN comes twice as late */
+            wait_us = min(2 * wait_us, MICROTCP_MAX_RTO_US);
+        }
+}
+
 /* return 0 on success or -1 on failure */
 int microtcp_shutdown(microtcp_sock_t *socket, int how){
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *receive = (microtcp_header_t *)segment;
+    ssize_t isPacketReceived;
+    uint32_t fin;
+    int tries = 0;
+    int gotAck = 0;
+    int result = 0;
+
+    (void)how; /* Always both directions, microTCP has no half-close */
+    /* The FIN follows the last data, so they must all be settled first, and the socket is ours again after it */
+    if (drainSendBuffer(socket) < 0)
+        return -1;
     if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER){
-        perror("You can't call shutdown with this socket state.");
+        reportError(socket, "microtcp_shutdown(): not connected");
         return -1;
     }
-    //printf("\nYou called shutdown\n\n");
-    microtcp_header_t send;
-    microtcp_header_t receive;
-    int isPacketReceived, isPacketSent;
-    int X, Y;
 
+    if (socket->streams && pumpStreams(socket, 1) < 0)
+        return -1;
+    if (socket->messages && flushMessages(socket) < 0)
+        return -1;
+    socket->corked = 0;
+    if (socket->held_len > 0 && microtcp_send(socket, socket->held, 0, 0) < 0)
+        return -1;
+
+    fin = socket->seq_number;
     if (socket->state != CLOSING_BY_PEER) { /* client */
         /* Send 1st packet to server */
-        X = getRandom(500);
-        initializeHeader(&send, htons(X), 0, FIN_ACK, 0, 0, 0, 0, 0); 
-        isPacketSent = sendto(socket->sd, (void *)&send, sizeof(microtcp_header_t), 0, socket->address, socket->size); 
-        if (isPacketSent == -1){
-            perror("Error in microtcp_shutdown(), while sending the FIN_ACK packet to server.\n");
-            socket->state = INVALID;
+        if (sendSegment(socket, fin, FIN_ACK, NULL, 0) < 0){
+            reportError(socket, "microtcp_shutdown(): sending the FIN_ACK");
+            setState(socket, INVALID);
             return -1;
         }
-        printf("Client: We just sent a FIN_ACK\n");
-        /* receive 1st packet and check it     */
-        /* Not sure about the last 2 arguments */ 
-        isPacketReceived = recvfrom(socket->sd, &receive, sizeof(microtcp_header_t), 0, socket->address, &socket->size);
-        if (isPacketReceived == -1){
-            perror("Error in microtcp_shutdown, while receiving 1st packet from server.\n");
-            socket->state = INVALID;
-            return -1;
+
+        /* Wait for the ACK of our FIN and then for the FIN_ACK of the server */
+        while (TRUE){
+            isPacketReceived = receiveSegment(socket, segment, socket->rto_us);
+            if (isPacketReceived < 0){
+                reportError(socket, "microtcp_shutdown(): receiving from the server: %s", strerror(errno));
+                result = -1;
+                break;
+            }
+            if (isPacketReceived == 0){
+                if (++tries > MICROTCP_MAX_RETRIES){
+                    reportError(socket, "microtcp_shutdown(): the server does not answer");
+                    result = -1;
+                    break;
+                }
+                socket->rto_us = min(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+                if (!gotAck)
+                    sendSegment(socket, fin, FIN_ACK, NULL, 0);
+                continue;
+            }
+            if (receive->control == FIN_ACK){
+                /* The FIN of the server also acknowledges ours */
+                socket->seq_number = fin + 1;
+                socket->ack_number = ntohl(receive->seq_number) + 1;
+                sendAck(socket);
+                timeWait(socket);
+                break;
+            }
+            if (receive->control == ACK && ntohl(receive->data_len) == 0
+                && ntohl(receive->ack_number) == fin + 1){
+                gotAck = 1;
+                setState(socket, CLOSING_BY_HOST);
+                continue;
+            }
+            if (ntohl(receive->data_len) > 0 && !(receive->future_use0 & SEG_REPAIR)){
+                /* Nobody will read it, but the peer cannot close before its send completes */
+                if (ntohl(receive->seq_number) == socket->ack_number)
+                    socket->ack_number += ntohl(receive->data_len);
+                sendAck(socket);
+            }
         }
-        //printf("Client: We just received a ACK after we send the FINACK.\n");
-        if (hasValidCheckSum(&receive) != 0){
-            socket->state = INVALID;
-            perror("Error on checksum");
+    }
+    else{ /* server */
+        /* The FIN of the client has already been acknowledged by microtcp_recv() */
+        if (sendSegment(socket, fin, FIN_ACK, NULL, 0) < 0){
+            reportError(socket, "microtcp_shutdown(): sending the FIN_ACK");
+            setState(socket, INVALID);
             return -1;
         }
-        if (receive.control != ACK){
-            socket->state = INVALID;
-            perror("Error, the received packet should be ACK\n");
-            return -1;
+
+        /* server receives the final packet */
+        while (TRUE){
+            isPacketReceived = receiveSegment(socket, segment, socket->rto_us);
+            if (isPacketReceived < 0){
+                reportError(socket, "microtcp_shutdown(): receiving from the client: %s", strerror(errno));
+                result = -1;
+                break;
+            }
+            if (isPacketReceived == 0){
+                if (++tries > MICROTCP_MAX_RETRIES){
+                    reportError(socket, "microtcp_shutdown(): the client does not answer");
+                    result = -1;
+                    break;
+                }
+                socket->rto_us = min(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+                sendSegment(socket, fin, FIN_ACK, NULL, 0);
+                continue;
+            }
+            if (receive->control == FIN_ACK){
+                /* Our ACK to the FIN of the client got lost */
+                sendAck(socket);
+                continue;
+            }
+            if (receive->control == ACK && ntohl(receive->ack_number) == fin + 1){
+                socket->seq_number = fin + 1;
+                break;
+            }
         }
+    }
 
-        socket->state = CLOSING_BY_HOST; /* change state for client */
+    saveMetrics(socket);
+    freeRecvbuf(socket);
+    free(socket->held);
+    socket->held = NULL;
+    freeSendBuffer(socket);
+    microtcp_uring_destroy(socket->uring);
+    socket->uring = NULL;
+    freeStreams(socket);
+    freeFec(socket);
+    freeMessages(socket);
+    if (socket->sampler){
+        socket->sampler->next_us = 0;   /* Always end with a last row */
+        sampleStats(socket);
+        fclose(socket->sampler->fp);
+        free(socket->sampler);
+        socket->sampler = NULL;
+    }
+    setState(socket, result == 0 ? CLOSED : INVALID);
+    return result; /* return 0 on sucess */
+}
 
-        /* Receive 2nd packet from server */
-        /* Not sure about the last 2 arguments */
-        isPacketReceived = recvfrom(socket->sd, &receive, sizeof(microtcp_header_t), 0, socket->address, &socket->size);
-        if (isPacketReceived == -1){
-            perror("Error in microtcp_shutdown, while receiving the 2nd packet from server.\n");
-            socket->state = INVALID;
-            return -1;
+/* The send times of the segments sendStream() has in flight, oldest first */
+struct rack_ring {
+    uint32_t seq[RACK_SLOTS];
+    uint32_t end[RACK_SLOTS];
+    uint64_t sent_us[RACK_SLOTS];
+    unsigned head;
+    unsigned count;
+};
+
+/* Past the last slot segments go unrecorded, their loss is left to duplicate ACKs */
+static void rackSent(struct rack_ring *r, uint32_t seq, uint32_t end, uint64_t now){
+    unsigned i;
+
+    if (r->count == RACK_SLOTS)
+        return;
+    i = (r->head + r->count++) % RACK_SLOTS;
+    r->seq[i] = seq;
+    r->end[i] = end;
+    r->sent_us[i] = now;
+}
+
+/* Forgets the segments that ack covers */
+static void rackAcked(struct rack_ring *r, uint32_t ack){
+    while (r->count > 0 && SEQ_LEQ(r->end[r->head], ack)){
+        r->head = (r->head + 1) % RACK_SLOTS;
+        r->count--;
+    }
+}
+
+/* When the segment that starts at seq, the oldest in flight, was last sent, 0 if unknown */
+static uint64_t rackSentAt(struct rack_ring *r, uint32_t seq){
+    if (r->count == 0 || r->seq[r->head] != seq)
+        return 0;
+    return r->sent_us[r->head];
+}
+
+/*
+ * For the sender thread, the send buffer from una on as the data of
+ * sendStream(): the ring wraps at most once, which streamBytes() takes
+ * like held back bytes followed by a buffer. Frees the space of what una
+ * has passed, takes in what the application has added since, and with
+ * nothing in flight waits for more. Returns 0 once closing has left
+ * nothing to send.
+ */
+static int pullSendBuffer(microtcp_sock_t *socket, struct microtcp_sendbuf *sb, uint32_t una, uint32_t nxt,
+                          uint32_t *end, const uint8_t **held, size_t *heldLen, const void **buffer){
+    size_t acked = una - socket->seq_number;
+
+    pthread_mutex_lock(&sb->lock);
+    sb->start = (sb->start + acked) % sb->size;
+    sb->len -= acked;
+    socket->seq_number = una;
+    copyStats(socket, &sb->stats);
+    if (acked > 0)
+        pthread_cond_broadcast(&sb->cond);
+    while (una == nxt && !sb->closing && (sb->len == 0 || (socket->corked && sb->len < socket->mss)))
+        pthread_cond_wait(&sb->cond, &sb->lock);
+    *end = una + sb->len;
+    *held = sb->data + sb->start;
+    *heldLen = sb->size - sb->start;
+    *buffer = sb->data;
+    pthread_mutex_unlock(&sb->lock);
+    return *end != una;
+}
+
+/*
+ * Eπιστρέϕει τον αριθμό των bytes που επιτυχημένα και επιβεβαιωμένα έστειλε στον παραλήπτη.
+ *
+ * Sends heldLen bytes of held and then length bytes of buffer. The data are sent in segments of up to mss bytes, keeping at most
+ * min(cwnd, curr_win_size) bytes in flight. Slow start and congestion avoidance
+ * grow cwnd, and a timeout sends everything after the last ACK again. Now and
+ * then a larger segment probes whether the path can carry it.
+ * A duplicate ACK means a later segment arrived, so the one at una is lost
+ * once its RACK deadline has passed or three of them have come, and a fast
+ * retransmit goes back to it. After two RTTs without an ACK the last
+ * segment is sent again as a tail loss probe: its ACK, or the duplicate ACK
+ * it draws, ends the silence well before the RTO would.
+ * With flow control nothing is sent past the window of the peer, and less
+ * than a segment waits until half of the window is free (sender silly
+ * window avoidance).
+ * While the window stays closed the persist timer sends what fits, or a
+ * byte to probe a window of 0, with the same backoff as the RTO.
+ * With sb the data are instead what the application keeps adding to the
+ * send buffer, until it closes it.
+ */
+static ssize_t sendStream(microtcp_sock_t *socket, struct microtcp_sendbuf *sb,
+                          const uint8_t *held, size_t heldLen, const void *buffer, size_t length){
+    uint8_t segment[SEGMENT_LEN];
+    uint8_t scratch[SEGMENT_LEN];
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    uint32_t una, nxt, end, ack, recover;
+    uint32_t high;               /* The highest sequence number sent */
+    uint32_t rttSeq = 0;
+    uint64_t rttStart = 0;
+    int rttPending = 0;
+    int timeouts = 0;
+    size_t wnd, payloadSize, acked;
+    size_t dupAcks = 0;
+    uint32_t probeSeq = 0;
+    size_t probeSize = 0;        /* Of the probe in flight, 0 if there is none */
+    size_t probe;
+    int probeLost;
+    size_t windowProbe = 0;      /* Of the window probe in flight, 0 if there is none */
+    uint64_t persistUs = socket->rto_us;
+    int persistProbes = 0;       /* Window probes without an answer */
+    int persist;
+    int windowChanged;
+    ssize_t received;
+    struct rack_ring rack;
+    uint64_t rackUs = 0;         /* The RACK timer of the segment at una, 0 if not armed */
+    uint64_t sentAt;
+    uint64_t wait;
+    uint64_t now;
+    uint32_t tail;
+    int recovering = 0;          /* In fast recovery after a fast retransmit */
+    int probing = 0;             /* A tail loss probe is unanswered */
+    int probeArmed;
+    int lost = 0;                /* The segment at una is lost, by duplicate ACKs or its RACK deadline */
+
+    rack.head = rack.count = 0;
+    una = nxt = recover = high = socket->seq_number;
+    end = una + heldLen + length;
+    startRateSample(socket, io_now_us());
+    while (sb ? pullSendBuffer(socket, sb, una, nxt, &end, &held, &heldLen, &buffer) : una != end) {
+        if (lost){
+            /* Fast retransmit. The receiver drops out of order segments, so go back to una. */
+            socket->retransmissions++;
+            socket->packets_lost++;
+            socket->bytes_lost += min(socket->mss, end - una);
+            probeLost = probeSize > 0 && una == probeSeq;
+            if (probeLost)
+                pmtuProbeDone(socket, probeSize, 0, una); /* No fast recovery either */
+            else{
+                socket->ssthresh = max((size_t)(nxt - una) / 2, 2 * socket->mss);
+                socket->cwnd = socket->ssthresh;
+            }
+            recovering = !probeLost;
+            probeSize = 0;
+            TRACE_EVENT(LOG_LEVEL_DEBUG, TRACE_RETRANSMIT, socket->sd, una, 0, nxt - una, 1);
+            traceCwnd(socket, una);
+            recover = nxt;
+            nxt = una;
+            rttPending = 0;
+            rackUs = 0;
+            rack.count = 0;
+            lost = 0;
         }
-        if (hasValidCheckSum(&receive) != 0){
-            socket->state = INVALID;
-            perror("Error on checksum");
-            return -1;
+
+        /* Fill the window, io_uring submits it in batches */
+        wnd = min(socket->cwnd, socket->curr_win_size);
+        socket->batching = 1;
+        while (nxt != end && nxt - una < wnd) {
+            payloadSize = min(socket->mss, end - nxt);
+            /* Probe whenever the data and cwnd allow, with nothing behind it the tail loss probe draws the duplicate ACK that reports its loss */
+            probe = probeSize == 0 && dupAcks == 0 && timeouts == 0 ? pmtuProbeSize(socket) : 0;
+            if (probe > 0 && end - nxt >= probe && nxt - una + probe <= wnd)
+                payloadSize = probe;
+            else
+                probe = 0;
+            if (nxt != una && nxt - una + payloadSize > wnd)
+                break;
+            /*
+             * A window smaller than a segment, as a receiver short of memory
+             * offers, takes a smaller one once at least half of it is free,
+             * the sender side of the silly window avoidance of RFC 1122
+             */
+            if (socket->flow_control && nxt - una + payloadSize > socket->curr_win_size){
+                if (probe > 0 || nxt - una >= socket->curr_win_size
+                    || 2 * (socket->curr_win_size - (nxt - una)) < socket->curr_win_size)
+                    break;
+                payloadSize = socket->curr_win_size - (nxt - una);
+            }
+            if (sendSegment(socket, nxt, ACK, streamBytes(held, heldLen, buffer, nxt - socket->seq_number, payloadSize, scratch),
+                            payloadSize) < 0){
+                setState(socket, INVALID);
+                return -1;
+            }
+            now = io_now_us();
+            rackSent(&rack, nxt, nxt + payloadSize, now);
+            if (!rttPending){
+                rttPending = 1;
+                rttSeq = nxt + payloadSize;
+                rttStart = now;
+            }
+            if (probe > 0){
+                probeSeq = nxt;
+                probeSize = probe;
+            }
+            nxt += payloadSize;
+            if (SEQ_GT(nxt, high))
+                high = nxt;
+        }
+        socket->batching = 0;
+        socket->flight_size = nxt - una;
+        sampleStats(socket);
+
+        /* Nothing in flight because the window of the peer is closed, or only a window probe */
+        persist = windowProbe > 0 || (socket->flow_control && nxt == una && nxt != end);
+        wait = persist ? persistUs : socket->rto_us;
+        probeArmed = !persist && !probing && !recovering && socket->srtt_us > 0 && nxt != una
+                     && probeTimeout(socket) < wait;
+        if (probeArmed)
+            wait = probeTimeout(socket);
+        if (rackUs != 0){
+            now = io_now_us();
+            wait = min(wait, rackUs > now ? rackUs - now : 1);
         }
-        if (receive.control != FIN_ACK){
-            socket->state = INVALID;
-            perror("The recieved packet should be FIN_ACK\n");
+        received = receiveSegment(socket, segment, wait);
+        if (received < 0){
+            setState(socket, INVALID);
             return -1;
         }
-        //printf("Client: We just receiverd a FIN_ACk from server\n");
+        if (received == 0 && persist){
+            if (++persistProbes > MICROTCP_MAX_RETRIES){
+                reportError(socket, "microtcp_send(): the peer does not answer");
+                setState(socket, INVALID);
+                return -1;
+            }
+            nxt = una;
+            rack.count = 0;
+            windowProbe = max(min(min(socket->mss, end - nxt), socket->curr_win_size), 1);
+            if (sendSegment(socket, nxt, ACK, streamBytes(held, heldLen, buffer, nxt - socket->seq_number, windowProbe, scratch),
+                            windowProbe) < 0){
+                setState(socket, INVALID);
+                return -1;
+            }
+            rackSent(&rack, nxt, nxt + windowProbe, io_now_us());
+            nxt += windowProbe;
+            socket->window_probes++;
+            persistUs = min(2 * persistUs, MICROTCP_MAX_RTO_US);
+            continue;
+        }
+        if (received == 0 && rackUs != 0 && io_now_us() >= rackUs){
+            /* The segment at una is past its RACK deadline */
+            lost = 1;
+            continue;
+        }
+        if (received == 0 && probeArmed){
+            /* Tail loss probe, the last segment again or the last mss bytes of a larger PMTU probe */
+            tail = rack.count > 0 ? rack.seq[(rack.head + rack.count - 1) % RACK_SLOTS] : una;
+            if (nxt - tail > socket->mss)
+                tail = nxt - socket->mss;
+            if (sendSegment(socket, tail, ACK, streamBytes(held, heldLen, buffer, tail - socket->seq_number, nxt - tail, scratch),
+                            nxt - tail) < 0){
+                setState(socket, INVALID);
+                return -1;
+            }
+            if (rack.count > 0 && rack.seq[(rack.head + rack.count - 1) % RACK_SLOTS] == tail)
+                rack.sent_us[(rack.head + rack.count - 1) % RACK_SLOTS] = io_now_us();
+            if (rttPending && SEQ_GT(rttSeq, tail))
+                rttPending = 0; /* Karn */
+            TRACE_EVENT(LOG_LEVEL_DEBUG, TRACE_RETRANSMIT, socket->sd, tail, 0, nxt - tail, 2);
+            socket->tail_probes++;
+            probing = 1;
+            continue;
+        }
+        if (received == 0){
+            /* Timeout, everything in flight is considered lost */
+            if (++timeouts > MICROTCP_MAX_RETRIES){
+                reportError(socket, "microtcp_send(): the peer does not answer");
+                setState(socket, INVALID);
+                return -1;
+            }
+            socket->retransmissions++;
+            socket->packets_lost += (nxt - una + socket->mss - 1) / socket->mss;
+            socket->bytes_lost += nxt - una;
+            /* A lost probe says nothing about congestion (RFC 4821) */
+            probeLost = probeSize > 0 && una == probeSeq;
+            if (probeLost){
+                pmtuProbeDone(socket, probeSize, 0, una);
+                timeouts--;
+            }
+            else{
+                if (timeouts >= PMTU_BLACK_HOLE_TIMEOUTS)
+                    pmtuBlackHole(socket, una);
+                socket->ssthresh = max((size_t)(nxt - una) / 2, 2 * socket->mss);
+                socket->cwnd = socket->mss;
+                socket->rto_us = min(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+            }
+            probeSize = 0;
+            TRACE_EVENT(LOG_LEVEL_DEBUG, TRACE_RETRANSMIT, socket->sd, una, 0, nxt - una, 0);
+            traceCwnd(socket, una);
+            recover = nxt;
+            nxt = una;
+            rttPending = 0;
+            dupAcks = 0;
+            recovering = 0;
+            probing = 0;
+            rackUs = 0;
+            rack.count = 0;
+            continue;
+        }
+        /* Fast path: a pure ACK for new data while nothing is being recovered */
+        if (IS_PLAIN(h) && h->data_len == 0 && dupAcks == 0
+            && SEQ_GT(ack = ntohl(h->ack_number), una) && SEQ_LEQ(ack, nxt))
+            socket->segments_predicted++;
+        else if (handleIncoming(socket, segment) || !(h->control & ACK))
+            continue;
+        else
+            ack = ntohl(h->ack_number);
+        TRACE_EVENT(LOG_LEVEL_TRACE, TRACE_ACK, socket->sd, una, ack, SEQ_GT(ack, una) ? ack - una : 0, dupAcks);
+        /* After going back the peer may acknowledge more than was sent again */
+        if (SEQ_GT(ack, nxt) && SEQ_LEQ(ack, high))
+            nxt = ack;
+        /* The window is relative to the ACK, an old ACK carries an old window */
+        windowChanged = 0;
+        if (socket->flow_control && SEQ_GEQ(ack, una) && SEQ_LEQ(ack, nxt)){
+            wnd = (size_t)ntohs(h->window) << WINDOW_SHIFT;
+            windowChanged = wnd != socket->curr_win_size;
+            socket->curr_win_size = wnd;
+        }
+        if (windowProbe > 0){
+            if (ack == una)
+                nxt = una; /* No room for the probe, the peer dropped it */
+            windowProbe = 0;
+            persistProbes = 0;
+        }
+        if (SEQ_GT(ack, una) && SEQ_LEQ(ack, nxt)){
+            acked = ack - una;
+            una = ack;
+            timeouts = 0;
+            rackAcked(&rack, una);
+            rackUs = 0;
+            persistUs = socket->rto_us;
+            if (probeSize > 0 && SEQ_GEQ(ack, probeSeq + probeSize)){
+                pmtuProbeDone(socket, probeSize, 1, una);
+                probeSize = 0;
+            }
+            if (rttPending && SEQ_GEQ(ack, rttSeq)){
+                now = io_now_us();
+                updateRtt(socket, now - rttStart);
+                rttPending = 0;
+            }
+            now = io_now_us();
+            if (socket->srtt_us > 0 && now - socket->rate_start_us >= rateInterval(socket)){
+                updateDeliveryRate(socket, (uint64_t)(una - socket->rate_seq) * 1000000 / (now - socket->rate_start_us));
+                socket->rate_seq = una;
+                socket->rate_start_us = now;
+            }
+            if (probing && una == nxt){
+                /* The probe repaired a tail loss, as far as we can tell, which tells about congestion */
+                socket->ssthresh = max((size_t)acked / 2, 2 * socket->mss);
+                socket->cwnd = socket->ssthresh;
+            }
+            else if (recovering)
+                socket->cwnd = socket->ssthresh; /* Leave fast recovery */
+            else if (socket->cwnd < socket->ssthresh)
+                socket->cwnd += min(acked, socket->mss); /* Slow start */
+            else
+                socket->cwnd += max(1, socket->mss * socket->mss / socket->cwnd); /* Congestion avoidance */
+            traceCwnd(socket, una);
+            dupAcks = 0;
+            recovering = 0;
+            probing = 0;
+        }
+        else if (ack == una && una != nxt && !windowChanged){
+            sentAt = socket->srtt_us > 0 ? rackSentAt(&rack, una) : 0;
+            now = io_now_us();
+            /* Before recover the old flight still echoes, only an ACK for a segment sent after una counts */
+            if (SEQ_LT(una, recover) && (sentAt == 0 || now < sentAt + socket->min_rtt_us))
+                continue;
+            socket->dup_acks++;
+            dupAcks++;
+            /* Without an RTT or the send time, three of them */
+            if (dupAcks >= 3 || (sentAt != 0 && now >= rackDeadline(socket, sentAt)))
+                lost = 1;
+            else if (sentAt != 0 && rackUs == 0)
+                rackUs = rackDeadline(socket, sentAt);
+        }
+    }
+    socket->seq_number = end;
+    socket->flight_size = 0;
+    socket->rate_idle_us = io_now_us();
+    sampleStats(socket);
+    return sb ? 0 : heldLen + length;
+}
+
+/*
+ * Sends the data of the send buffer until the socket drains it, in one
+ * sendStream() that keeps the window full and its RTT and loss state
+ * across everything the application adds meanwhile
+ */
+static void *sendBufferMain(void *arg){
+    microtcp_sock_t *socket = (microtcp_sock_t *)arg;
+    struct microtcp_sendbuf *sb = socket->sendbuf;
+    int failed;
+
+    failed = sendStream(socket, sb, NULL, 0, NULL, 0) < 0;
+    pthread_mutex_lock(&sb->lock);
+    sb->failed = failed;
+    copyStats(socket, &sb->stats);
+    pthread_cond_broadcast(&sb->cond);
+    pthread_mutex_unlock(&sb->lock);
+    return NULL;
+}
 
-        
-        /* client sends the final packet to server */
-        initializeHeader(&send, htons(ntohl(receive.ack_number)), htons(ntohl(receive.seq_number) + 1), ACK, 0, 0, 0, 0, 0);
-        isPacketSent = sendto(socket->sd, (void *)&send, sizeof(microtcp_header_t), 0, socket->address, socket->size);
-        if (isPacketSent == -1){
-            perror("Error in microtcp_connect(), while sending the the final packet to client.\n");
-            socket->state = INVALID;
+/* Copies the data into the send buffer, starting the sender thread if needed */
+static ssize_t enqueueSend(microtcp_sock_t *socket, const uint8_t *buffer, size_t length){
+    struct microtcp_sendbuf *sb = socket->sendbuf;
+    size_t copied = 0;
+    size_t tail, n;
+    int failed;
+
+    if (sb->data == NULL && (sb->data = malloc(sb->size)) == NULL){
+        reportError(socket, "microtcp_send(): allocating the send buffer");
+        return -1;
+    }
+    if (!sb->running){
+        if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER)
+            return -1;
+        sb->failed = 0;
+        copyStats(socket, &sb->stats);
+        if (pthread_create(&sb->thread, NULL, sendBufferMain, socket) != 0){
+            reportError(socket, "microtcp_send(): starting the sender thread");
             return -1;
         }
-        printf("Client: We just sent an ACK to server as an answer to the FINACK\n");
+        sb->running = 1;
     }
-    else{ /* server */
 
-        
-        /* send 1st packet to client */
-        initializeHeader(&send, 0, htons(ntohl(receive.seq_number) + 1), ACK, 0, 0, 0, 0, 0); /* window ?? */
-        isPacketSent = sendto(socket->sd, (void *)&send, sizeof(microtcp_header_t), 0, socket->address, socket->size);
-        if (isPacketSent == -1){
-            perror("Error in microtcp_connect(), while sending the 1st packet to client.\n");
-            socket->state = INVALID;
+    pthread_mutex_lock(&sb->lock);
+    while (copied < length && !sb->failed){
+        if (sb->len == sb->size){
+            if (sb->nonblocking)
+                break;
+            pthread_cond_wait(&sb->cond, &sb->lock);
+            continue;
+        }
+        tail = (sb->start + sb->len) % sb->size;
+        n = min(length - copied, min(sb->size - sb->len, sb->size - tail));
+        memcpy(sb->data + tail, buffer + copied, n);
+        sb->len += n;
+        copied += n;
+        pthread_cond_broadcast(&sb->cond);
+    }
+    failed = sb->failed;
+    pthread_mutex_unlock(&sb->lock);
+
+    if (failed)
+        return -1;
+    if (copied == 0 && length > 0){
+        errno = EAGAIN;
+        return -1;
+    }
+    return copied;
+}
+
+ssize_t microtcp_send(microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
+    size_t copied, keep;
+    int more = (flags & MICROTCP_MSG_MORE) || socket->corked;
+
+    if(buffer == NULL) {
+        reportError(socket, "microtcp_send(): NULL buffer");
+        return 0;
+    }
+    if (socket->streams)
+        return microtcp_send_stream(socket, 0, buffer, length);
+    if (socket->messages)
+        return sendMessage(socket, buffer, length, socket->messages->lifetime_us);
+    /* The sender thread coalesces by itself, whatever piles up while it sends goes out in full segments */
+    if (socket->sendbuf)
+        return enqueueSend(socket, buffer, length);
+    if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER)
+        return -1;
+    if (!more && socket->held_len == 0)
+        return sendStream(socket, NULL, NULL, 0, buffer, length);
+
+    /* Not even a segment yet, wait for more */
+    if (more && socket->held_len + length < socket->mss){
+        if (socket->held == NULL && (socket->held = malloc(socket->max_mss)) == NULL){
+            reportError(socket, "microtcp_send(): allocating the held back data");
             return -1;
         }
+        memcpy(socket->held + socket->held_len, buffer, length);
+        socket->held_len += length;
+        return length;
+    }
+
+    /* Whole segments go out now, with MSG_MORE a partial last one is held back */
+    keep = more ? (socket->held_len + length) % socket->mss : 0;
+    if (sendStream(socket, NULL, socket->held, socket->held_len, buffer, length - keep) < 0)
+        return -1;
+    copied = length - keep;
+    socket->held_len = keep;
+    if (keep > 0)
+        memcpy(socket->held, (const uint8_t *)buffer + copied, keep);
+    return length;
+}
+
+/* Handles the segments that have already arrived, without waiting */
+static int absorbSegments(microtcp_sock_t *socket){
+    uint8_t segment[SEGMENT_LEN];
+    ssize_t received;
+
+    while ((received = receiveSegment(socket, segment, NO_WAIT)) > 0)
+        handleIncoming(socket, segment);
+    return received < 0 ? -1 : 0;
+}
+
+ssize_t microtcp_recv(microtcp_sock_t *socket, void *buffer, size_t length, int flags){
+    uint8_t segment[SEGMENT_LEN];
+    microtcp_header_t *h = (microtcp_header_t *)segment;
+    ssize_t receiveResult;
+    size_t dataLength, copied;
+    int stream = 0;
+
+    if (socket->streams)
+        return microtcp_recv_stream(socket, &stream, buffer, length);
+    /* The sender thread handles what arrives while it runs, recvbuf included */
+    if (drainSendBuffer(socket) < 0)
+        return -1;
+    autotuneRecvbuf(socket);
+    if (socket->messages)
+        return recvMessage(socket, buffer, length);
+
+    /* With flow control what has arrived meanwhile moves to recvbuf, so the ACKs tell the peer how much room is left */
+    if (socket->flow_control && socket->state == ESTABLISHED && absorbSegments(socket) < 0){
+        reportError(socket, "microtcp_recv(): %s", strerror(errno));
+        return -1;
+    }
 
-        printf("Server: We just sent an ACK as an answer to FINACK\n");
+    /* Data that arrived while we were sending or did not fit last time */
+    if (socket->buf_fill_level > 0){
+        copied = min(length, socket->buf_fill_level);
+        memcpy(buffer, socket->recvbuf + socket->buf_start, copied);
+        consumeRecvbuf(socket, copied);
+        return copied;
+    }
+    if (socket->state != ESTABLISHED)
+        return -1; /* The peer has closed the connection */
 
-        /* send 2nd packet to client */
-        Y = getRandom(500);                                                                               /* is ack the same as before?? */
-        initializeHeader(&send, htons(Y), htons(ntohl(receive.seq_number) + 1), FIN_ACK, 0, 0, 0, 0, 0); /* window ?? */
-        isPacketSent = sendto(socket->sd, (void *)&send, sizeof(microtcp_header_t), 0, socket->address, socket->size);
-        if (isPacketSent == -1){
-            perror("Error in microtcp_connect(), while sending the 1st packet to client.\n");
-            socket->state = INVALID;
+    while (TRUE){
+        receiveResult = receiveSegment(socket, segment, idleWait(socket));
+        if(receiveResult < 0) {
+            reportError(socket, "microtcp_recv(): %s", strerror(errno));
             return -1;
         }
-        printf("Server: We just sent a FIN_ACK\n");
+        if (receiveResult == 0){
+            shrinkRecvbuf(socket);
+            continue;
+        }
+        dataLength = receiveResult - sizeof(microtcp_header_t);
 
-        /* server receives the final packet */
-        isPacketReceived = recvfrom(socket->sd, &receive, sizeof(microtcp_header_t), 0, socket->address, &socket->size);
-        if (isPacketReceived == -1){
-            perror("Error in microtcp_shutdown, while receiving the final packet from client.\n");
-            socket->state = INVALID;
+        /* Fast path: the next in order data, straight to the caller */
+        if (dataLength > 0 && IS_PLAIN(h) && ntohl(h->seq_number) == socket->ack_number
+            && dataLength - min(length, dataLength) <= socket->recvbuf_len){
+            socket->segments_predicted++;
+            copied = min(length, dataLength);
+            memcpy(buffer, segment + sizeof(microtcp_header_t), copied);
+            memcpy(socket->recvbuf, segment + sizeof(microtcp_header_t) + copied, dataLength - copied);
+            socket->buf_fill_level = dataLength - copied;
+            socket->ack_number += dataLength;
+            socket->bytes_received += dataLength;
+            sendAck(socket);
+            sampleStats(socket);
+            return copied;
+        }
+
+        handleIncoming(socket, segment);
+        if (socket->buf_fill_level > 0)
+            return microtcp_recv(socket, buffer, length, flags);
+        if(socket->state == CLOSING_BY_PEER){
             return -1;
         }
-        //printf("Server: We just received an ACK from client\n");
-        if (hasValidCheckSum(&receive) != 0){
-            socket->state = INVALID;
-            perror("Error on checksum");
+    }
+}
+
+int microtcp_get_stats(const microtcp_sock_t *socket, microtcp_stats_t *stats){
+    if (socket == NULL || stats == NULL)
+        return -1;
+    /* The sender thread owns the socket while it runs */
+    if (socket->sendbuf && socket->sendbuf->running){
+        pthread_mutex_lock(&socket->sendbuf->lock);
+        *stats = socket->sendbuf->stats;
+        pthread_mutex_unlock(&socket->sendbuf->lock);
+        return 0;
+    }
+    copyStats(socket, stats);
+    return 0;
+}
+
+int microtcp_set_message_mode(microtcp_sock_t *socket, uint64_t lifetime_us){
+    if (socket->state != UNKNOWN && socket->state != LISTEN){
+        reportError(socket, "microtcp_set_message_mode(): the connection is already established");
+        return -1;
+    }
+    if (socket->messages == NULL){
+        socket->messages = calloc(1, sizeof(struct microtcp_messages));
+        if (socket->messages == NULL){
+            reportError(socket, "microtcp_set_message_mode(): allocating the message queue");
             return -1;
         }
-        if (receive.control != ACK){
-            socket->state = INVALID;
-            perror("The recieved packet should be ACK");
+    }
+    socket->messages->lifetime_us = lifetime_us;
+    return 0;
+}
+
+ssize_t microtcp_send_message(microtcp_sock_t *socket, const void *buffer, size_t length, uint64_t lifetime_us){
+    if (socket->messages == NULL || socket->streams){
+        reportError(socket, "microtcp_send_message(): the connection is not in message mode");
+        return -1;
+    }
+    return sendMessage(socket, buffer, length, lifetime_us);
+}
+
+int microtcp_set_streams(microtcp_sock_t *socket){
+    if (socket->state != UNKNOWN && socket->state != LISTEN){
+        reportError(socket, "microtcp_set_streams(): the connection is already established");
+        return -1;
+    }
+    if (socket->messages == NULL && microtcp_set_message_mode(socket, 0) < 0)
+        return -1;
+    if (socket->streams == NULL){
+        socket->streams = calloc(1, sizeof(struct microtcp_streams));
+        if (socket->streams == NULL){
+            reportError(socket, "microtcp_set_streams(): allocating the streams");
             return -1;
         }
     }
-    socket->state = CLOSED;
-    return 0; /* return 0 on sucess */     
+    return 0;
 }
 
-/* Eπιστρέϕει τον αριθμό των bytes που επιτυχημένα και επιβεβαιωμένα έστειλε στον παραλήπτη. */
-ssize_t microtcp_send(microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
-    struct timeval timeout;
-    size_t sentUpTo, dataLeft, payloadSize, totalBytes, chunks, chunkSize, seq;
-    microtcp_header_t header;
-    int receiveResult;
-    void *outBuffer = malloc((MICROTCP_MSS + sizeof(microtcp_header_t)) * sizeof(char));
-    void *inBuffer = malloc((MICROTCP_MSS + sizeof(microtcp_header_t)) * sizeof(char));
-    int i;
+ssize_t microtcp_send_stream(microtcp_sock_t *socket, int stream, const void *buffer, size_t length){
+    struct microtcp_stream *s;
+    size_t copied = 0;
+    size_t n;
 
-    if(buffer == NULL) {
-        perror("Error: Null buffer\n");
-        return 0;
+    if (socket->streams == NULL || stream < 0 || stream >= MICROTCP_MAX_STREAMS){
+        reportError(socket, "microtcp_send_stream(): no stream %d on this connection", stream);
+        return -1;
     }
-    totalBytes = 0;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = MICROTCP_ACK_TIMEOUT_US;
-    sentUpTo = 0;
-    dataLeft = length;
-    seq = socket->seq_number;
-
-    while (sentUpTo < length) {
-        totalBytes = min(socket->curr_win_size, min(socket->cwnd, dataLeft));
-        chunks = totalBytes / MICROTCP_MSS;
-        for (i = 0; i < chunks; i++) {
-            initializeHeader(&header, htons(seq), 0, 0, 0, htonl(MICROTCP_MSS), 0, 0, 0);
-            memcpy(outBuffer, &header, sizeof(microtcp_header_t));
-            memcpy(outBuffer + sizeof(microtcp_header_t), buffer + i * MICROTCP_MSS + sentUpTo, MICROTCP_MSS);
-
-            if (sendto(socket->sd, outBuffer, MICROTCP_MSS, 0, (struct sockaddr *)&socket->address, socket->size) < 0) {
-                socket->state = INVALID;
-                perror("microTCP Send  - while trying to send data\n");
-                free(outBuffer);
-                return -1;
-            }
-            sentUpTo += MICROTCP_MSS;
-            seq += MICROTCP_MSS;
-        }
-        /* Check if there is a semi-filled chunk */
-        if (totalBytes % MICROTCP_MSS){
-            chunks++;
-            initializeHeader(&header, htons(seq), 0, 0, 0, htonl(totalBytes), 0, 0, 0);
-            memcpy(outBuffer, &header, sizeof(microtcp_header_t));
-            memcpy(outBuffer + sizeof(microtcp_header_t), buffer, MICROTCP_MSS); //+i*MICROTCP_MSS+sentUpTo na to alaxeis -- oxi MSS alla total bytes
-            if (sendto(socket->sd, outBuffer, MICROTCP_MSS +sizeof(microtcp_header_t), 0, socket->address, socket->size) < 0){
-                socket->state = INVALID;
-                perror("microTCP Send  - while trying to send");
-                free(outBuffer);
+    if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER)
+        return -1;
+    s = &socket->streams->stream[stream];
+    if (s->pending == NULL && (s->pending = malloc(MICROTCP_STREAM_BUFFER_LEN)) == NULL){
+        reportError(socket, "microtcp_send_stream(): allocating the buffer of the stream");
+        return -1;
+    }
+    while (copied < length){
+        if (s->pending_start > 0 && s->pending_start + s->pending_len == MICROTCP_STREAM_BUFFER_LEN){
+            memmove(s->pending, s->pending + s->pending_start, s->pending_len);
+            s->pending_start = 0;
+        }
+        n = min(length - copied, MICROTCP_STREAM_BUFFER_LEN - s->pending_start - s->pending_len);
+        if (n == 0){
+            /* The stream is full, wait until the window takes some of it */
+            if (pollMessages(socket, 1) < 0 || pumpStreams(socket, 0) < 0)
                 return -1;
-            }
-            seq += totalBytes;
-            sentUpTo += totalBytes % MICROTCP_MSS;
+            continue;
         }
-
+        memcpy(s->pending + s->pending_start + s->pending_len, (const uint8_t *)buffer + copied, n);
+        s->pending_len += n;
+        socket->streams->pending += n;
+        copied += n;
+        if (pumpStreams(socket, 0) < 0)
+            return -1;
     }
-    socket->ack_number += sentUpTo;
-    free(outBuffer);
-    free(inBuffer);
-    return sentUpTo;
+    return length;
 }
 
+ssize_t microtcp_recv_stream(microtcp_sock_t *socket, int *stream, void *buffer, size_t length){
+    size_t copied;
 
-ssize_t microtcp_recv(microtcp_sock_t *socket, void *buffer, size_t length, int flags){
-    int receiveResult;
-    void *inBuffer = malloc((MICROTCP_MSS + sizeof(microtcp_header_t)) * sizeof(char));
-    microtcp_header_t *tmpHeader;
-    microtcp_header_t inHeader, outHeader;
-    size_t expectedSeq = socket->seq_number;
-    size_t seqToSend = socket->ack_number;
+    if (socket->streams == NULL || stream == NULL || *stream < MICROTCP_ANY_STREAM || *stream >= MICROTCP_MAX_STREAMS){
+        reportError(socket, "microtcp_recv_stream(): no such stream on this connection");
+        return -1;
+    }
+    if (length == 0)
+        return 0;
+    autotuneRecvbuf(socket);
     while (TRUE){
-        receiveResult = recvfrom(socket->sd, inBuffer, MICROTCP_MSS + sizeof(microtcp_header_t), 0, socket->address, &socket->size);
-        if(receiveResult < 0) {
-            perror("Server receive error.\n");
+        /* Our own pending data go out meanwhile, as the window allows */
+        if (pumpStreams(socket, 0) < 0)
             return -1;
-        }
-        memcpy(buffer, inBuffer+sizeof(microtcp_header_t) , receiveResult-sizeof(microtcp_header_t));
-       // printf("\nreceiveResult = ld\n", (receiveResult - sizeof(microtcp_header_t) ));
-
-        tmpHeader = (microtcp_header_t *)inBuffer;
-        
-        if(tmpHeader->control == FIN_ACK){
-            socket->seq_number = ntohl(tmpHeader->seq_number);
-            //printf("We just received a FIN_ACK\n");
-			socket->state = CLOSING_BY_PEER;
-			return -1;
-		}	
-        break;
-
-        /*    tmpHeader = (microtcp_header_t *)inBuffer;
-        initializeHeader(&inHeader, tmpHeader->seq_number, tmpHeader->ack_number, tmpHeader->control, tmpHeader->window, tmpHeader->data_len, 0, 0, 0);
-
-        /// do some finack  here
-
-        if (ntohl(inHeader->checksum) == crc32(inBuffer, sizeof(inBuffer)))
-        {
-            if (ntohl(inHeader->seq_number) == expectedSeq)
-            {
-                //good
-                memcpy(curBuffPos, inBuffer + sizeof(microtcp_header_t), inHeader->data_len, htons(MICROTCP_RECVBUF_LEN - indexRecvBuff));
-                curBuffPos += inHeader->data_len;
-                expectedSeq++;
-            }
-            initializeHeader(&outHeader, htonl(seqToSend++), htonl(expectedSeq), ACK, htons(MICROTCP_RECVBUF_LEN - curBuffPos), inHeader->data_len, 0, 0, 0);
-
-            memcpy(buffer, &outHeader, sizeof(microtcp_header_t));
-            outHeader->checksum = htonl(crc32(buffer, sizeof(buffer)));
-            memcpy(buffer, &outHeader, sizeof(microtcp_header_t));
+        copied = readStreams(socket, stream, buffer, length);
+        if (copied > 0)
+            return copied;
+        if (socket->state != ESTABLISHED)
+            return -1; /* The peer has closed the connection */
+        if (pollMessages(socket, 1) < 0)
+            return -1;
+    }
+}
 
-            if (sendto(socket->sd, (void *)&send_head_pack, sizeof(microtcp_header_t), 0, (struct sockaddr *)&socket->clientAddress, socket->clientSize) < 0)
-            { 
-                socket->state = INVALID;
-                perror("microTCP rcv connection error - While trying to send ACK\n");
-            }
-        }
-        else
-        {
-            //checksum error
+int microtcp_set_fec(microtcp_sock_t *socket, int block){
+    if (socket->state != UNKNOWN && socket->state != LISTEN){
+        reportError(socket, "microtcp_set_fec(): the connection is already established");
+        return -1;
+    }
+    if (block < 0 || block > MICROTCP_FEC_MAX_BLOCK){
+        reportError(socket, "microtcp_set_fec(): the block should be between 0 and %d messages", MICROTCP_FEC_MAX_BLOCK);
+        return -1;
+    }
+    if (block == 0){
+        freeFec(socket);
+        return 0;
+    }
+    if (socket->messages == NULL && microtcp_set_message_mode(socket, 0) < 0)
+        return -1;
+    if (socket->fec == NULL){
+        socket->fec = calloc(1, sizeof(struct microtcp_fec));
+        if (socket->fec == NULL){
+            reportError(socket, "microtcp_set_fec(): allocating the repair state");
+            return -1;
         }
     }
+    socket->fec->max_block = block;
+    socket->fec->block = block;
+    return 0;
+}
 
-    if (socket->state != ESTABLISHED)
-        perror("Connection is not established");
-    ssize_t receivedData = 0;
-    void *bufferTosend = malloc(sizeof(microtcp_header_t));
-    void *bufferForRecv = malloc(MICROTCP_MSS);
-    void *receiveBuffer = malloc(MICROTCP_RECVBUF_LEN);
-    int isReceived;
-
-    /* Timeout timer for socket 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = MICROTCP_ACK_TIMEOUT_US;
-
-    while (TRUE)
-    {
-        if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) < 0)
-        {
-            socket->state = INVALID;
-            perror("Error: Set Timeout\n");
+int microtcp_setsockopt(microtcp_sock_t *socket, int option, int value){
+    switch (option){
+    case MICROTCP_CORK:
+        if (socket->sendbuf){
+            pthread_mutex_lock(&socket->sendbuf->lock);
+            socket->corked = value != 0;
+            pthread_cond_broadcast(&socket->sendbuf->cond);
+            pthread_mutex_unlock(&socket->sendbuf->lock);
             return 0;
         }
-        isReceived = recvfrom(socket->sd, bufferForRecv, MICROTCP_MSS, 0, (struct sockaddr *)&socket->clientAddress, &socket->clientSize);
-        if (isReceived > 0)
-        {
-        }
-        else
-        { /* Then error (isReceived == -1) 
+        socket->corked = value != 0;
+        if (!socket->corked && socket->held_len > 0 && microtcp_send(socket, socket->held, 0, 0) < 0)
+            return -1;
+        return 0;
+#ifndef MICROTCP_SIM
+    case MICROTCP_BUSY_POLL:
+        socket->busy_poll_us = value > 0 ? value : 0;
+        return 0;
+    case MICROTCP_KERNEL_BUSY_POLL:
+        if (io_setsockopt(socket->sd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(int)) < 0){
+            reportError(socket, "microtcp_setsockopt(): setting SO_BUSY_POLL: %s", strerror(errno));
+            return -1;
         }
-    */
+        return 0;
+#endif
+    case MICROTCP_AUTOTUNE:
+        socket->autotune = value != 0;
+        return 0;
+    case MICROTCP_METRICS:
+        socket->metrics = value != 0;
+        return 0;
+    default:
+        reportError(socket, "microtcp_setsockopt(): unknown option %d", option);
+        return -1;
+    }
+}
+
+int microtcp_set_send_buffer(microtcp_sock_t *socket, size_t size, int nonblocking){
+    struct microtcp_sendbuf *sb;
+
+#ifdef MICROTCP_SIM
+    if (size > 0){
+        reportError(socket, "microtcp_set_send_buffer(): not available in the simulator");
+        return -1;
+    }
+#endif
+    /* Whatever the old setup holds goes out first */
+    if (freeSendBuffer(socket) < 0)
+        return -1;
+    if (socket->held_len > 0){
+        if (sendStream(socket, NULL, socket->held, socket->held_len, socket->held, 0) < 0)
+            return -1;
+        socket->held_len = 0;
     }
-    return (receiveResult - sizeof(microtcp_header_t));
-}
\ No newline at end of file
+    if (size == 0)
+        return 0;
+
+    sb = calloc(1, sizeof(struct microtcp_sendbuf));
+    if (sb == NULL){
+        reportError(socket, "microtcp_set_send_buffer(): allocating the send buffer");
+        return -1;
+    }
+    sb->size = size;
+    sb->nonblocking = nonblocking;
+    pthread_mutex_init(&sb->lock, NULL);
+    pthread_cond_init(&sb->cond, NULL);
+    socket->sendbuf = sb;
+    return 0;
+}
+
+int microtcp_set_checksum(microtcp_sock_t *socket, microtcp_checksum_t checksum){
+    if (socket->state != UNKNOWN && socket->state != LISTEN){
+        reportError(socket, "microtcp_set_checksum(): the connection is already established");
+        return -1;
+    }
+    if (checksum >= MICROTCP_CHECKSUM_COUNT){
+        reportError(socket, "microtcp_set_checksum(): unknown checksum %d", checksum);
+        return -1;
+    }
+#ifdef MICROTCP_FIXED_CHECKSUM
+    if (checksum != SOCKET_CHECKSUM(socket)){
+        reportError(socket, "microtcp_set_checksum(): the library is built for checksum %d only", SOCKET_CHECKSUM(socket));
+        return -1;
+    }
+#endif
+    socket->checksum = checksum;
+    return 0;
+}
+
+int microtcp_enable_sampler(microtcp_sock_t *socket, const char *path, uint64_t interval_us){
+    struct microtcp_sampler *s;
+
+    s = calloc(1, sizeof(struct microtcp_sampler));
+    if (s == NULL)
+        return -1;
+    s->fp = fopen(path, "w");
+    if (s->fp == NULL){
+        reportError(socket, "Opening the sampler file %s: %s", path, strerror(errno));
+        free(s);
+        return -1;
+    }
+    fprintf(s->fp, "time_s,bytes_send,bytes_received,send_mbps,recv_mbps,cwnd,ssthresh,"
+            "flight_size,peer_window,srtt_us,rto_us,retransmissions,dup_acks\n");
+    s->interval_us = interval_us;
+    s->start_us = io_now_us();
+    s->last_us = s->start_us;
+    s->next_us = s->start_us + interval_us;
+    if (socket->sampler){
+        fclose(socket->sampler->fp);
+        free(socket->sampler);
+    }
+    socket->sampler = s;
+    return 0;
+}
+
+int microtcp_set_memory_limit(size_t bytes){
+    if (bytes == 0){
+        LOG_ERROR("microtcp_set_memory_limit(): the budget must not be 0");
+        return -1;
+    }
+    __atomic_store_n(&memoryLimit, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+size_t microtcp_memory_used(void){
+    return __atomic_load_n(&recvbufMemory, __ATOMIC_RELAXED);
+}
+
+microtcp_memory_pressure_t microtcp_memory_pressure(void){
+    return memoryPressure();
+}
@@ -13,11 +13,57 @@
  * Several useful constants
  */
 #define MICROTCP_ACK_TIMEOUT_US 200000
-#define MICROTCP_MSS 1400
+#define MICROTCP_MSS 1400                 /* Used when the path MTU is unknown or a probe found a black hole */
+#define MICROTCP_MAX_MSS (65507 - sizeof(microtcp_header_t)) /* The largest UDP payload over IPv4 */
 #define MICROTCP_RECVBUF_LEN 8192
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
-#define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
+#define MICROTCP_WIN_SEGMENTS 4           /* The window holds at least this many segments */
+#define MICROTCP_RECVBUF_MAX (1 << 18)    /* Autotuning stops at the largest window the header carries */
+#define MICROTCP_RECVBUF_IDLE_US 1000000  /* A receive buffer idle this long shrinks back to its initial size */
+#define MICROTCP_MEMORY_LIMIT (64 << 20)  /* Default budget of all the receive buffers of the process */
+#define MICROTCP_INIT_CWND_SEGMENTS 3
+#define MICROTCP_INIT_CWND (MICROTCP_INIT_CWND_SEGMENTS * MICROTCP_MSS)
+#define MICROTCP_PMTU_RAISE_US 600000000  /* Looks for a larger segment size again after 10 minutes */
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_MAX_RTO_US 60000000
+#define MICROTCP_MAX_RETRIES 8
+#define MICROTCP_SEND_BUFFER_LEN (1 << 20) /* A reasonable size for microtcp_set_send_buffer() */
+#define MICROTCP_MAX_STREAMS 64           /* Of a multiplexed connection, see microtcp_set_streams() */
+#define MICROTCP_STREAM_BUFFER_LEN (1 << 16) /* Data of a stream waiting for the window */
+#define MICROTCP_ANY_STREAM (-1)
+#define MICROTCP_FEC_BLOCK 8              /* Messages per repair segment of a peer that asks for FEC */
+#define MICROTCP_FEC_MAX_BLOCK 32
+
+/*
+ * Flag of the type of microtcp_socket(): the connection does its socket
+ * I/O through io_uring, or with plain system calls where io_uring is not
+ * available. Building the library with MICROTCP_URING sets it for every
+ * socket.
+ */
+#define MICROTCP_SOCK_URING (1 << 30)
+
+/*
+ * A build can fix what every socket otherwise picks at run time, so the
+ * hot paths carry no branch on it:
+ *   MICROTCP_FIXED_CHECKSUM  a microtcp_checksum_t, the only checksum the
+ *                            library offers, accepts and computes
+ *   MICROTCP_SYSCALL_IO      plain system calls, MICROTCP_SOCK_URING is
+ *                            ignored
+ * The presets of microtcp.hpp check that they match them.
+ */
+
+/* Flags of microtcp_send() */
+#define MICROTCP_MSG_MORE MSG_MORE        /* More data follow, hold back a partial last segment */
+
+/* Options of microtcp_setsockopt() */
+#define MICROTCP_CORK 1                   /* Every send holds back a partial last segment until uncorked */
+#define MICROTCP_BUSY_POLL 2              /* Microseconds to spin on the socket before blocking, 0 never */
+#define MICROTCP_KERNEL_BUSY_POLL 3       /* SO_BUSY_POLL of the UDP socket, in microseconds */
+#define MICROTCP_AUTOTUNE 4               /* Sizes the receive buffer after the rate of the peer, 1 by default */
+#define MICROTCP_METRICS 5                /* Starts from and saves the metrics of the destination, 1 by default */
+
+#define MICROTCP_CACHE_LINE 64
+#define MICROTCP_CACHE_ALIGNED __attribute__((aligned(MICROTCP_CACHE_LINE)))
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
@@ -38,42 +84,183 @@ typedef enum
   INVALID
 } mircotcp_state_t;
 
+/**
+ * Integrity checks of the segments, negotiated at the 3-way handshake.
+ * The handshake itself is always protected with CRC-32.
+ */
+typedef enum
+{
+  MICROTCP_CHECKSUM_CRC32,      /* The default, see crc32() in utils folder */
+  MICROTCP_CHECKSUM_CRC32C,     /* With the CRC32 instructions of the CPU if it has them */
+  MICROTCP_CHECKSUM_HASH64,     /* hash64() folded to 32 bits */
+  MICROTCP_CHECKSUM_NONE,       /* Only for links that already guarantee integrity, e.g. loopback */
+  MICROTCP_CHECKSUM_COUNT
+} microtcp_checksum_t;
+
+/**
+ * How close the receive buffers of the process are to the budget of
+ * microtcp_set_memory_limit()
+ */
+typedef enum
+{
+  MICROTCP_MEMORY_OK,           /* Buffers grow as their connections need */
+  MICROTCP_MEMORY_PRESSURE,     /* Over three quarters of the budget, no buffer grows */
+  MICROTCP_MEMORY_EXHAUSTED     /* Over the budget, buffers shrink as soon as they are drained */
+} microtcp_memory_pressure_t;
+
 
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
  *
  * NOTE: Fill free to insert additional fields.
+ *
+ * The fields are grouped by how they are used, each group starting on a
+ * cache line of its own. The sequence state comes first, one line the
+ * sending side writes for every segment and one the receiving side
+ * writes, so a segment touches the first two lines of the socket. Then
+ * those read for every segment and written only at the handshake, the
+ * rest of what each side writes, and the cold rest. A server that juggles
+ * many connections then touches few lines per segment, and the thread of
+ * microtcp_set_send_buffer() does not share lines with the application.
+ * Keep new fields with the group they belong to.
  */
 typedef struct
 {
-  int sd;                       /* The underline UDP socket descriptor */
-  mircotcp_state_t state;       /* The state of the microTCP socket */
-  size_t init_win_size;         /* The window size negotiated at the 3-way handshake */
-  size_t curr_win_size;         /* The current window size */
+  /* Written by the sending side for every segment */
+  uint32_t seq_number MICROTCP_CACHE_ALIGNED; /* Keep the state of the sequence number */
+  size_t cwnd;
+  size_t ssthresh;
+  size_t flight_size;             /* Bytes sent but not acknowledged yet */
+  size_t curr_win_size;         /* The window of the peer with flow control, our own window without it */
+  uint64_t packets_send;          /* Every segment sent, including control segments and ACKs */
+  uint64_t bytes_send;            /* Data bytes sent, including retransmissions */
+  uint64_t srtt_us;               /* Smoothed RTT, 0 until the first sample */
 
+  /* Written by the receiving side for every segment */
+  uint32_t ack_number MICROTCP_CACHE_ALIGNED; /* Keep the state of the ack number */
   uint8_t *recvbuf;             /* The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
                                      to retrieve the data from the network. */
+  size_t buf_start;             /* Where the data in the buffer start */
   size_t buf_fill_level;        /* Amount of data in the buffer */
+  size_t recvbuf_len;
+  size_t advertised_window;     /* The free space our last segment advertised */
+  uint64_t packets_received;      /* Every segment received with a valid checksum */
+  uint64_t bytes_received;        /* Data bytes received in order */
 
-  size_t cwnd;
-  size_t ssthresh;
+  /* Read for every segment */
+  int sd MICROTCP_CACHE_ALIGNED; /* The underline UDP socket descriptor */
+  mircotcp_state_t state;       /* The state of the microTCP socket */
+  microtcp_checksum_t checksum; /* Requested before the handshake, negotiated after it */
+  int flow_control;             /* Both sides advertise the free space of their receive buffer */
+  socklen_t size;
+  int batching;                 /* Data segments wait for the rest of the window */
+  size_t mss;                   /* The segment size, negotiated and then adjusted by probing */
+  size_t max_mss;               /* The smaller of the two sides' MTU-derived sizes */
+  struct sockaddr *address;
+  struct microtcp_uring *uring; /* Set up at the handshake if io_uring is available */
+  uint64_t busy_poll_us;        /* Spin budget of every wait for a segment, see MICROTCP_BUSY_POLL */
+  struct microtcp_messages *messages; /* Set in message mode, see microtcp_set_message_mode() */
+  struct microtcp_streams *streams; /* Set on a multiplexed connection, see microtcp_set_streams() */
+  struct microtcp_fec *fec;     /* Set with forward error correction, see microtcp_set_fec() */
+  struct microtcp_sampler *sampler; /* Optional CSV time series, see microtcp_enable_sampler() */
+  int autotune;                 /* See MICROTCP_AUTOTUNE */
 
-  uint32_t seq_number;            /* Keep the state of the sequence number */
-  uint32_t ack_number;            /* Keep the state of the ack number */
+  /* The rest the sending side writes */
+  uint64_t rttvar_us MICROTCP_CACHE_ALIGNED;
+  uint64_t rto_us;                /* Current retransmission timeout */
+  uint64_t min_rtt_us;            /* The smallest RTT sample, sizes the reordering window of RACK */
+  uint64_t send_rate;             /* Windowed maximum of the rate in bytes per second the peer acknowledged over an RTT or more */
+  uint64_t rate_max[2];           /* The highest delivery rate sample of the current and the previous window */
+  uint32_t rate_samples;          /* Delivery rate samples in the current window */
+  uint32_t rate_seq;              /* Where the interval of the next delivery rate sample started */
+  uint64_t rate_start_us;         /* When it started, 0 before the first send */
+  uint64_t rate_idle_us;          /* When the last send had everything acknowledged */
+  size_t pmtu_high;             /* The smallest segment size known or assumed not to go through */
+  uint64_t pmtu_probe_us;       /* When to send the next probe for a larger segment size */
+  uint8_t *held;                /* Less than a segment, held back by MICROTCP_MSG_MORE or MICROTCP_CORK */
+  size_t held_len;
+  int corked;
+
+  /* The rest the receiving side writes */
+  uint64_t segments_predicted MICROTCP_CACHE_ALIGNED; /* Segments handled by the header prediction fast path */
+  uint64_t timeout_us;            /* The receive timeout currently set on sd */
+  uint32_t autotune_seq;          /* The ack number at the start of the autotuning round */
+  uint64_t autotune_us;           /* When the round started, 0 before the first one */
+  uint64_t receive_rate;          /* The highest rate in bytes per second data arrived in order over a round */
+
+  /* Cold: setup, rare events and their counters */
+  size_t init_win_size MICROTCP_CACHE_ALIGNED; /* The window size negotiated at the 3-way handshake */
+  uint64_t handshake_rtt_us;      /* Round trip of the handshake, all a receiver that sends no data knows */
+  struct microtcp_sendbuf *sendbuf; /* Optional, see microtcp_set_send_buffer() */
+  int use_uring;                /* Asked for with MICROTCP_SOCK_URING, cleared if not available */
+  int metrics;                  /* See MICROTCP_METRICS */
+  int warm_start;               /* Started from the metrics of earlier connections to the peer */
+  uint16_t local_port;          /* Looked up for the first captured segment, see microtcp_capture.h */
+
+  uint64_t packets_lost;          /* Segments we had to send again */
+  uint64_t bytes_lost;            /* Data bytes we had to send again */
+  uint64_t retransmissions;       /* Retransmission events (timeouts and fast retransmits) */
+  uint64_t tail_probes;           /* The last segment sent again after two RTTs without an ACK */
+  uint64_t dup_acks;
+  uint64_t messages_expired;      /* Messages abandoned at the end of their lifetime */
+  uint64_t window_probes;         /* Sent while the window of the peer was closed */
+  uint64_t window_updates;        /* ACKs sent only because our window opened */
+  uint64_t fec_repairs;           /* Repair segments sent */
+  uint64_t fec_recovered;         /* Lost messages of the peer rebuilt from its repair segments */
+  uint64_t recvbuf_grown;         /* Times autotuning enlarged the receive buffer */
+  uint64_t recvbuf_shrunk;        /* Times it gave memory back, idle or under pressure */
+  uint64_t busy_poll_cpu_us;    /* CPU time spent spinning */
+  uint64_t busy_poll_hits;      /* Waits a segment ended while spinning */
+  uint64_t busy_poll_misses;    /* Waits that ran out of budget and blocked */
+} microtcp_sock_t;
+
+/**
+ * Snapshot of the state and the counters of a connection
+ */
+typedef struct
+{
+  mircotcp_state_t state;
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
-   
-  struct sockaddr *address;
-  socklen_t size;
-
-} microtcp_sock_t;
+  uint64_t retransmissions;
+  uint64_t tail_probes;
+  uint64_t dup_acks;
+  uint64_t messages_expired;
+  uint64_t segments_predicted;
+  uint64_t window_probes;
+  uint64_t window_updates;
+  uint64_t fec_repairs;
+  uint64_t fec_recovered;
+  int fec_block;                /* Messages per repair segment now, 0 without FEC */
+  size_t recvbuf_len;           /* The receive buffer now, what the window can open up to */
+  uint64_t recvbuf_grown;
+  uint64_t recvbuf_shrunk;
+  uint64_t srtt_us;
+  uint64_t rttvar_us;
+  uint64_t rto_us;
+  uint64_t send_rate;           /* Delivery rate in bytes per second, 0 until a send has lasted an RTT */
+  uint64_t receive_rate;        /* In bytes per second, 0 before a round of autotuning */
+  int warm_start;               /* Started from the metrics of earlier connections to the peer */
+  size_t cwnd;
+  size_t ssthresh;
+  size_t flight_size;
+  size_t curr_win_size;         /* The window of the peer with flow control */
+  int flow_control;
+  microtcp_checksum_t checksum;
+  size_t mss;
+  size_t max_mss;
+  int io_uring;                 /* The socket I/O goes through io_uring */
+  uint64_t busy_poll_cpu_us;
+  uint64_t busy_poll_hits;
+  uint64_t busy_poll_misses;
+} microtcp_stats_t;
 
 
 /**
@@ -90,7 +277,7 @@ typedef struct
   uint32_t future_use0;         /**< 32-bits for future use */
   uint32_t future_use1;         /**< 32-bits for future use */
   uint32_t future_use2;         /**< 32-bits for future use */
-  uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
+  uint32_t checksum;            /**< CRC-32 checksum by default, see microtcp_set_checksum() */
 } microtcp_header_t;
 
 
@@ -121,12 +308,201 @@ microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Sends the data and returns once the peer has acknowledged them, or with
+ * a send buffer once they are copied into it.
+ *
+ * @param flags MICROTCP_MSG_MORE says that more data follow. A last part
+ * smaller than a segment is then held back and sent together with the
+ * data of the next call, and the call returns at once if nothing fills a
+ * segment. A call without the flag, microtcp_shutdown() or uncorking
+ * sends what is held back.
+ * @return length on success or -1 on failure
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Gives the socket a send buffer of size bytes. microtcp_send() then only
+ * copies the data into it and returns, while a thread of the library sends
+ * them, handles their ACKs and retransmits them. The socket must not move
+ * in memory while the buffer holds data.
+ *
+ * When the buffer is full microtcp_send() waits for space, or with
+ * nonblocking returns the bytes that fit, -1 with errno EAGAIN if none
+ * did. A failure of the transmission is reported by the next
+ * microtcp_send(). microtcp_recv() and microtcp_shutdown() first wait
+ * until everything in the buffer is acknowledged, and until then
+ * microtcp_get_stats() reports the socket as the thread last left it.
+ *
+ * Not available in the simulator, whose tasks cannot share it with a thread.
+ *
+ * @param size 0 goes back to sending in microtcp_send()
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_send_buffer (microtcp_sock_t *socket, size_t size, int nonblocking);
+
+/**
+ * Sets an option of the socket. MICROTCP_CORK with a non zero value makes
+ * every microtcp_send() behave as if it had MICROTCP_MSG_MORE, with 0 it
+ * sends what is held back.
+ *
+ * MICROTCP_BUSY_POLL makes every wait for a segment poll the socket
+ * without sleeping for up to value microseconds before it blocks, trading
+ * a busy core for the wakeup latency. A blocking wait that follows still
+ * gets its whole timeout. MICROTCP_KERNEL_BUSY_POLL sets SO_BUSY_POLL, so
+ * the kernel also polls the device queue (values above the
+ * net.core.busy_poll sysctl need CAP_NET_ADMIN). Neither is available in
+ * the simulator, whose clock does not move while a task spins.
+ *
+ * MICROTCP_METRICS with 0, before the handshake, starts the connection
+ * from the defaults instead of what earlier connections learned about the
+ * peer (see microtcp_metrics.h), and keeps what it learns to itself.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int option, int value);
+
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * Switches the socket to message mode. Call it before microtcp_connect()
+ * or microtcp_accept(). The connection uses message mode if either side
+ * asks for it.
+ *
+ * In message mode every microtcp_send() sends one message of up to the
+ * negotiated segment size (the mss of microtcp_get_stats()) and returns as soon as the message is sent, without
+ * waiting for its ACK. microtcp_recv() returns one whole message as soon
+ * as it arrives, even if earlier messages are still missing. A message
+ * that is longer than the buffer given to microtcp_recv() is truncated.
+ *
+ * @param lifetime_us messages not acknowledged within this time are no
+ * longer retransmitted, 0 retransmits them forever
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_message_mode (microtcp_sock_t *socket, uint64_t lifetime_us);
+
+/**
+ * Sends one message in message mode with its own lifetime.
+ */
+ssize_t
+microtcp_send_message (microtcp_sock_t *socket, const void *buffer,
+                       size_t length, uint64_t lifetime_us);
+
+/**
+ * Multiplexes up to MICROTCP_MAX_STREAMS independent streams over the
+ * connection. Call it before microtcp_connect() or microtcp_accept(). The
+ * connection is multiplexed if either side asks for it, and it then uses
+ * message mode underneath.
+ *
+ * Each stream is a reliable, ordered byte stream of its own, but all of
+ * them share the handshake, the congestion window and the window of the
+ * peer. A lost segment holds back only the data of its own stream, and the
+ * sender takes a segment from each stream with data in turn.
+ * microtcp_send() and microtcp_recv() use stream 0.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_streams (microtcp_sock_t *socket);
+
+/**
+ * Queues the data on a stream and sends as much as the window allows. It
+ * blocks only while MICROTCP_STREAM_BUFFER_LEN bytes of the stream are
+ * already waiting.
+ * @return length or -1 on failure
+ */
+ssize_t
+microtcp_send_stream (microtcp_sock_t *socket, int stream, const void *buffer,
+                      size_t length);
+
+/**
+ * Receives the next data of *stream, or with MICROTCP_ANY_STREAM of
+ * whichever stream has data, taking the streams in turn, and sets *stream
+ * to the stream they belong to.
+ * @return the number of bytes copied or -1 on failure or when the peer
+ * has closed the connection
+ */
+ssize_t
+microtcp_recv_stream (microtcp_sock_t *socket, int *stream, void *buffer,
+                      size_t length);
+
+/**
+ * Adds forward error correction to message mode. Call it before
+ * microtcp_connect() or microtcp_accept(). The connection uses it, and
+ * message mode underneath, if either side asks for it.
+ *
+ * After every block of messages the sender sends a repair segment, the
+ * XOR of them, and the receiver rebuilds a message of the block that got
+ * lost from the others without waiting a round trip for the
+ * retransmission. A block that is not full in a quarter of the RTT is
+ * repaired as it is. The block shrinks from block messages down to one
+ * (every message sent twice) as the loss that the peer reports grows, so
+ * that a block rarely loses more than one message. The repair segments
+ * cost up to 1 / block of extra bandwidth and do not count against cwnd,
+ * a rebuilt message still halves it.
+ *
+ * @param block the most messages per repair segment, up to
+ * MICROTCP_FEC_MAX_BLOCK, or 0 to turn FEC off
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_fec (microtcp_sock_t *socket, int block);
+
+/**
+ * Asks for an integrity check other than CRC-32. Call it before
+ * microtcp_connect() or microtcp_accept(). The connection uses it only if
+ * the peer asks for the same one, otherwise it falls back to CRC-32.
+ * microtcp_get_stats() reports the outcome.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_checksum (microtcp_sock_t *socket, microtcp_checksum_t checksum);
+
+/**
+ * Copies the current state and counters of the connection.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_get_stats (const microtcp_sock_t *socket, microtcp_stats_t *stats);
+
+/**
+ * Starts writing a CSV time series of the connection (cwnd, throughput,
+ * RTT, ...) to the file at path, one row at most every interval_us while
+ * the connection sends or receives. The file is closed at shutdown.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_enable_sampler (microtcp_sock_t *socket, const char *path,
+                         uint64_t interval_us);
+
+/**
+ * Sets the budget of the receive buffers of all the connections of the
+ * process, MICROTCP_MEMORY_LIMIT by default. Autotuning grows a buffer
+ * only while the buffers stay under three quarters of it. A new
+ * connection gets what is left of it, and under pressure a drained
+ * buffer shrinks to that too. Each connection keeps at least
+ * MICROTCP_RECVBUF_LEN bytes, which may go over the budget.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_memory_limit (size_t bytes);
+
+/* The bytes taken by the receive buffers of the process */
+size_t
+microtcp_memory_used (void);
+
+/**
+ * The pressure signal of the budget, for a server to stop accepting or to
+ * drop idle connections before the buffers of the busy ones shrink.
+ */
+microtcp_memory_pressure_t
+microtcp_memory_pressure (void);
+
 
 #endif /* LIB_MICROTCP_H_ */
\ No newline at end of file
@@ -0,0 +1,292 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_HPP_
+#define LIB_MICROTCP_HPP_
+
+/*
+ * A header-only C++ front end of microTCP.
+ *
+ * microtcp::connection<StartPreset, ChecksumPreset, IoPreset> is a
+ * connection that applies three configuration presets before the
+ * handshake. A preset is a class with static members only: the socket
+ * type flags it needs and a configure() that makes the setsockopt-like
+ * calls of the C API. They save the calls at every place a connection
+ * is made, and a program fixed to one deployment names its configuration
+ * once in a typedef.
+ *
+ * The engine is the C library. By default it picks the checksum and the
+ * I/O of every segment at run time from what the socket holds. Built
+ * with MICROTCP_FIXED_CHECKSUM or MICROTCP_SYSCALL_IO (see microtcp.h,
+ * and the microtcp_crc32c library of CMakeLists.txt) it has them fixed at
+ * compile time instead. microtcp::engine tells which, and a connection
+ * whose presets ask for something else does not compile. Every member
+ * function is an inline call of the C function of the same name, and
+ * microtcp::connection<>, all defaults, behaves exactly like the C API
+ * without any option set.
+ *
+ * A preset of your own needs:
+ *   static constexpr int socket_flags;           only IoPreset, or-ed into the type
+ *   static int configure (microtcp_sock_t *);    0 on success or -1
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+extern "C" {
+#include "microtcp.h"
+#include "microtcp_table.h"
+}
+
+namespace microtcp
+{
+
+/* What the library was built with, the same macros must reach this header */
+struct engine
+{
+#ifdef MICROTCP_FIXED_CHECKSUM
+  static constexpr bool fixed_checksum = true;
+  static constexpr microtcp_checksum_t checksum = (microtcp_checksum_t) (MICROTCP_FIXED_CHECKSUM);
+#else
+  static constexpr bool fixed_checksum = false;
+  static constexpr microtcp_checksum_t checksum = MICROTCP_CHECKSUM_CRC32;
+#endif
+#ifdef MICROTCP_SYSCALL_IO
+  static constexpr bool syscall_io = true;
+#else
+  static constexpr bool syscall_io = false;
+#endif
+};
+
+/* The start of a connection, see MICROTCP_METRICS */
+
+/* From the metrics earlier connections left about the peer, and leaving its own */
+struct warm_start
+{
+  static int
+  configure (microtcp_sock_t *)
+  {
+    return 0;
+  }
+};
+
+/* From the defaults, and keeping what it learns to itself */
+struct cold_start
+{
+  static int
+  configure (microtcp_sock_t *sock)
+  {
+    return microtcp_setsockopt (sock, MICROTCP_METRICS, 0);
+  }
+};
+
+/* Integrity checks, see microtcp_set_checksum() */
+
+template <microtcp_checksum_t Checksum>
+struct checksum
+{
+  static constexpr microtcp_checksum_t value = Checksum;
+
+  static int
+  configure (microtcp_sock_t *sock)
+  {
+    return Checksum == MICROTCP_CHECKSUM_CRC32 ? 0 : microtcp_set_checksum (sock, Checksum);
+  }
+};
+
+typedef checksum<MICROTCP_CHECKSUM_CRC32> crc32;
+typedef checksum<MICROTCP_CHECKSUM_CRC32C> crc32c;
+typedef checksum<MICROTCP_CHECKSUM_HASH64> hash64;
+typedef checksum<MICROTCP_CHECKSUM_NONE> no_checksum;    /* Only for links that guarantee integrity */
+
+/* Socket I/O */
+
+/* Plain system calls */
+struct syscall_io
+{
+  static constexpr int socket_flags = 0;
+
+  static int
+  configure (microtcp_sock_t *)
+  {
+    return 0;
+  }
+};
+
+/* io_uring where the kernel allows it, system calls otherwise */
+struct uring_io
+{
+  static constexpr int socket_flags = MICROTCP_SOCK_URING;
+
+  static int
+  configure (microtcp_sock_t *)
+  {
+    return 0;
+  }
+};
+
+/* Io, spinning up to SpinUs microseconds before every blocking wait (MICROTCP_BUSY_POLL) */
+template <int SpinUs, class Io = syscall_io>
+struct busy_poll
+{
+  static_assert (SpinUs > 0, "a busy poll needs a spin budget");
+  static constexpr int socket_flags = Io::socket_flags;
+
+  static int
+  configure (microtcp_sock_t *sock)
+  {
+    return Io::configure (sock) < 0 ? -1 : microtcp_setsockopt (sock, MICROTCP_BUSY_POLL, SpinUs);
+  }
+};
+
+template <class StartPreset = warm_start, class ChecksumPreset = checksum<engine::checksum>,
+          class IoPreset = syscall_io>
+class connection
+{
+  static_assert (!engine::fixed_checksum || ChecksumPreset::value == engine::checksum,
+                 "the library is built for another checksum");
+  static_assert (!engine::syscall_io || IoPreset::socket_flags == 0,
+                 "the library is built without io_uring");
+
+public:
+  typedef StartPreset start_preset;
+  typedef ChecksumPreset checksum_preset;
+  typedef IoPreset io_preset;
+
+  static constexpr int socket_type = SOCK_DGRAM | IoPreset::socket_flags;
+
+  /* A socket of its own, check valid() */
+  explicit
+  connection (int domain = AF_INET)
+      : sock_ (new microtcp_sock_t (microtcp_socket (domain, socket_type, IPPROTO_UDP))),
+        table_ (nullptr), handle_ (MICROTCP_NO_HANDLE)
+  {
+    configure ();
+  }
+
+  /* A socket in a slot of table, which keeps the state of many connections together */
+  explicit
+  connection (microtcp_table_t *table, int domain = AF_INET)
+      : sock_ (nullptr), table_ (table),
+        handle_ (microtcp_table_open (table, domain, socket_type, IPPROTO_UDP))
+  {
+    sock_ = microtcp_table_get (table, handle_);
+    configure ();
+  }
+
+  connection (const connection &) = delete;
+  connection &operator= (const connection &) = delete;
+
+  connection (connection &&other) noexcept
+      : sock_ (other.sock_), table_ (other.table_), handle_ (other.handle_)
+  {
+    other.sock_ = nullptr;
+    other.handle_ = MICROTCP_NO_HANDLE;
+  }
+
+  /* Shuts the connection down if it is still open and closes the socket */
+  ~connection ()
+  {
+    if (!sock_)
+      return;
+    if (sock_->state == ESTABLISHED || sock_->state == CLOSING_BY_PEER)
+      microtcp_shutdown (sock_, SHUT_RDWR);
+    if (table_) {
+      microtcp_table_close (table_, handle_);
+      return;
+    }
+    if (sock_->sd >= 0)
+      ::close (sock_->sd);
+    delete sock_;
+  }
+
+  bool
+  valid () const
+  {
+    return sock_ && sock_->state != INVALID;
+  }
+
+  mircotcp_state_t
+  state () const
+  {
+    return sock_ ? sock_->state : INVALID;
+  }
+
+  int
+  bind (const struct sockaddr *address, socklen_t address_len)
+  {
+    return microtcp_bind (sock_, address, address_len);
+  }
+
+  int
+  connect (const struct sockaddr *address, socklen_t address_len)
+  {
+    return microtcp_connect (sock_, address, address_len);
+  }
+
+  int
+  accept (struct sockaddr *address, socklen_t address_len)
+  {
+    return microtcp_accept (sock_, address, address_len);
+  }
+
+  ssize_t
+  send (const void *buffer, size_t length, int flags = 0)
+  {
+    return microtcp_send (sock_, buffer, length, flags);
+  }
+
+  ssize_t
+  recv (void *buffer, size_t length, int flags = 0)
+  {
+    return microtcp_recv (sock_, buffer, length, flags);
+  }
+
+  int
+  shutdown (int how = SHUT_RDWR)
+  {
+    return microtcp_shutdown (sock_, how);
+  }
+
+  int
+  setsockopt (int option, int value)
+  {
+    return microtcp_setsockopt (sock_, option, value);
+  }
+
+  int
+  stats (microtcp_stats_t *stats) const
+  {
+    return microtcp_get_stats (sock_, stats);
+  }
+
+  /* For the rest of the C API */
+  microtcp_sock_t *
+  native ()
+  {
+    return sock_;
+  }
+
+private:
+  /* A preset that fails leaves the socket invalid, as a failed C call would */
+  void
+  configure ()
+  {
+    if (!valid ())
+      return;
+    if (StartPreset::configure (sock_) < 0 || ChecksumPreset::configure (sock_) < 0
+        || IoPreset::configure (sock_) < 0)
+      sock_->state = INVALID;
+  }
+
+  microtcp_sock_t *sock_;
+  microtcp_table_t *table_;             /* NULL if the socket is our own */
+  microtcp_handle_t handle_;
+};
+
+}
+
+#endif /* LIB_MICROTCP_HPP_ */
@@ -0,0 +1,416 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "microtcp.h"
+#include "microtcp_capture.h"
+#include "microtcp_io.h"
+
+#define CAPTURE_RING_LEN (1 << 20) /* Bytes per thread, a power of 2 */
+#define CAPTURE_INTERVAL_US 10000
+#define CAPTURE_FILE_BUFFER (1 << 16)
+
+#define PCAP_MAGIC_NS 0xa1b23c4d /* Nanosecond timestamps */
+#define PCAP_LINKTYPE_RAW 101   /* Starts with the IP header, version 4 or 6 */
+#define IPV4_HEADER_LEN 20
+#define IPV6_HEADER_LEN 40
+#define UDP_HEADER_LEN 8
+
+/*
+ * A captured segment in a ring, followed by its first caplen bytes and
+ * padded to 8 bytes. A record that does not fit before the end of the
+ * ring starts over at the beginning, after a filler with wrap set.
+ */
+typedef struct
+{
+    uint32_t size;              /* Of the whole record, the only field of a filler besides wrap */
+    uint32_t wrap;
+    uint64_t time_ns;           /* io_now_ns() */
+    uint32_t length;            /* Of the segment */
+    uint32_t caplen;            /* Bytes of it kept */
+    uint16_t local_port;        /* Network order, like peer_port */
+    uint16_t peer_port;
+    uint8_t outgoing;
+    uint8_t family;
+    uint8_t peer[16];
+} capture_record_t;
+
+/* Single producer (the owner thread), single consumer (the writer) byte ring, as in microtcp_trace.c */
+typedef struct capture_ring
+{
+    uint8_t bytes[CAPTURE_RING_LEN];
+    uint64_t head;              /* Written only by the owner */
+    uint64_t tail;              /* Written only by the writer */
+    uint64_t dropped;
+    uint64_t reported;          /* Drops already counted, writer only */
+    int exited;                 /* The owner has exited, free it once written */
+    struct capture_ring *next;
+} capture_ring_t;
+
+struct pcap_file_header
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+volatile int microtcp_capture_active = 0;
+
+static __thread capture_ring_t *ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static size_t snap_len;         /* Set before microtcp_capture_active */
+
+/* Protects the list of rings and the writer state, never taken by the segments */
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static capture_ring_t *rings;
+static pthread_t writer;
+static int running;
+static int stopping;
+static int atexit_registered;
+static FILE *capture_fp;        /* NULL if the next file could not be opened */
+static char *capture_path;
+static size_t max_file_size;
+static int max_files;
+static int file_index;
+static size_t file_bytes;
+static int64_t wall_offset_ns;  /* CLOCK_REALTIME minus io_now_ns() */
+static uint64_t captured;
+static uint64_t dropped_total;
+
+static void ring_exited(void *arg){
+    capture_ring_t *r = (capture_ring_t *)arg;
+    __atomic_store_n(&r->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void){
+    pthread_key_create(&ring_key, ring_exited);
+}
+
+/* Allocates and registers the ring of the calling thread */
+static capture_ring_t *new_ring(void){
+    capture_ring_t *r;
+
+    r = calloc(1, sizeof(capture_ring_t));
+    if (r == NULL)
+        return NULL;
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, r);
+    pthread_mutex_lock(&capture_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&capture_lock);
+    return r;
+}
+
+void microtcp_capture_segment(int outgoing, uint16_t local_port, const struct sockaddr *peer, socklen_t peer_len,
+                              const void *segment, size_t length){
+    capture_record_t *rec;
+    uint64_t head, offset, filler, size;
+    size_t caplen;
+
+    if (ring == NULL && (ring = new_ring()) == NULL)
+        return;
+    caplen = length < snap_len ? length : snap_len;
+    size = (sizeof(capture_record_t) + caplen + 7) & ~(uint64_t)7;
+    head = ring->head;
+    offset = head & (CAPTURE_RING_LEN - 1);
+    filler = offset + size > CAPTURE_RING_LEN ? CAPTURE_RING_LEN - offset : 0;
+    if (head + filler + size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > CAPTURE_RING_LEN){
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (filler){
+        rec = (capture_record_t *)&ring->bytes[offset];
+        rec->size = filler;
+        rec->wrap = 1;
+        offset = 0;
+    }
+
+    rec = (capture_record_t *)&ring->bytes[offset];
+    memset(rec, 0, sizeof(capture_record_t));
+    rec->size = size;
+    rec->time_ns = io_now_ns();
+    rec->length = length;
+    rec->caplen = caplen;
+    rec->local_port = htons(local_port);
+    rec->outgoing = outgoing != 0;
+    if (peer && peer->sa_family == AF_INET6 && peer_len >= sizeof(struct sockaddr_in6)){
+        rec->family = AF_INET6;
+        rec->peer_port = ((const struct sockaddr_in6 *)peer)->sin6_port;
+        memcpy(rec->peer, &((const struct sockaddr_in6 *)peer)->sin6_addr, 16);
+    }
+    else if (peer && peer->sa_family == AF_INET && peer_len >= sizeof(struct sockaddr_in)){
+        rec->family = AF_INET;
+        rec->peer_port = ((const struct sockaddr_in *)peer)->sin_port;
+        memcpy(rec->peer, &((const struct sockaddr_in *)peer)->sin_addr, 4);
+    }
+    else
+        rec->family = AF_INET;  /* Unknown peer, written as 0.0.0.0:0 */
+    memcpy(rec + 1, segment, caplen);
+    __atomic_store_n(&ring->head, head + filler + size, __ATOMIC_RELEASE);
+}
+
+static uint16_t ip_checksum(const uint8_t *header, size_t len){
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i += 2)
+        sum += (header[i] << 8) | header[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* The IP and UDP headers the segment had on the wire, returns their length */
+static size_t wire_headers(const capture_record_t *rec, uint8_t *out){
+    size_t udp_len = UDP_HEADER_LEN + rec->length;
+    const uint8_t *src, *dst;
+    uint8_t any[16] = {0};
+    uint8_t *udp;
+    uint16_t sum;
+    size_t ip_len;
+
+    src = rec->outgoing ? any : rec->peer;
+    dst = rec->outgoing ? rec->peer : any;
+    if (rec->family == AF_INET6){
+        ip_len = IPV6_HEADER_LEN;
+        memset(out, 0, ip_len);
+        out[0] = 0x60;
+        out[4] = udp_len >> 8;
+        out[5] = udp_len & 0xff;
+        out[6] = IPPROTO_UDP;
+        out[7] = 64;
+        memcpy(out + 8, src, 16);
+        memcpy(out + 24, dst, 16);
+    }
+    else {
+        ip_len = IPV4_HEADER_LEN;
+        memset(out, 0, ip_len);
+        out[0] = 0x45;
+        out[2] = (ip_len + udp_len) >> 8;
+        out[3] = (ip_len + udp_len) & 0xff;
+        out[6] = 0x40;          /* Don't fragment */
+        out[8] = 64;
+        out[9] = IPPROTO_UDP;
+        memcpy(out + 12, src, 4);
+        memcpy(out + 16, dst, 4);
+        sum = ip_checksum(out, ip_len);
+        out[10] = sum >> 8;
+        out[11] = sum & 0xff;
+    }
+    /* No UDP checksum, the microTCP one covers the segment */
+    udp = out + ip_len;
+    memcpy(udp, rec->outgoing ? &rec->local_port : &rec->peer_port, 2);
+    memcpy(udp + 2, rec->outgoing ? &rec->peer_port : &rec->local_port, 2);
+    udp[4] = udp_len >> 8;
+    udp[5] = udp_len & 0xff;
+    udp[6] = 0;
+    udp[7] = 0;
+    return ip_len + UDP_HEADER_LEN;
+}
+
+/* Opens the file of file_index and writes the pcap header. Called with capture_lock held. */
+static int open_file(void){
+    struct pcap_file_header header;
+    char *name = capture_path;
+    char rotated[PATH_MAX];
+
+    if (max_file_size){
+        snprintf(rotated, sizeof(rotated), "%s.%d", capture_path, file_index);
+        name = rotated;
+    }
+    capture_fp = fopen(name, "w");
+    if (capture_fp == NULL)
+        return -1;
+    setvbuf(capture_fp, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+    memset(&header, 0, sizeof(struct pcap_file_header));
+    header.magic = PCAP_MAGIC_NS;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.snaplen = IPV6_HEADER_LEN + UDP_HEADER_LEN + snap_len;
+    header.linktype = PCAP_LINKTYPE_RAW;
+    fwrite(&header, sizeof(struct pcap_file_header), 1, capture_fp);
+    file_bytes = sizeof(struct pcap_file_header);
+    return 0;
+}
+
+/* Appends a segment to the current file, going on to the next one when it is full */
+static void write_record(const capture_record_t *rec){
+    struct pcap_record_header header;
+    uint8_t headers[IPV6_HEADER_LEN + UDP_HEADER_LEN];
+    uint64_t wall = rec->time_ns + wall_offset_ns;
+    size_t headers_len;
+
+    if (capture_fp == NULL)
+        return;
+    headers_len = wire_headers(rec, headers);
+    header.ts_sec = wall / 1000000000ULL;
+    header.ts_nsec = wall % 1000000000ULL;
+    header.incl_len = headers_len + rec->caplen;
+    header.orig_len = headers_len + rec->length;
+    fwrite(&header, sizeof(struct pcap_record_header), 1, capture_fp);
+    fwrite(headers, headers_len, 1, capture_fp);
+    fwrite(rec + 1, rec->caplen, 1, capture_fp);
+    file_bytes += sizeof(struct pcap_record_header) + header.incl_len;
+    captured++;
+
+    if (max_file_size && file_bytes >= max_file_size){
+        fclose(capture_fp);
+        file_index = (file_index + 1) % max_files;
+        open_file();
+    }
+}
+
+/* Writes the new segments of every ring. Called with capture_lock held. */
+static void drain(void){
+    capture_ring_t **link = &rings;
+    capture_ring_t *r;
+    capture_record_t *rec;
+    uint64_t head, tail, lost;
+    int exited;
+
+    while ((r = *link) != NULL){
+        exited = __atomic_load_n(&r->exited, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        while (tail != head){
+            rec = (capture_record_t *)&r->bytes[tail & (CAPTURE_RING_LEN - 1)];
+            if (!rec->wrap)
+                write_record(rec);
+            tail += rec->size;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        lost = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        dropped_total += lost - r->reported;
+        r->reported = lost;
+
+        if (exited){
+            *link = r->next;
+            free(r);
+        }
+        else
+            link = &r->next;
+    }
+    if (capture_fp)
+        fflush(capture_fp);
+}
+
+static void *writer_main(void *arg){
+    struct timespec ts;
+
+    (void)arg;
+    ts.tv_sec = 0;
+    ts.tv_nsec = CAPTURE_INTERVAL_US * 1000;
+    pthread_mutex_lock(&capture_lock);
+    while (!stopping){
+        pthread_mutex_unlock(&capture_lock);
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&capture_lock);
+        drain();
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return NULL;
+}
+
+int microtcp_capture_start(const char *path, size_t snaplen, size_t file_size, int files){
+    struct timespec rt;
+
+    pthread_mutex_lock(&capture_lock);
+    if (running){
+        pthread_mutex_unlock(&capture_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    snap_len = snaplen ? snaplen : MICROTCP_CAPTURE_SNAPLEN;
+    if (snap_len < sizeof(microtcp_header_t))
+        snap_len = sizeof(microtcp_header_t);
+    if (snap_len > MICROTCP_CAPTURE_MAX_SNAPLEN)
+        snap_len = MICROTCP_CAPTURE_MAX_SNAPLEN;
+    max_file_size = file_size;
+    max_files = files > 0 ? files : MICROTCP_CAPTURE_FILES;
+    file_index = 0;
+    capture_path = strdup(path);
+    if (capture_path == NULL || open_file() < 0){
+        free(capture_path);
+        capture_path = NULL;
+        pthread_mutex_unlock(&capture_lock);
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &rt);
+    wall_offset_ns = rt.tv_sec * 1000000000LL + rt.tv_nsec - (int64_t)io_now_ns();
+    captured = 0;
+    dropped_total = 0;
+
+    stopping = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0){
+        fclose(capture_fp);
+        capture_fp = NULL;
+        free(capture_path);
+        capture_path = NULL;
+        pthread_mutex_unlock(&capture_lock);
+        return -1;
+    }
+    if (!atexit_registered){
+        atexit(microtcp_capture_stop);
+        atexit_registered = 1;
+    }
+    running = 1;
+    microtcp_capture_active = 1;
+    pthread_mutex_unlock(&capture_lock);
+    return 0;
+}
+
+void microtcp_capture_stop(void){
+    pthread_mutex_lock(&capture_lock);
+    if (!running){
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    microtcp_capture_active = 0;
+    stopping = 1;
+    pthread_mutex_unlock(&capture_lock);
+    pthread_join(writer, NULL);
+
+    /* Whatever the threads captured before they saw the flag */
+    pthread_mutex_lock(&capture_lock);
+    drain();
+    if (capture_fp)
+        fclose(capture_fp);
+    capture_fp = NULL;
+    free(capture_path);
+    capture_path = NULL;
+    running = 0;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void microtcp_capture_stats(uint64_t *captured_segments, uint64_t *dropped_segments){
+    pthread_mutex_lock(&capture_lock);
+    if (captured_segments)
+        *captured_segments = captured;
+    if (dropped_segments)
+        *dropped_segments = dropped_total;
+    pthread_mutex_unlock(&capture_lock);
+}
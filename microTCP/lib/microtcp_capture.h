@@ -0,0 +1,77 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_CAPTURE_H_
+#define LIB_MICROTCP_CAPTURE_H_
+
+/*
+ * Packet capture of the microTCP segments to pcap files, which Wireshark
+ * and tcpdump read.
+ *
+ * Every segment a socket sends or accepts is copied, cut at the snap
+ * length, into a byte ring of the calling thread. As with the trace of
+ * microtcp_trace.h only that thread writes to its ring and only the
+ * writer thread reads from it, so a captured segment costs a memcpy of
+ * its first bytes and no locks or system calls. The writer wraps each
+ * one in the IPv4 or IPv6 and UDP headers it had on the wire and appends
+ * it to the current file. A file over the size limit is closed and the
+ * next one started, keeping only the last few. If a ring fills up before
+ * it is written, the new segments are dropped and counted, the protocol
+ * is never slowed down. With the snap length at the microTCP header the
+ * capture is cheap enough to leave on for as long as a problem lasts.
+ *
+ * The UDP sockets are not connected, so the kernel picks the local
+ * address of every datagram. The capture leaves it unspecified (0.0.0.0
+ * or ::) and keeps only the local port.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define MICROTCP_CAPTURE_SNAPLEN 96     /* The header and the first 60 bytes of data */
+#define MICROTCP_CAPTURE_MAX_SNAPLEN 65535
+#define MICROTCP_CAPTURE_FILES 8        /* Files kept when rotating, the oldest is overwritten */
+
+/* Set while the writer runs, checked before anything else is done */
+extern volatile int microtcp_capture_active;
+
+/**
+ * Starts capturing every segment of every socket of the process.
+ *
+ * @param path the pcap file. With rotation the files are path.0,
+ *        path.1 and so on, cycling after the last one.
+ * @param snaplen bytes of each segment kept, header included, 0 for
+ *        MICROTCP_CAPTURE_SNAPLEN. Raised to the header size at least.
+ * @param file_size starts the next file once this many bytes were
+ *        written to the current one, 0 for a single file
+ * @param files how many files rotation keeps, 0 for MICROTCP_CAPTURE_FILES
+ * @return 0 on success or -1 on failure. Stopped automatically at exit.
+ */
+int
+microtcp_capture_start (const char *path, size_t snaplen, size_t file_size, int files);
+
+/**
+ * Stops capturing, writes what is left in the rings and closes the file.
+ */
+void
+microtcp_capture_stop (void);
+
+/**
+ * Segments written and segments dropped because a ring was full, since
+ * microtcp_capture_start().
+ */
+void
+microtcp_capture_stats (uint64_t *captured, uint64_t *dropped);
+
+/**
+ * Copies a segment into the ring of the calling thread. outgoing tells
+ * its direction, local_port is ours and peer the address of the other
+ * side. The library calls it while microtcp_capture_active is set.
+ */
+void
+microtcp_capture_segment (int outgoing, uint16_t local_port, const struct sockaddr *peer,
+                          socklen_t peer_len, const void *segment, size_t length);
+
+#endif /* LIB_MICROTCP_CAPTURE_H_ */
@@ -0,0 +1,115 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_IO_H_
+#define LIB_MICROTCP_IO_H_
+
+/*
+ * All the socket I/O, the clock and the randomness of the library go
+ * through this header. Normally they map to the real system calls.
+ * When the library is built with MICROTCP_SIM they map to the simulated
+ * network of microtcp_sim.h, so many endpoints can run inside one
+ * process against a virtual clock.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+
+#ifdef MICROTCP_SIM
+
+#include "microtcp_sim.h"
+
+#define io_socket sim_socket
+#define io_bind sim_bind
+#define io_getsockname sim_getsockname
+#define io_sendto sim_sendto
+#define io_recvfrom sim_recvfrom
+#define io_setsockopt sim_setsockopt
+#define io_close sim_close
+#define io_path_mtu sim_path_mtu
+
+static inline uint64_t io_now_us(void){
+    return sim_now_us();
+}
+
+static inline uint64_t io_now_ns(void){
+    return sim_now_us() * 1000;
+}
+
+static inline uint32_t io_random(void){
+    return sim_random();
+}
+
+#else
+
+#define io_socket socket
+#define io_bind bind
+#define io_getsockname getsockname
+#define io_sendto sendto
+#define io_recvfrom recvfrom
+#define io_setsockopt setsockopt
+#define io_close close
+
+static inline uint64_t io_now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t io_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The MTU of the route to address as the kernel knows it, or -1 */
+static inline int io_path_mtu(const struct sockaddr *address, socklen_t address_len){
+    socklen_t len = sizeof(int);
+    int mtu = -1;
+    int sd;
+
+    sd = socket(address->sa_family, SOCK_DGRAM, 0);
+    if (sd < 0)
+        return -1;
+    if (connect(sd, address, address_len) < 0
+        || getsockopt(sd, address->sa_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP,
+                      address->sa_family == AF_INET6 ? IPV6_MTU : IP_MTU, &mtu, &len) < 0)
+        mtu = -1;
+    close(sd);
+    return mtu;
+}
+
+/*
+ * Unpredictable, for the initial sequence numbers, and safe to call from
+ * any thread. If the kernel has no getrandom(), a generator of the calling
+ * thread seeded from the clock takes over.
+ */
+static inline uint32_t io_random(void){
+    static __thread uint64_t state = 0;
+    struct timespec ts;
+    uint32_t value;
+
+    if (getrandom(&value, sizeof(value), GRND_NONBLOCK) == sizeof(value))
+        return value;
+    if (state == 0){
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        state = (ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)&state;
+        state |= 1;
+    }
+    /* xorshift64* */
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+#endif /* MICROTCP_SIM */
+
+#endif /* LIB_MICROTCP_IO_H_ */
@@ -0,0 +1,127 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "microtcp_metrics.h"
+#include "../utils/hash64.h"
+
+#define METRICS_WAYS 4          /* Entries per bucket, the oldest one makes room */
+#define METRICS_BUCKETS (MICROTCP_METRICS_SLOTS / METRICS_WAYS)
+
+/* The host part of an address, the port does not tell about the path */
+struct metrics_key {
+    sa_family_t family;
+    uint8_t addr[16];
+};
+
+struct metrics_entry {
+    struct metrics_key key;
+    int used;
+    uint64_t stamp_us;          /* When a connection last saved into it */
+    struct microtcp_metrics metrics;
+};
+
+static struct metrics_entry cache[METRICS_BUCKETS][METRICS_WAYS];
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns 0 for an address family without metrics */
+static int makeKey(const struct sockaddr *address, socklen_t address_len, struct metrics_key *key){
+    memset(key, 0, sizeof(struct metrics_key));
+    if (address == NULL)
+        return 0;
+    if (address->sa_family == AF_INET && address_len >= sizeof(struct sockaddr_in)){
+        memcpy(key->addr, &((const struct sockaddr_in *)address)->sin_addr, sizeof(struct in_addr));
+        key->family = AF_INET;
+        return 1;
+    }
+    if (address->sa_family == AF_INET6 && address_len >= sizeof(struct sockaddr_in6)){
+        memcpy(key->addr, &((const struct sockaddr_in6 *)address)->sin6_addr, sizeof(struct in6_addr));
+        key->family = AF_INET6;
+        return 1;
+    }
+    return 0;
+}
+
+static struct metrics_entry *bucketOf(const struct metrics_key *key){
+    return cache[hash64(key->addr, sizeof(key->addr), key->family) % METRICS_BUCKETS];
+}
+
+static int fresh(const struct metrics_entry *e, uint64_t now_us){
+    return e->used && now_us - e->stamp_us < MICROTCP_METRICS_AGE_US;
+}
+
+/* The entry of key if it is recent, NULL otherwise */
+static struct metrics_entry *findEntry(const struct metrics_key *key, uint64_t now_us){
+    struct metrics_entry *bucket = bucketOf(key);
+    int i;
+
+    for (i = 0; i < METRICS_WAYS; i++)
+        if (fresh(&bucket[i], now_us) && memcmp(&bucket[i].key, key, sizeof(struct metrics_key)) == 0)
+            return &bucket[i];
+    return NULL;
+}
+
+/* Averages the old and the new value, or takes the one that is known */
+static uint64_t blend(uint64_t old, uint64_t new){
+    if (old == 0 || new == 0)
+        return old ? old : new;
+    return (old + new) / 2;
+}
+
+int microtcp_metrics_lookup(const struct sockaddr *address, socklen_t address_len, struct microtcp_metrics *metrics,
+                            uint64_t now_us){
+    struct metrics_key key;
+    struct metrics_entry *e;
+
+    if (!makeKey(address, address_len, &key))
+        return 0;
+    pthread_mutex_lock(&cacheLock);
+    e = findEntry(&key, now_us);
+    if (e)
+        *metrics = e->metrics;
+    pthread_mutex_unlock(&cacheLock);
+    return e != NULL;
+}
+
+void microtcp_metrics_save(const struct sockaddr *address, socklen_t address_len,
+                           const struct microtcp_metrics *metrics, uint64_t now_us){
+    struct metrics_key key;
+    struct metrics_entry *bucket;
+    struct metrics_entry *e;
+    int i;
+
+    if (metrics->srtt_us == 0 || !makeKey(address, address_len, &key))
+        return;
+    pthread_mutex_lock(&cacheLock);
+    e = findEntry(&key, now_us);
+    if (e){
+        e->metrics.srtt_us = blend(e->metrics.srtt_us, metrics->srtt_us);
+        e->metrics.rttvar_us = blend(e->metrics.rttvar_us, metrics->rttvar_us);
+        e->metrics.ssthresh = blend(e->metrics.ssthresh, metrics->ssthresh);
+        e->metrics.send_rate = blend(e->metrics.send_rate, metrics->send_rate);
+        e->metrics.receive_rate = blend(e->metrics.receive_rate, metrics->receive_rate);
+    }
+    else{
+        /* A free or stale entry, or else the one updated longest ago */
+        bucket = bucketOf(&key);
+        e = &bucket[0];
+        for (i = 1; i < METRICS_WAYS && fresh(e, now_us); i++)
+            if (!fresh(&bucket[i], now_us) || bucket[i].stamp_us < e->stamp_us)
+                e = &bucket[i];
+        e->key = key;
+        e->used = 1;
+        e->metrics = *metrics;
+    }
+    e->stamp_us = now_us;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void microtcp_metrics_clear(void){
+    pthread_mutex_lock(&cacheLock);
+    memset(cache, 0, sizeof(cache));
+    pthread_mutex_unlock(&cacheLock);
+}
@@ -0,0 +1,59 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_METRICS_H_
+#define LIB_MICROTCP_METRICS_H_
+
+/*
+ * What earlier connections learned about a destination, like the
+ * tcp_metrics of Linux.
+ *
+ * A connection that closes leaves its smoothed RTT, RTT variance,
+ * ssthresh and delivery rates in both directions here, keyed by the
+ * address of the peer without the port. The next connection to the same
+ * host starts from them instead of from nothing: its RTO follows the RTT
+ * the path really has, RACK and the tail loss probe work from the first
+ * segment, and the initial cwnd and the receive buffer cover the
+ * bandwidth-delay product the path delivered, so a short transfer is not
+ * over before slow start is.
+ *
+ * The cache holds at most MICROTCP_METRICS_SLOTS destinations, evicting
+ * the least recently updated of a bucket, and forgets an entry nobody has
+ * updated for MICROTCP_METRICS_AGE_US. It belongs to the process and is
+ * shared by all of its threads.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define MICROTCP_METRICS_SLOTS 1024
+#define MICROTCP_METRICS_AGE_US 600000000ULL /* Paths change, after 10 minutes the metrics are forgotten */
+
+struct microtcp_metrics {
+    uint64_t srtt_us;
+    uint64_t rttvar_us;
+    size_t ssthresh;            /* 0 if no loss was ever seen */
+    uint64_t send_rate;         /* The windowed maximum delivery rate in bytes per second, 0 if unknown */
+    uint64_t receive_rate;      /* The highest rate the peer sent at, 0 if unknown */
+};
+
+/**
+ * Copies what the cache knows about the host of address into metrics.
+ * @return 1 if it knows something recent, 0 otherwise
+ */
+int microtcp_metrics_lookup(const struct sockaddr *address, socklen_t address_len, struct microtcp_metrics *metrics,
+                            uint64_t now_us);
+
+/**
+ * Folds the metrics of a closing connection into what the cache knows
+ * about the host of address, half the old and half the new.
+ */
+void microtcp_metrics_save(const struct sockaddr *address, socklen_t address_len,
+                           const struct microtcp_metrics *metrics, uint64_t now_us);
+
+/* Forgets every destination, for when the network of the host changed */
+void microtcp_metrics_clear(void);
+
+#endif /* LIB_MICROTCP_METRICS_H_ */
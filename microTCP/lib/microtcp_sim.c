@@ -0,0 +1,603 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "microtcp_sim.h"
+
+#define SIM_TASK_STACK (1024 * 1024) /* microTCP keeps whole segments of up to 64 KiB on the stack */
+#define SIM_DEFAULT_RCVBUF 212992
+#define SIM_EPHEMERAL_PORT 32768
+#define SIM_DEFAULT_MTU 65535
+#define SIM_IP_UDP_HEADERS 28
+
+typedef struct sim_task
+{
+    void *(*fn)(void *);
+    void *arg;
+    pthread_cond_t cond;
+    int running;                /* Holds the (single) virtual CPU */
+    int ready;                  /* Waits in the ready queue */
+    int side;
+    uint64_t wait_gen;          /* Invalidates stale timeouts */
+    int timed_out;
+    struct sim_task *next_ready;
+} sim_task_t;
+
+typedef struct sim_packet
+{
+    struct sim_packet *next;
+    struct sockaddr_in from;
+    size_t len;
+    uint8_t data[];
+} sim_packet_t;
+
+typedef struct
+{
+    int side;
+    uint16_t port;
+    uint64_t timeout_us;        /* SO_RCVTIMEO, 0 blocks forever */
+    size_t rcvbuf;
+    size_t queued;
+    sim_packet_t *head;
+    sim_packet_t *tail;
+    sim_task_t *waiter;
+} sim_sock_t;
+
+enum { SIM_EV_DELIVER, SIM_EV_TIMER };
+
+typedef struct
+{
+    uint64_t time;
+    uint64_t order;             /* Events of the same time run in creation order */
+    int type;
+    uint16_t port;
+    sim_packet_t *packet;
+    sim_task_t *task;
+    uint64_t gen;
+} sim_event_t;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static __thread sim_task_t *self;
+static sim_task_t *current;
+static sim_task_t *ready_head;
+static sim_task_t *ready_tail;
+static int alive_tasks;
+
+static sim_link_t net;
+static sim_stats_t stats;
+static uint64_t sim_clock;
+static uint64_t rng_state;
+static uint64_t busy_until[2];
+
+static sim_event_t *events;
+static size_t events_len;
+static size_t events_cap;
+static uint64_t events_order;
+
+static sim_sock_t **socks;
+static size_t socks_len;
+static int port_map[65536];     /* Port to socket descriptor + 1 */
+static uint16_t next_port = SIM_EPHEMERAL_PORT;
+
+/* xorshift64* generator, the only source of randomness of the simulation */
+static uint64_t next_random(void){
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double uniform(void){
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int event_less(const sim_event_t *a, const sim_event_t *b){
+    if (a->time != b->time)
+        return a->time < b->time;
+    return a->order < b->order;
+}
+
+static int push_event(sim_event_t *ev){
+    size_t i, parent;
+    sim_event_t *tmp;
+
+    if (events_len == events_cap){
+        tmp = realloc(events, (events_cap ? 2 * events_cap : 1024) * sizeof(sim_event_t));
+        if (!tmp)
+            return -1;
+        events = tmp;
+        events_cap = events_cap ? 2 * events_cap : 1024;
+    }
+    ev->order = events_order++;
+    i = events_len++;
+    while (i > 0){
+        parent = (i - 1) / 2;
+        if (!event_less(ev, &events[parent]))
+            break;
+        events[i] = events[parent];
+        i = parent;
+    }
+    events[i] = *ev;
+    return 0;
+}
+
+static sim_event_t pop_event(void){
+    sim_event_t top = events[0];
+    sim_event_t last = events[--events_len];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < events_len){
+        if (child + 1 < events_len && event_less(&events[child + 1], &events[child]))
+            child++;
+        if (!event_less(&events[child], &last))
+            break;
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+static void make_ready(sim_task_t *t){
+    if (t->ready)
+        return;
+    t->ready = 1;
+    t->next_ready = NULL;
+    if (ready_tail)
+        ready_tail->next_ready = t;
+    else
+        ready_head = t;
+    ready_tail = t;
+}
+
+/* Gives the CPU back to the scheduler until someone makes us ready again */
+static void block(void){
+    sim_task_t *t = self;
+    t->running = 0;
+    current = NULL;
+    pthread_cond_signal(&sched_cond);
+    while (!t->running)
+        pthread_cond_wait(&t->cond, &sim_lock);
+}
+
+static void add_timer(sim_task_t *t, uint64_t at){
+    sim_event_t ev;
+    memset(&ev, 0, sizeof(sim_event_t));
+    ev.time = at;
+    ev.type = SIM_EV_TIMER;
+    ev.task = t;
+    ev.gen = t->wait_gen;
+    push_event(&ev);
+}
+
+static void *task_main(void *arg){
+    sim_task_t *t = (sim_task_t *)arg;
+    size_t i;
+
+    pthread_mutex_lock(&sim_lock);
+    self = t;
+    while (!t->running)
+        pthread_cond_wait(&t->cond, &sim_lock);
+    t->fn(t->arg);
+
+    /* A timer of the last wait may still be pending, it wakes nobody now */
+    for (i = 0; i < events_len; i++)
+        if (events[i].type == SIM_EV_TIMER && events[i].task == t)
+            events[i].task = NULL;
+    alive_tasks--;
+    current = NULL;
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sim_lock);
+    pthread_cond_destroy(&t->cond);
+    free(t);
+    return NULL;
+}
+
+static sim_sock_t *lookup(int sd){
+    if (sd < 0 || (size_t)sd >= socks_len || !socks[sd]){
+        errno = EBADF;
+        return NULL;
+    }
+    return socks[sd];
+}
+
+static int assign_port(sim_sock_t *s, int sd, uint16_t port){
+    int tries;
+    if (port == 0){
+        for (tries = 0; tries < 65536 - SIM_EPHEMERAL_PORT; tries++){
+            port = next_port;
+            next_port = next_port == 65535 ? SIM_EPHEMERAL_PORT : next_port + 1;
+            if (!port_map[port])
+                break;
+        }
+    }
+    if (port_map[port]){
+        errno = EADDRINUSE;
+        return -1;
+    }
+    s->port = port;
+    port_map[port] = sd + 1;
+    return 0;
+}
+
+void sim_init(uint64_t seed, const sim_link_t *l){
+    size_t i;
+    sim_packet_t *p;
+
+    pthread_mutex_lock(&sim_lock);
+    for (i = 0; i < socks_len; i++){
+        if (!socks[i])
+            continue;
+        while ((p = socks[i]->head)){
+            socks[i]->head = p->next;
+            free(p);
+        }
+        free(socks[i]);
+    }
+    free(socks);
+    socks = NULL;
+    socks_len = 0;
+    for (i = 0; i < events_len; i++)
+        free(events[i].packet);
+    events_len = 0;
+    events_order = 0;
+    memset(port_map, 0, sizeof(port_map));
+    next_port = SIM_EPHEMERAL_PORT;
+
+    memset(&stats, 0, sizeof(sim_stats_t));
+    memset(&net, 0, sizeof(sim_link_t));
+    if (l)
+        net = *l;
+    sim_clock = 0;
+    busy_until[0] = busy_until[1] = 0;
+    rng_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    ready_head = ready_tail = NULL;
+    alive_tasks = 0;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int sim_spawn(int side, void *(*fn)(void *), void *arg){
+    pthread_attr_t attr;
+    pthread_t thread;
+    sim_task_t *t;
+    int in_task = self != NULL;
+    int ret;
+
+    t = calloc(1, sizeof(sim_task_t));
+    if (!t)
+        return -1;
+    t->fn = fn;
+    t->arg = arg;
+    t->side = side;
+    pthread_cond_init(&t->cond, NULL);
+
+    if (!in_task)
+        pthread_mutex_lock(&sim_lock);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SIM_TASK_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, task_main, t);
+    pthread_attr_destroy(&attr);
+    if (ret == 0){
+        alive_tasks++;
+        make_ready(t);
+    }
+    else {
+        pthread_cond_destroy(&t->cond);
+        free(t);
+    }
+    if (!in_task)
+        pthread_mutex_unlock(&sim_lock);
+    return ret == 0 ? 0 : -1;
+}
+
+uint64_t sim_run(uint64_t until_us){
+    sim_event_t ev;
+    sim_sock_t *s;
+    sim_task_t *t;
+    int sd;
+
+    pthread_mutex_lock(&sim_lock);
+    while (alive_tasks > 0){
+        if (ready_head){
+            t = ready_head;
+            ready_head = t->next_ready;
+            if (!ready_head)
+                ready_tail = NULL;
+            t->ready = 0;
+            t->running = 1;
+            current = t;
+            pthread_cond_signal(&t->cond);
+            while (current)
+                pthread_cond_wait(&sched_cond, &sim_lock);
+            continue;
+        }
+        if (events_len == 0)
+            break;                  /* Everybody waits for something that never comes */
+        if (events[0].time > until_us){
+            sim_clock = until_us;
+            break;
+        }
+
+        ev = pop_event();
+        if (ev.time > sim_clock)
+            sim_clock = ev.time;
+        stats.events++;
+        if (ev.type == SIM_EV_TIMER){
+            if (ev.task && ev.task->wait_gen == ev.gen){
+                ev.task->wait_gen++;
+                ev.task->timed_out = 1;
+                make_ready(ev.task);
+            }
+            continue;
+        }
+
+        sd = port_map[ev.port] - 1;
+        s = sd >= 0 ? socks[sd] : NULL;
+        if (!s || s->queued + ev.packet->len > s->rcvbuf){
+            stats.queue_drops++;
+            free(ev.packet);
+            continue;
+        }
+        stats.delivered++;
+        s->queued += ev.packet->len;
+        if (s->tail)
+            s->tail->next = ev.packet;
+        else
+            s->head = ev.packet;
+        s->tail = ev.packet;
+        if (s->waiter){
+            t = s->waiter;
+            s->waiter = NULL;
+            t->wait_gen++;
+            make_ready(t);
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return sim_clock;
+}
+
+uint64_t sim_now_us(void){
+    return sim_clock;
+}
+
+void sim_sleep_us(uint64_t us){
+    add_timer(self, sim_clock + us);
+    block();
+    self->timed_out = 0;
+}
+
+uint32_t sim_random(void){
+    return next_random() >> 32;
+}
+
+void sim_get_stats(sim_stats_t *out){
+    *out = stats;
+}
+
+int sim_socket(int domain, int type, int protocol){
+    sim_sock_t **tmp;
+    sim_sock_t *s;
+
+    (void)type;         /* Always a datagram socket */
+    (void)protocol;
+    if (domain != AF_INET){
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    s = calloc(1, sizeof(sim_sock_t));
+    if (!s){
+        errno = ENOMEM;
+        return -1;
+    }
+    tmp = realloc(socks, (socks_len + 1) * sizeof(sim_sock_t *));
+    if (!tmp){
+        free(s);
+        errno = ENOMEM;
+        return -1;
+    }
+    socks = tmp;
+    s->side = self ? self->side : SIM_LEFT;
+    s->rcvbuf = SIM_DEFAULT_RCVBUF;
+    socks[socks_len] = s;
+    return socks_len++;
+}
+
+int sim_bind(int sd, const struct sockaddr *address, socklen_t address_len){
+    sim_sock_t *s = lookup(sd);
+    if (!s)
+        return -1;
+    if (s->port || address_len < sizeof(struct sockaddr_in)){
+        errno = EINVAL;
+        return -1;
+    }
+    return assign_port(s, sd, ntohs(((const struct sockaddr_in *)address)->sin_port));
+}
+
+int sim_getsockname(int sd, struct sockaddr *address, socklen_t *address_len){
+    sim_sock_t *s = lookup(sd);
+    struct sockaddr_in local;
+
+    if (!s)
+        return -1;
+    memset(&local, 0, sizeof(struct sockaddr_in));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(s->port);
+    memcpy(address, &local, *address_len < sizeof(struct sockaddr_in) ? *address_len : sizeof(struct sockaddr_in));
+    *address_len = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+ssize_t sim_sendto(int sd, const void *buffer, size_t length, int flags,
+                   const struct sockaddr *address, socklen_t address_len){
+    sim_sock_t *s = lookup(sd);
+    sim_sock_t *dst;
+    sim_packet_t *p;
+    sim_event_t ev;
+    uint64_t at = sim_clock;
+    uint64_t start;
+    int dsd;
+
+    (void)flags;        /* Never blocks, the bottleneck queue takes or drops the datagram */
+    if (!s)
+        return -1;
+    if (!address || address_len < sizeof(struct sockaddr_in)){
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    if (!s->port && assign_port(s, sd, 0) < 0)
+        return -1;
+    if (length + SIM_IP_UDP_HEADERS > (size_t)sim_path_mtu(address, address_len)){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    stats.sent++;
+
+    /* Nobody listens there, the datagram silently disappears */
+    dsd = port_map[ntohs(((const struct sockaddr_in *)address)->sin_port)] - 1;
+    if (dsd < 0)
+        return length;
+    dst = socks[dsd];
+
+    if (dst->side != s->side){
+        if (net.mtu && length + SIM_IP_UDP_HEADERS > net.mtu){
+            /* Too big for the bottleneck, which does not report it (a black hole) */
+            stats.mtu_drops++;
+            return length;
+        }
+        if (net.loss > 0 && uniform() < net.loss){
+            stats.lost++;
+            return length;
+        }
+        if (net.rate_bps){
+            start = busy_until[s->side] > sim_clock ? busy_until[s->side] : sim_clock;
+            if (net.queue_bytes && (start - sim_clock) * net.rate_bps / 8000000 > net.queue_bytes){
+                stats.queue_drops++;
+                return length;
+            }
+            busy_until[s->side] = start + length * 8 * 1000000ULL / net.rate_bps;
+            at = busy_until[s->side];
+        }
+    }
+    at += net.delay_us;
+    if (net.jitter_us)
+        at += next_random() % (net.jitter_us + 1);
+
+    p = malloc(sizeof(sim_packet_t) + length);
+    if (!p){
+        errno = ENOMEM;
+        return -1;
+    }
+    p->next = NULL;
+    p->len = length;
+    memcpy(p->data, buffer, length);
+    memset(&p->from, 0, sizeof(struct sockaddr_in));
+    p->from.sin_family = AF_INET;
+    p->from.sin_port = htons(s->port);
+    p->from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(&ev, 0, sizeof(sim_event_t));
+    ev.time = at;
+    ev.type = SIM_EV_DELIVER;
+    ev.port = ntohs(((const struct sockaddr_in *)address)->sin_port);
+    ev.packet = p;
+    if (push_event(&ev) < 0){
+        free(p);
+        errno = ENOMEM;
+        return -1;
+    }
+    return length;
+}
+
+ssize_t sim_recvfrom(int sd, void *buffer, size_t length, int flags,
+                     struct sockaddr *address, socklen_t *address_len){
+    sim_sock_t *s = lookup(sd);
+    sim_packet_t *p;
+    size_t len;
+
+    if (!s)
+        return -1;
+    while (!s->head){
+        if (flags & MSG_DONTWAIT){
+            errno = EAGAIN;
+            return -1;
+        }
+        s->waiter = self;
+        self->timed_out = 0;
+        if (s->timeout_us)
+            add_timer(self, sim_clock + s->timeout_us);
+        block();
+        s->waiter = NULL;
+        if (self->timed_out){
+            self->timed_out = 0;
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    p = s->head;
+    s->head = p->next;
+    if (!s->head)
+        s->tail = NULL;
+    s->queued -= p->len;
+
+    len = p->len < length ? p->len : length;
+    memcpy(buffer, p->data, len);
+    if (address && address_len){
+        memcpy(address, &p->from, *address_len < sizeof(struct sockaddr_in) ? *address_len : sizeof(struct sockaddr_in));
+        *address_len = sizeof(struct sockaddr_in);
+    }
+    free(p);
+    return len;
+}
+
+int sim_setsockopt(int sd, int level, int optname, const void *optval, socklen_t optlen){
+    sim_sock_t *s = lookup(sd);
+    const struct timeval *tv;
+
+    if (!s)
+        return -1;
+    if (level != SOL_SOCKET)
+        return 0;
+    if (optname == SO_RCVTIMEO && optlen >= sizeof(struct timeval)){
+        tv = (const struct timeval *)optval;
+        s->timeout_us = tv->tv_sec * 1000000ULL + tv->tv_usec;
+    }
+    else if (optname == SO_RCVBUF && optlen >= sizeof(int)){
+        s->rcvbuf = *(const int *)optval;
+    }
+    return 0;
+}
+
+int sim_close(int sd){
+    sim_sock_t *s = lookup(sd);
+    sim_packet_t *p;
+
+    if (!s)
+        return -1;
+    if (s->port)
+        port_map[s->port] = 0;
+    while ((p = s->head)){
+        s->head = p->next;
+        free(p);
+    }
+    free(s);
+    socks[sd] = NULL;
+    return 0;
+}
+
+int sim_path_mtu(const struct sockaddr *address, socklen_t address_len){
+    (void)address;      /* A single path */
+    (void)address_len;
+    return net.interface_mtu ? net.interface_mtu : SIM_DEFAULT_MTU;
+}
@@ -0,0 +1,128 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_SIM_H_
+#define LIB_MICROTCP_SIM_H_
+
+/*
+ * Deterministic simulated network with a virtual clock.
+ *
+ * The library built with MICROTCP_SIM (target microtcp_sim) sends and
+ * receives through these functions instead of the real UDP sockets.
+ * Every endpoint runs as a simulation task. Only one task runs at any time
+ * and the virtual clock advances only when all the tasks are blocked, by
+ * jumping to the next event (a datagram delivery or a timeout). So a run
+ * takes as long as the CPU work it contains and, for the same seed, always
+ * produces the same result.
+ *
+ * The topology is a dumbbell. Every task lives either on the left or on
+ * the right side. Datagrams that cross sides go through the bottleneck of
+ * their direction, which has a rate, a drop-tail queue and random loss.
+ * All the datagrams see the propagation delay plus jitter.
+ *
+ * Tasks must block only through the functions below (or the microTCP
+ * calls built on them), never on real I/O or on each other.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define SIM_LEFT 0
+#define SIM_RIGHT 1
+
+typedef struct
+{
+  uint64_t delay_us;            /* One way propagation delay */
+  uint64_t jitter_us;           /* Uniform jitter added to the delay */
+  double loss;                  /* Random loss probability at the bottleneck */
+  uint64_t rate_bps;            /* Bottleneck rate of each direction, 0 for infinite */
+  uint64_t queue_bytes;         /* Bottleneck queue of each direction */
+  uint32_t mtu;                 /* Larger datagrams (IP and UDP headers included) vanish at the bottleneck, 0 for no limit */
+  uint32_t interface_mtu;       /* The MTU the endpoints see, 0 for 65535 */
+} sim_link_t;
+
+typedef struct
+{
+  uint64_t sent;
+  uint64_t delivered;
+  uint64_t lost;
+  uint64_t queue_drops;
+  uint64_t mtu_drops;
+  uint64_t events;
+} sim_stats_t;
+
+/**
+ * Resets the simulation.
+ *
+ * @param seed the seed of every random decision of the simulation
+ * @param link the link parameters, copied by the simulator
+ */
+void
+sim_init (uint64_t seed, const sim_link_t *link);
+
+/**
+ * Creates a task that runs fn(arg) on the given side of the dumbbell.
+ * The task starts running at the next sim_run().
+ * @return 0 on success or -1 on failure
+ */
+int
+sim_spawn (int side, void *(*fn)(void *), void *arg);
+
+/**
+ * Runs the simulation until all the tasks exit, all of them are blocked
+ * with nothing left to happen, or the virtual clock reaches until_us.
+ * @return the virtual time in microseconds at the end of the run
+ */
+uint64_t
+sim_run (uint64_t until_us);
+
+uint64_t
+sim_now_us (void);
+
+void
+sim_sleep_us (uint64_t us);
+
+uint32_t
+sim_random (void);
+
+void
+sim_get_stats (sim_stats_t *stats);
+
+/*
+ * Socket calls with the semantics of their POSIX counterparts for
+ * AF_INET datagram sockets. SO_RCVTIMEO and SO_RCVBUF are honored.
+ */
+int
+sim_socket (int domain, int type, int protocol);
+
+int
+sim_bind (int sd, const struct sockaddr *address, socklen_t address_len);
+
+/* Port 0 until the socket is bound or sends */
+int
+sim_getsockname (int sd, struct sockaddr *address, socklen_t *address_len);
+
+ssize_t
+sim_sendto (int sd, const void *buffer, size_t length, int flags,
+            const struct sockaddr *address, socklen_t address_len);
+
+ssize_t
+sim_recvfrom (int sd, void *buffer, size_t length, int flags,
+              struct sockaddr *address, socklen_t *address_len);
+
+int
+sim_setsockopt (int sd, int level, int optname, const void *optval,
+                socklen_t optlen);
+
+int
+sim_close (int sd);
+
+/**
+ * @return the interface MTU of the simulated link
+ */
+int
+sim_path_mtu (const struct sockaddr *address, socklen_t address_len);
+
+#endif /* LIB_MICROTCP_SIM_H_ */
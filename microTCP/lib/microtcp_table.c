@@ -0,0 +1,132 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "microtcp_table.h"
+#include "microtcp_io.h"
+
+#define TABLE_INDEX_BITS 20
+#define TABLE_GEN_MASK ((1U << (32 - TABLE_INDEX_BITS)) - 1)
+
+struct microtcp_table {
+    microtcp_sock_t *slots;     /* Aligned to the cache line like microtcp_sock_t itself */
+    uint32_t *gens;             /* Generation of each slot, odd while it is open */
+    uint32_t *free_list;        /* Indexes of the free slots, a stack */
+    size_t free_count;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+static microtcp_handle_t makeHandle(uint32_t gen, uint32_t index){
+    return ((gen & TABLE_GEN_MASK) << TABLE_INDEX_BITS) | (index + 1);
+}
+
+/* The slot of an open handle, -1 for a stale or invalid one */
+static long handleSlot(microtcp_table_t *table, microtcp_handle_t handle){
+    uint32_t index = (handle & MICROTCP_TABLE_MAX) - 1;
+    uint32_t gen;
+
+    if (handle == MICROTCP_NO_HANDLE || index >= table->capacity)
+        return -1;
+    gen = __atomic_load_n(&table->gens[index], __ATOMIC_ACQUIRE);
+    if (!(gen & 1) || makeHandle(gen, index) != handle)
+        return -1;
+    return index;
+}
+
+microtcp_table_t *microtcp_table_create(size_t capacity){
+    microtcp_table_t *table;
+    size_t i;
+
+    if (capacity == 0 || capacity > MICROTCP_TABLE_MAX)
+        return NULL;
+    table = calloc(1, sizeof(microtcp_table_t));
+    if (!table)
+        return NULL;
+    /* aligned_alloc() wants a multiple of the alignment, which sizeof(microtcp_sock_t) is */
+    table->slots = aligned_alloc(MICROTCP_CACHE_LINE, capacity * sizeof(microtcp_sock_t));
+    table->gens = calloc(capacity, sizeof(uint32_t));
+    table->free_list = malloc(capacity * sizeof(uint32_t));
+    if (!table->slots || !table->gens || !table->free_list){
+        free(table->slots);
+        free(table->gens);
+        free(table->free_list);
+        free(table);
+        return NULL;
+    }
+    /* Hand out the low slots first, they share pages with each other */
+    for (i = 0; i < capacity; i++)
+        table->free_list[i] = capacity - 1 - i;
+    table->free_count = capacity;
+    table->capacity = capacity;
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+void microtcp_table_destroy(microtcp_table_t *table){
+    size_t i;
+
+    if (!table)
+        return;
+    for (i = 0; i < table->capacity; i++)
+        if (table->gens[i] & 1)
+            microtcp_table_close(table, makeHandle(table->gens[i], i));
+    pthread_mutex_destroy(&table->lock);
+    free(table->slots);
+    free(table->gens);
+    free(table->free_list);
+    free(table);
+}
+
+microtcp_handle_t microtcp_table_open(microtcp_table_t *table, int domain, int type, int protocol){
+    microtcp_sock_t sock;
+    uint32_t index;
+    uint32_t gen;
+
+    sock = microtcp_socket(domain, type, protocol);
+    if (sock.state == INVALID)
+        return MICROTCP_NO_HANDLE;
+
+    pthread_mutex_lock(&table->lock);
+    if (table->free_count == 0){
+        pthread_mutex_unlock(&table->lock);
+        io_close(sock.sd);
+        return MICROTCP_NO_HANDLE;
+    }
+    index = table->free_list[--table->free_count];
+    table->slots[index] = sock;
+    /* Odd while open, the index part keeps a handle from ever being 0 */
+    gen = table->gens[index] + 1;
+    __atomic_store_n(&table->gens[index], gen, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table->lock);
+    return makeHandle(gen, index);
+}
+
+microtcp_sock_t *microtcp_table_get(microtcp_table_t *table, microtcp_handle_t handle){
+    long index = handleSlot(table, handle);
+
+    return index < 0 ? NULL : &table->slots[index];
+}
+
+int microtcp_table_close(microtcp_table_t *table, microtcp_handle_t handle){
+    long index;
+
+    pthread_mutex_lock(&table->lock);
+    index = handleSlot(table, handle);
+    if (index < 0){
+        pthread_mutex_unlock(&table->lock);
+        return -1;
+    }
+    __atomic_store_n(&table->gens[index], table->gens[index] + 1, __ATOMIC_RELEASE);
+    if (table->slots[index].sd >= 0)
+        io_close(table->slots[index].sd);
+    table->slots[index].sd = -1;
+    table->slots[index].state = INVALID;
+    table->free_list[table->free_count++] = index;
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_TABLE_H_
+#define LIB_MICROTCP_TABLE_H_
+
+/*
+ * A table of connections for a process that serves many of them.
+ *
+ * microtcp_socket() returns the connection state by value, so the caller
+ * decides where it lives, and a struct full of them or a vector of
+ * pointers scatters it over the heap with no regard for its cache lines.
+ * The table keeps all the sockets in one array aligned to the cache line,
+ * so the hot groups of microtcp_sock_t stay on lines of their own, and
+ * hands out handles instead of pointers.
+ * A handle carries the generation of its slot, so a handle kept after
+ * microtcp_table_close() is refused instead of reaching the connection
+ * that reused the slot.
+ *
+ * Opening and closing take a lock. Looking a handle up does not, and the
+ * socket it returns is used by one thread at a time like any other.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "microtcp.h"
+
+typedef uint32_t microtcp_handle_t;
+
+#define MICROTCP_NO_HANDLE 0
+#define MICROTCP_TABLE_MAX ((1 << 20) - 1)  /* Slots a table can hold, the index part of a handle */
+
+typedef struct microtcp_table microtcp_table_t;
+
+/**
+ * Creates a table for up to capacity connections, at most MICROTCP_TABLE_MAX.
+ * @return the table or NULL on failure
+ */
+microtcp_table_t *
+microtcp_table_create (size_t capacity);
+
+/* Closes the connections still open and frees the table */
+void
+microtcp_table_destroy (microtcp_table_t *table);
+
+/**
+ * Creates a socket like microtcp_socket() in a free slot of the table.
+ * @return its handle, or MICROTCP_NO_HANDLE if the table is full or the
+ * socket could not be created
+ */
+microtcp_handle_t
+microtcp_table_open (microtcp_table_t *table, int domain, int type, int protocol);
+
+/**
+ * The socket of handle, stable until the handle is closed.
+ * @return the socket or NULL if the handle is not open
+ */
+microtcp_sock_t *
+microtcp_table_get (microtcp_table_t *table, microtcp_handle_t handle);
+
+/**
+ * Closes the UDP socket of the connection and frees its slot. The
+ * connection should have been shut down before.
+ * @return 0 on success or -1 if the handle is not open
+ */
+int
+microtcp_table_close (microtcp_table_t *table, microtcp_handle_t handle);
+
+#endif /* LIB_MICROTCP_TABLE_H_ */
@@ -0,0 +1,213 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "microtcp_trace.h"
+#include "microtcp_io.h"
+
+#define TRACE_RING_LEN 8192     /* Events per thread, a power of 2 */
+#define TRACE_DEFAULT_INTERVAL_US 10000
+
+/*
+ * Single producer (the owner thread), single consumer (the drainer) ring.
+ * head and tail only grow, the slot of an event is its index modulo the
+ * length of the ring.
+ */
+typedef struct trace_ring
+{
+    microtcp_trace_event_t events[TRACE_RING_LEN];
+    uint64_t head;              /* Written only by the owner */
+    uint64_t tail;              /* Written only by the drainer */
+    uint64_t dropped;
+    uint64_t reported;          /* Drops already written, drainer only */
+    int exited;                 /* The owner has exited, free it once drained */
+    uint16_t thread;
+    struct trace_ring *next;
+} trace_ring_t;
+
+volatile int microtcp_trace_active = 0;
+
+static __thread trace_ring_t *ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* Protects the list of rings and the drainer state, never taken by emit */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static uint16_t next_thread;
+static pthread_t drainer;
+static FILE *trace_fp;
+static uint64_t interval;
+static int stopping;
+static int atexit_registered;
+
+static void ring_exited(void *arg){
+    trace_ring_t *r = (trace_ring_t *)arg;
+    __atomic_store_n(&r->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void){
+    pthread_key_create(&ring_key, ring_exited);
+}
+
+/* Allocates and registers the ring of the calling thread */
+static trace_ring_t *new_ring(void){
+    trace_ring_t *r;
+
+    r = calloc(1, sizeof(trace_ring_t));
+    if (r == NULL)
+        return NULL;
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, r);
+    pthread_mutex_lock(&trace_lock);
+    r->thread = next_thread++;
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&trace_lock);
+    return r;
+}
+
+void microtcp_trace_emit(uint16_t type, int sd, uint32_t seq, uint32_t ack, uint32_t len, uint32_t arg){
+    microtcp_trace_event_t *ev;
+    uint64_t head;
+
+    if (ring == NULL && (ring = new_ring()) == NULL)
+        return;
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_LEN){
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ev = &ring->events[head & (TRACE_RING_LEN - 1)];
+    ev->time_ns = io_now_ns();
+    ev->type = type;
+    ev->thread = ring->thread;
+    ev->sd = sd;
+    ev->seq = seq;
+    ev->ack = ack;
+    ev->len = len;
+    ev->arg = arg;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the new events of every ring to the file. Called with trace_lock held. */
+static void drain(void){
+    trace_ring_t **link = &rings;
+    trace_ring_t *r;
+    microtcp_trace_event_t dropped;
+    uint64_t head, tail, first, count, lost;
+    int exited;
+
+    while ((r = *link) != NULL){
+        exited = __atomic_load_n(&r->exited, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        while (tail != head){
+            first = tail & (TRACE_RING_LEN - 1);
+            count = head - tail < TRACE_RING_LEN - first ? head - tail : TRACE_RING_LEN - first;
+            fwrite(&r->events[first], sizeof(microtcp_trace_event_t), count, trace_fp);
+            tail += count;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        lost = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (lost != r->reported){
+            memset(&dropped, 0, sizeof(microtcp_trace_event_t));
+            dropped.time_ns = io_now_ns();
+            dropped.type = TRACE_DROPPED;
+            dropped.thread = r->thread;
+            dropped.sd = -1;
+            dropped.arg = lost - r->reported;
+            fwrite(&dropped, sizeof(microtcp_trace_event_t), 1, trace_fp);
+            r->reported = lost;
+        }
+
+        if (exited){
+            *link = r->next;
+            free(r);
+        }
+        else
+            link = &r->next;
+    }
+    fflush(trace_fp);
+}
+
+static void *drainer_main(void *arg){
+    struct timespec ts;
+
+    (void)arg;
+    ts.tv_sec = interval / 1000000;
+    ts.tv_nsec = (interval % 1000000) * 1000;
+    pthread_mutex_lock(&trace_lock);
+    while (!stopping){
+        pthread_mutex_unlock(&trace_lock);
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&trace_lock);
+        drain();
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+int microtcp_trace_start(const char *path, uint64_t interval_us){
+    microtcp_trace_file_header_t header;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp != NULL){
+        pthread_mutex_unlock(&trace_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    trace_fp = fopen(path, "w");
+    if (trace_fp == NULL){
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    memset(&header, 0, sizeof(microtcp_trace_file_header_t));
+    memcpy(header.magic, MICROTCP_TRACE_MAGIC, sizeof(header.magic));
+    header.version = MICROTCP_TRACE_VERSION;
+    header.event_size = sizeof(microtcp_trace_event_t);
+    fwrite(&header, sizeof(microtcp_trace_file_header_t), 1, trace_fp);
+
+    interval = interval_us ? interval_us : TRACE_DEFAULT_INTERVAL_US;
+    stopping = 0;
+    if (pthread_create(&drainer, NULL, drainer_main, NULL) != 0){
+        fclose(trace_fp);
+        trace_fp = NULL;
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    if (!atexit_registered){
+        atexit(microtcp_trace_stop);
+        atexit_registered = 1;
+    }
+    microtcp_trace_active = 1;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void microtcp_trace_stop(void){
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp == NULL){
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    microtcp_trace_active = 0;
+    stopping = 1;
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(drainer, NULL);
+
+    /* Whatever the threads recorded before they saw the flag */
+    pthread_mutex_lock(&trace_lock);
+    drain();
+    fclose(trace_fp);
+    trace_fp = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,95 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_TRACE_H_
+#define LIB_MICROTCP_TRACE_H_
+
+/*
+ * Binary event tracing of the protocol paths.
+ *
+ * Every thread that records an event gets its own ring of fixed size
+ * events. Only that thread writes to the ring and only the drainer reads
+ * from it, so recording an event is a few stores and no locks or system
+ * calls. The drainer is a background thread that periodically copies the
+ * rings to a file. If a ring fills up before it is drained, the new events
+ * are dropped and counted, the protocol is never slowed down.
+ *
+ * Events are recorded only while the drainer runs and only if their level
+ * is enabled in utils/log.h, both at compile time and at runtime.
+ * The trace_decode tool turns the file into text.
+ */
+
+#include <stdint.h>
+
+#include "../utils/log.h"
+
+#define MICROTCP_TRACE_MAGIC "MTCPTRC1"
+#define MICROTCP_TRACE_VERSION 1
+
+typedef enum
+{
+  TRACE_SEGMENT_SENT = 1,       /* seq, ack, len, arg = control */
+  TRACE_SEGMENT_RECEIVED,       /* seq, ack, len, arg = control */
+  TRACE_ACK,                    /* seq = una, ack, len = bytes acked, arg = duplicate ACKs */
+  TRACE_RETRANSMIT,             /* seq = una, len = bytes in flight, arg = 0 timeout, 1 fast retransmit,
+                                   2 tail loss probe (seq and len of the probed segment) */
+  TRACE_CWND,                   /* seq = una, len = ssthresh, arg = cwnd */
+  TRACE_STATE,                  /* seq, ack, len = old state, arg = new state */
+  TRACE_ERROR,                  /* seq, ack, len = source line, arg = errno */
+  TRACE_DROPPED,                /* arg = events dropped by the thread, written by the drainer */
+  TRACE_MSS                     /* seq = una, len = old segment size, arg = new segment size */
+} microtcp_trace_type_t;
+
+typedef struct
+{
+  uint64_t time_ns;             /* io_now_ns(), the virtual clock in the simulator */
+  uint16_t type;
+  uint16_t thread;              /* Small id of the recording thread */
+  int32_t sd;
+  uint32_t seq;
+  uint32_t ack;
+  uint32_t len;
+  uint32_t arg;
+} microtcp_trace_event_t;
+
+/* The trace file starts with this header, followed by the events */
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+} microtcp_trace_file_header_t;
+
+/* Set while the drainer runs, checked before anything else is done */
+extern volatile int microtcp_trace_active;
+
+#define TRACE_EVENT(level, type, sd, seq, ack, len, arg)                        \
+        do {                                                                    \
+          if (LOG_ENABLED(level) && microtcp_trace_active)                      \
+            microtcp_trace_emit(type, sd, seq, ack, len, arg);                  \
+        } while (0)
+
+/**
+ * Starts the drainer, which writes the events of all the threads to the
+ * file at path every interval_us. Stopped automatically at exit.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_trace_start (const char *path, uint64_t interval_us);
+
+/**
+ * Stops recording, writes what is left in the rings and closes the file.
+ */
+void
+microtcp_trace_stop (void);
+
+/**
+ * Records an event in the ring of the calling thread. Use TRACE_EVENT(),
+ * which skips the call when the event would be filtered out.
+ */
+void
+microtcp_trace_emit (uint16_t type, int sd, uint32_t seq, uint32_t ack,
+                     uint32_t len, uint32_t arg);
+
+#endif /* LIB_MICROTCP_TRACE_H_ */
@@ -0,0 +1,468 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "microtcp_uring.h"
+
+#define URING_RECV_BUFS 64      /* Receive buffers registered with the ring, a power of 2 */
+#define URING_SEND_SLOTS 32
+#define URING_ENTRIES 64        /* Submission entries, the completion queue gets twice as many */
+#define URING_SEND_BATCH 16     /* Queued sends submitted together */
+#define URING_BGID 0            /* The buffer group of the receive buffers */
+#define URING_RECV (UINT64_MAX - 1) /* user_data of the receive */
+#define URING_CANCEL UINT64_MAX /* user_data of its cancellation */
+#define URING_DESTROY_WAIT_US 1000000
+#define URING_DESTROY_POLL_US 10000
+
+/* A send buffer and what sendmsg() needs to send it */
+struct uring_slot {
+    uint8_t *buf;
+    int busy;                   /* Owned by the kernel */
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage address;
+};
+
+struct microtcp_uring {
+    int fd;
+    int sd;
+    size_t buf_len;
+
+    /* Submission queue, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned tail;              /* Our copy of *sq_tail, ahead of it by the queued entries */
+    unsigned queued;            /* Entries not submitted yet */
+    unsigned queued_sends;
+
+    /* Completion queue, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /*
+     * The receive buffers, handed to the kernel through a buffer ring. One
+     * multishot receive picks a buffer for every datagram, so they arrive
+     * in order and nothing has to be posted again per datagram.
+     */
+    uint8_t *recv_bufs;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    uint16_t buf_tail;
+    int recv_armed;             /* The multishot receive is in flight */
+
+    /* Received datagrams not handed out yet, in arrival order */
+    uint16_t ready[URING_RECV_BUFS];
+    int ready_len[URING_RECV_BUFS];
+    int ready_start;
+    int ready_count;
+
+    uint8_t *send_bufs;
+    struct uring_slot slots[URING_SEND_SLOTS];
+    int free_sends[URING_SEND_SLOTS];
+    int free_count;
+    int current;                /* The send slot of the last microtcp_uring_send_buffer() */
+
+    int error;                  /* Of an earlier send or receive, reported by the next call */
+    int closing;                /* The receive is no longer armed again */
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Submits the queued entries and, if wait is set, waits for a completion
+ * for at most timeout_us (0 forever).
+ */
+static int uring_enter(struct microtcp_uring *u, int wait, uint64_t timeout_us){
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeout_us > 0){
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    ret = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, wait ? 1 : 0, flags,
+                       flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL,
+                       flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    if (ret >= 0){
+        u->queued -= (unsigned)ret < u->queued ? (unsigned)ret : u->queued;
+        if (u->queued == 0)
+            u->queued_sends = 0;
+        return 0;
+    }
+    /* The entries were submitted even if the wait timed out */
+    if (errno == ETIME){
+        u->queued = 0;
+        u->queued_sends = 0;
+        errno = EAGAIN;
+    }
+    return -1;
+}
+
+static struct io_uring_sqe *get_sqe(struct microtcp_uring *u, uint64_t user_data){
+    unsigned index = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+    u->tail++;
+    u->queued++;
+    return sqe;
+}
+
+/* Hands receive buffer bid back to the kernel */
+static void give_buffer(struct microtcp_uring *u, uint16_t bid){
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (URING_RECV_BUFS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(u->recv_bufs + bid * u->buf_len);
+    b->len = u->buf_len;
+    b->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_recv(struct microtcp_uring *u){
+    struct io_uring_sqe *sqe = get_sqe(u, URING_RECV);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->sd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    u->recv_armed = 1;
+}
+
+/* Moves the completions to the ready datagrams and the free send slots */
+static void reap(struct microtcp_uring *u){
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+    int slot, i;
+
+    for (; head != tail; head++){
+        cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data == URING_CANCEL)
+            continue;
+        if (cqe->user_data == URING_RECV){
+            if (cqe->flags & IORING_CQE_F_BUFFER){
+                i = (u->ready_start + u->ready_count) % URING_RECV_BUFS;
+                u->ready[i] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                u->ready_len[i] = cqe->res > 0 ? cqe->res : 0;
+                u->ready_count++;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)){
+                u->recv_armed = 0;
+                /* Out of buffers is not an error, it is armed again once one is handed back */
+                if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED && cqe->res != -EINTR
+                    && u->error == 0)
+                    u->error = -cqe->res;
+            }
+            continue;
+        }
+        slot = (int)cqe->user_data;
+        u->slots[slot].busy = 0;
+        u->free_sends[u->free_count++] = slot;
+        if (cqe->res < 0 && cqe->res != -EMSGSIZE && u->error == 0)
+            u->error = -cqe->res;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    if (!u->recv_armed && !u->closing && u->ready_count < URING_RECV_BUFS)
+        arm_recv(u);
+}
+
+static int take_error(struct microtcp_uring *u){
+    if (u->error == 0)
+        return 0;
+    errno = u->error;
+    u->error = 0;
+    return -1;
+}
+
+static void *map_ring(struct microtcp_uring *u, size_t len, off_t offset){
+    return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, offset);
+}
+
+struct microtcp_uring *microtcp_uring_create(int sd, size_t buf_len){
+    struct microtcp_uring *u;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    int i;
+
+    u = calloc(1, sizeof(struct microtcp_uring));
+    if (u == NULL)
+        return NULL;
+    memset(&p, 0, sizeof(p));
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0){
+        free(u);
+        return NULL;
+    }
+    u->sq_ring = MAP_FAILED;
+    u->cq_ring = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->buf_ring = MAP_FAILED;
+    /* Timed waits need the extended arguments of io_uring_enter() */
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+        goto fail;
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (u->cq_ring_len > u->sq_ring_len)
+            u->sq_ring_len = u->cq_ring_len;
+        u->cq_ring_len = u->sq_ring_len;
+    }
+    u->sq_ring = map_ring(u, u->sq_ring_len, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    u->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? u->sq_ring : map_ring(u, u->cq_ring_len, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+        goto fail;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = map_ring(u, u->sqes_len, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    u->sq_head = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned *)((uint8_t *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((uint8_t *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((uint8_t *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ring + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    u->sd = sd;
+    u->buf_len = buf_len;
+    u->recv_bufs = malloc(URING_RECV_BUFS * buf_len);
+    u->send_bufs = malloc(URING_SEND_SLOTS * buf_len);
+    if (u->recv_bufs == NULL || u->send_bufs == NULL)
+        goto fail;
+    for (i = 0; i < URING_SEND_SLOTS; i++){
+        u->slots[i].buf = u->send_bufs + i * buf_len;
+        u->free_sends[u->free_count++] = i;
+    }
+    u->current = -1;
+
+    /* Register the receive buffers, kernels before 5.19 have no buffer rings */
+    u->buf_ring_len = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (u->buf_ring == MAP_FAILED)
+        goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_BGID;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (i = 0; i < URING_RECV_BUFS; i++)
+        give_buffer(u, i);
+
+    /* A kernel without multishot receives fails it at once */
+    arm_recv(u);
+    if (uring_enter(u, 0, 0) < 0)
+        goto fail;
+    reap(u);
+    if (u->error != 0){
+        microtcp_uring_destroy(u);
+        return NULL;
+    }
+    return u;
+
+fail:
+    if (u->buf_ring != MAP_FAILED)
+        munmap(u->buf_ring, u->buf_ring_len);
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_len);
+    if (u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+    free(u->recv_bufs);
+    free(u->send_bufs);
+    free(u);
+    return NULL;
+}
+
+void microtcp_uring_destroy(struct microtcp_uring *u){
+    uint64_t waited = 0;
+    struct io_uring_sqe *sqe;
+    int busy = 0;
+    int i;
+
+    if (u == NULL)
+        return;
+    /*
+     * The kernel may still write to the buffers until every request has
+     * completed, so cancel the receive and wait for all of them.
+     */
+    u->closing = 1;
+    reap(u);
+    if (u->recv_armed){
+        sqe = get_sqe(u, URING_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_RECV;
+    }
+    while (waited < URING_DESTROY_WAIT_US){
+        busy = u->recv_armed;
+        for (i = 0; i < URING_SEND_SLOTS; i++)
+            busy |= u->slots[i].busy;
+        if (!busy)
+            break;
+        if (uring_enter(u, 1, URING_DESTROY_POLL_US) < 0 && errno != EAGAIN && errno != EINTR)
+            break;
+        reap(u);
+        waited += URING_DESTROY_POLL_US;
+    }
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_len);
+    munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+    /* Better leak the buffers than let the kernel write to freed memory */
+    if (!busy){
+        munmap(u->buf_ring, u->buf_ring_len);
+        free(u->recv_bufs);
+        free(u->send_bufs);
+    }
+    free(u);
+}
+
+uint8_t *microtcp_uring_send_buffer(struct microtcp_uring *u){
+    reap(u);
+    while (u->free_count == 0){
+        if (uring_enter(u, 1, 0) < 0 && errno != EINTR)
+            return NULL;
+        reap(u);
+    }
+    u->current = u->free_sends[--u->free_count];
+    return u->slots[u->current].buf;
+}
+
+int microtcp_uring_send(struct microtcp_uring *u, size_t length, const struct sockaddr *address,
+                        socklen_t address_len, int more){
+    struct uring_slot *s = &u->slots[u->current];
+    struct io_uring_sqe *sqe;
+
+    if (take_error(u) < 0){
+        u->free_sends[u->free_count++] = u->current;
+        return -1;
+    }
+    memcpy(&s->address, address, address_len);
+    s->iov.iov_base = s->buf;
+    s->iov.iov_len = length;
+    memset(&s->msg, 0, sizeof(struct msghdr));
+    s->msg.msg_name = &s->address;
+    s->msg.msg_namelen = address_len;
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    s->busy = 1;
+
+    sqe = get_sqe(u, u->current);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = u->sd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+    sqe->len = 1;
+    u->current = -1;
+    u->queued_sends++;
+    if (more && u->queued_sends < URING_SEND_BATCH)
+        return 0;
+    return uring_enter(u, 0, 0);
+}
+
+int microtcp_uring_flush(struct microtcp_uring *u){
+    if (u->queued == 0)
+        return 0;
+    return uring_enter(u, 0, 0);
+}
+
+ssize_t microtcp_uring_recv(struct microtcp_uring *u, void *buffer, size_t length, uint64_t timeout_us){
+    uint64_t deadline = 0;
+    uint64_t now;
+    size_t copied;
+    uint16_t bid;
+
+    reap(u);
+    if (timeout_us > 0 && timeout_us != MICROTCP_URING_NO_WAIT)
+        deadline = now_us() + timeout_us;
+    while (u->ready_count == 0){
+        if (take_error(u) < 0)
+            return -1;
+        if (timeout_us == MICROTCP_URING_NO_WAIT){
+            if (u->queued > 0 && uring_enter(u, 0, 0) < 0)
+                return -1;
+            reap(u);
+            if (u->ready_count == 0){
+                errno = EAGAIN;
+                return -1;
+            }
+            break;
+        }
+        /* A wait that also submitted returns without waiting out the timeout */
+        if (deadline > 0){
+            now = now_us();
+            if (now >= deadline){
+                errno = EAGAIN;
+                return -1;
+            }
+            timeout_us = deadline - now;
+        }
+        if (uring_enter(u, 1, timeout_us) < 0){
+            reap(u);
+            if (u->ready_count > 0)
+                break;
+            return -1;
+        }
+        reap(u);
+    }
+
+    bid = u->ready[u->ready_start];
+    copied = (size_t)u->ready_len[u->ready_start] < length ? (size_t)u->ready_len[u->ready_start] : length;
+    u->ready_start = (u->ready_start + 1) % URING_RECV_BUFS;
+    u->ready_count--;
+    memcpy(buffer, u->recv_bufs + bid * u->buf_len, copied);
+    give_buffer(u, bid);
+    if (!u->recv_armed && !u->closing)
+        arm_recv(u);
+    return copied;
+}
@@ -0,0 +1,116 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef LIB_MICROTCP_URING_H_
+#define LIB_MICROTCP_URING_H_
+
+/*
+ * An io_uring backend for the UDP socket of a connection.
+ *
+ * A fixed set of receive buffers is registered with the ring and a single
+ * multishot receive keeps filling them, so datagrams land in them while
+ * the protocol is busy and a burst of them is picked up with one system
+ * call, or none if they have already completed.
+ * Sends are written straight into send buffers of the ring and queued,
+ * then submitted in a batch together with the next wait for a receive.
+ *
+ * The ring belongs to one connection and is used by one thread at a time.
+ * microtcp_uring_create() returns NULL where io_uring is not available
+ * (old kernels, seccomp, the simulator), and the library then keeps using
+ * the plain system calls of microtcp_io.h.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define MICROTCP_URING_NO_WAIT UINT64_MAX
+
+struct microtcp_uring;
+
+#ifndef MICROTCP_SIM
+
+/**
+ * Creates a ring for the socket sd with buffers of buf_len bytes, the
+ * largest datagram the connection sends or receives.
+ * @return the ring or NULL if io_uring is not available
+ */
+struct microtcp_uring *microtcp_uring_create(int sd, size_t buf_len);
+
+/* Sends what is queued, waits for the sends in flight and frees the ring */
+void microtcp_uring_destroy(struct microtcp_uring *u);
+
+/**
+ * A free send buffer of buf_len bytes to build the next datagram in,
+ * waiting for one if all of them are in flight.
+ * @return the buffer or NULL on failure
+ */
+uint8_t *microtcp_uring_send_buffer(struct microtcp_uring *u);
+
+/**
+ * Queues the datagram built in the last microtcp_uring_send_buffer().
+ * It is submitted at once unless more is set, then it waits for the
+ * batch to fill up, the next receive or microtcp_uring_flush().
+ * Errors of earlier sends are reported here, a datagram larger than the
+ * MTU of the interface is silently lost as it would be on the path.
+ * @return 0 on success or -1 with errno set
+ */
+int microtcp_uring_send(struct microtcp_uring *u, size_t length, const struct sockaddr *address,
+                        socklen_t address_len, int more);
+
+/* Submits the queued sends. Returns 0 on success or -1 with errno set. */
+int microtcp_uring_flush(struct microtcp_uring *u);
+
+/**
+ * Copies the next datagram into buffer, waiting at most timeout_us
+ * for it (0 forever, MICROTCP_URING_NO_WAIT not at all).
+ * @return its length, or -1 with errno EAGAIN on timeout or another errno
+ * on failure, like recvfrom() with SO_RCVTIMEO
+ */
+ssize_t microtcp_uring_recv(struct microtcp_uring *u, void *buffer, size_t length, uint64_t timeout_us);
+
+#else
+
+/* The simulated network has no kernel behind it */
+static inline struct microtcp_uring *microtcp_uring_create(int sd, size_t buf_len){
+    (void)sd;
+    (void)buf_len;
+    return NULL;
+}
+
+static inline void microtcp_uring_destroy(struct microtcp_uring *u){
+    (void)u;
+}
+
+static inline uint8_t *microtcp_uring_send_buffer(struct microtcp_uring *u){
+    (void)u;
+    return NULL;
+}
+
+static inline int microtcp_uring_send(struct microtcp_uring *u, size_t length, const struct sockaddr *address,
+                                      socklen_t address_len, int more){
+    (void)u;
+    (void)length;
+    (void)address;
+    (void)address_len;
+    (void)more;
+    return -1;
+}
+
+static inline int microtcp_uring_flush(struct microtcp_uring *u){
+    (void)u;
+    return 0;
+}
+
+static inline ssize_t microtcp_uring_recv(struct microtcp_uring *u, void *buffer, size_t length, uint64_t timeout_us){
+    (void)u;
+    (void)buffer;
+    (void)length;
+    (void)timeout_us;
+    return -1;
+}
+
+#endif /* MICROTCP_SIM */
+
+#endif /* LIB_MICROTCP_URING_H_ */
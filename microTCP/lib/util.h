@@ -1,48 +1,78 @@
-/* Georgios Gerasimos Leventopoulos csd4152 
-   Konstantinos Anemozalis csd4149      
-   Theofanis Tsesmetzis csd4142             */
-   
-#include <stdio.h>
-#include <string.h>
-#include <time.h>
-#include <errno.h>
-#include <time.h>
-#include <stdlib.h>
-#include <arpa/inet.h>
-#include <inttypes.h>
-#include <unistd.h>
-
-#define min(x, y) (((x) < (y)) ? (x) : (y))
-
-/* Change the check sum of a microtcp header */
-void insertToBuffer(void* buffer, microtcp_header_t *h, size_t headerSize, void* dataBuffer, size_t insertFrom, size_t dataSize){
-  memcpy(buffer, h, headerSize);
-  memcpy(buffer+headerSize, dataBuffer+insertFrom, dataSize);
-  h->checksum = htonl(crc32(buffer, sizeof(buffer)));
-  memcpy(buffer, h, headerSize);
-}
-
-/* Validate the check sum of a microtcp header */
-int hasValidCheckSum(microtcp_header_t *h){
-	uint8_t buff[8192];
-	memset(buff, 0, sizeof(buff));
-	memcpy(buff, h, sizeof(microtcp_header_t));
-	return (h->checksum == crc32(buff, sizeof(buff)));
-}
-
-/* Initialize a microtcp header */
-void initializeHeader(microtcp_header_t *h, uint32_t seq_number, uint32_t ack_number, uint16_t control, uint16_t window, uint32_t data_len, uint32_t future_use0, uint32_t future_use1, uint32_t future_use2){
-  h->seq_number = seq_number;
-  h->ack_number = ack_number;
-  h->control = control; 
-  h->window = window;
-  h->data_len = data_len;
-  h->future_use0 = future_use0;
-  h->future_use1 = future_use1;
-  h->future_use2 = future_use2;
-}
-
-int getRandom(int max){
-  srand(time(NULL));
-  return rand()%(max+1);
+/* Georgios Gerasimos Leventopoulos csd4152 
+   Konstantinos Anemozalis csd4149      
+   Theofanis Tsesmetzis csd4142             */
+   
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#define min(x, y) (((x) < (y)) ? (x) : (y))
+#define max(x, y) (((x) > (y)) ? (x) : (y))
+
+/* Sequence number comparisons that survive the wrap around */
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+/* The checksum of a segment whose checksum field is 0 */
+static inline uint32_t computeChecksum(microtcp_checksum_t algorithm, const void *segment, size_t length){
+  uint64_t hash;
+  switch (algorithm){
+  case MICROTCP_CHECKSUM_CRC32C:
+    return crc32c(segment, length);
+  case MICROTCP_CHECKSUM_HASH64:
+    hash = hash64(segment, length, 0);
+    return (uint32_t)(hash ^ (hash >> 32));
+  case MICROTCP_CHECKSUM_NONE:
+    return 0;
+  default:
+    return crc32(segment, length);
+  }
+}
+
+/* Copies the header and the data to buffer and fills in the checksum of the whole segment */
+static inline void insertToBuffer(void* buffer, microtcp_header_t *h, size_t headerSize, void* dataBuffer, size_t insertFrom, size_t dataSize,
+                                  microtcp_checksum_t algorithm){
+  h->checksum = 0;
+  memcpy(buffer, h, headerSize);
+  if (dataSize > 0)
+    memcpy(buffer+headerSize, dataBuffer+insertFrom, dataSize);
+  h->checksum = htonl(computeChecksum(algorithm, buffer, headerSize + dataSize));
+  ((microtcp_header_t *)buffer)->checksum = h->checksum;
+}
+
+/* Validate the check sum of a received segment (header and data) */
+static inline int hasValidCheckSum(void *segment, size_t length, microtcp_checksum_t algorithm){
+  microtcp_header_t *h = (microtcp_header_t *)segment;
+  uint32_t received = h->checksum;
+  uint32_t computed;
+  if (algorithm == MICROTCP_CHECKSUM_NONE)
+    return 1;
+  h->checksum = 0;
+  computed = htonl(computeChecksum(algorithm, segment, length));
+  h->checksum = received;
+  return received == computed;
+}
+
+/* Initialize a microtcp header */
+void initializeHeader(microtcp_header_t *h, uint32_t seq_number, uint32_t ack_number, uint16_t control, uint16_t window, uint32_t data_len, uint32_t future_use0, uint32_t future_use1, uint32_t future_use2){
+  h->seq_number = seq_number;
+  h->ack_number = ack_number;
+  h->control = control; 
+  h->window = window;
+  h->data_len = data_len;
+  h->future_use0 = future_use0;
+  h->future_use1 = future_use1;
+  h->future_use2 = future_use2;
+}
+
+int getRandom(int max){
+  return io_random()%(max+1);
 }
\ No newline at end of file
@@ -32,10 +32,80 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "../lib/microtcp.c"
+#include "../lib/microtcp_trace.h"
+#include "../lib/microtcp_capture.h"
 
 #define CHUNK_SIZE 4096
+#define MAX_STREAMS 64
+#define SAMPLE_INTERVAL_US 100000
+
+/* If set with -t, microTCP connections write their time series there */
+static const char *sample_file = NULL;
+
+/* The integrity check microTCP connections ask for, set with -c */
+static microtcp_checksum_t checksum = MICROTCP_CHECKSUM_CRC32;
+static const char *checksum_names[] = { "crc32", "crc32c", "hash64", "none" };
+
+/* The microTCP send buffer of the clients, set with -b, 0 for none */
+static size_t send_buffer_len = 0;
+
+/* The type of the microTCP sockets, -u adds MICROTCP_SOCK_URING */
+static int socket_type = SOCK_DGRAM;
+
+/* The microTCP server reads at most this many bytes per second, set with -r, 0 for no limit */
+static double read_rate = 0;
+
+/* Sleeps until reading total_bytes since start keeps to read_rate */
+static void
+throttle_read(ssize_t total_bytes, const struct timespec *start)
+{
+  struct timespec now;
+  double ahead;
+
+  if (read_rate <= 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  ahead = total_bytes / read_rate - (now.tv_sec - start->tv_sec) - (now.tv_nsec - start->tv_nsec) * 1e-9;
+  if (ahead > 0)
+    usleep(ahead * 1e6);
+}
+
+/*
+ * Every stream of the parallel mode starts with this preamble, so the
+ * server knows where in the file the data of the stream belong.
+ * Both fields are in network byte order.
+ */
+typedef struct
+{
+  uint64_t offset;
+  uint64_t length;
+} stream_preamble_t;
+
+typedef struct
+{
+  int id;
+  uint8_t use_microtcp;
+  int fd;                       /* The file, shared by all the streams */
+  int sock;                     /* Accepted TCP socket (TCP server only) */
+  const char *serverip;
+  uint16_t port;
+  uint64_t offset;
+  uint64_t length;
+
+  /* Results */
+  int status;
+  uint64_t bytes;
+  struct timespec start;
+  struct timespec end;
+  double cpu_time;
+} stream_ctx_t;
 
 static inline void
 print_statistics(ssize_t received, struct timespec start, struct timespec end)
@@ -47,6 +117,99 @@ print_statistics(ssize_t received, struct timespec start, struct timespec end)
   printf("Throughput achieved: %f MB/s\n", megabytes / elapsed);
 }
 
+static void
+print_microtcp_statistics(const microtcp_sock_t *sock)
+{
+  microtcp_stats_t stats;
+
+  if (microtcp_get_stats(sock, &stats) < 0)
+    return;
+  printf("Packets sent/received: %lu/%lu\n", stats.packets_send, stats.packets_received);
+  printf("Packets lost: %lu\n", stats.packets_lost);
+  printf("Retransmissions: %lu\n", stats.retransmissions);
+  printf("Tail loss probes: %lu\n", stats.tail_probes);
+  printf("Duplicate ACKs: %lu\n", stats.dup_acks);
+  printf("Header prediction hits: %lu of %lu received (%.2f%%)\n", stats.segments_predicted,
+         stats.packets_received,
+         stats.packets_received ? 100.0 * stats.segments_predicted / stats.packets_received : 0.0);
+  printf("Smoothed RTT: %f ms (RTO %f ms)\n", stats.srtt_us / 1000.0, stats.rto_us / 1000.0);
+  printf("Checksum: %s\n", checksum_names[stats.checksum]);
+  printf("Segment size: %zu bytes (%zu negotiated)\n", stats.mss, stats.max_mss);
+  printf("Socket I/O: %s\n", stats.io_uring ? "io_uring" : "system calls");
+  if (stats.flow_control)
+    printf("Flow control: %lu window probes, %lu window updates\n", stats.window_probes,
+           stats.window_updates);
+  else
+    printf("Flow control: not supported by the peer\n");
+  printf("Receive buffer: %zu bytes (grown %lu times, shrunk %lu times)\n", stats.recvbuf_len,
+         stats.recvbuf_grown, stats.recvbuf_shrunk);
+  printf("Final cwnd: %zu bytes (ssthresh %zu)\n", stats.cwnd, stats.ssthresh);
+  printf("Delivery rate: %f MB/s sent, %f MB/s received (%s)\n", stats.send_rate / (1024.0 * 1024.0),
+         stats.receive_rate / (1024.0 * 1024.0), stats.warm_start ? "warm start" : "cold start");
+}
+
+static inline double
+elapsed_sec(struct timespec start, struct timespec end)
+{
+  return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static inline double
+thread_cpu_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline double
+process_cpu_time(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6
+      + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+/*
+ * Prints the throughput of each stream and the aggregate of all of them.
+ * The aggregate throughput is measured from the first stream that started
+ * until the last one that finished.
+ */
+static void
+print_parallel_statistics(stream_ctx_t *streams, int n, double cpu_time)
+{
+  int i;
+  uint64_t total_bytes = 0;
+  double elapsed;
+  double megabytes;
+  struct timespec first_start = streams[0].start;
+  struct timespec last_end = streams[0].end;
+
+  for (i = 0; i < n; i++)
+  {
+    elapsed = elapsed_sec(streams[i].start, streams[i].end);
+    megabytes = streams[i].bytes / (1024.0 * 1024.0);
+    printf("Stream %2d: %f MB in %f seconds, %f MB/s, CPU time %f seconds%s\n",
+           i, megabytes, elapsed, elapsed > 0 ? megabytes / elapsed : 0.0,
+           streams[i].cpu_time, streams[i].status ? " (FAILED)" : "");
+    total_bytes += streams[i].bytes;
+    if (elapsed_sec(streams[i].start, first_start) > 0)
+      first_start = streams[i].start;
+    if (elapsed_sec(last_end, streams[i].end) > 0)
+      last_end = streams[i].end;
+  }
+
+  elapsed = elapsed_sec(first_start, last_end);
+  megabytes = total_bytes / (1024.0 * 1024.0);
+  printf("Aggregate: %d streams\n", n);
+  printf("Data transferred: %f MB\n", megabytes);
+  printf("Transfer time: %f seconds\n", elapsed);
+  printf("Throughput achieved: %f MB/s\n", elapsed > 0 ? megabytes / elapsed : 0.0);
+  printf("Process CPU time: %f seconds (%f cores)\n", cpu_time,
+         elapsed > 0 ? cpu_time / elapsed : 0.0);
+}
+
 int server_tcp(uint16_t listen_port, const char *file)
 {
   uint8_t *buffer;
@@ -195,7 +358,8 @@ int server_microtcp(uint16_t listen_port, const char *file)
     return -EXIT_FAILURE;
   }
 
-  sock = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sock = microtcp_socket(AF_INET, socket_type, IPPROTO_UDP);
+  microtcp_set_checksum(&sock, checksum);
 
   memset(&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
@@ -216,6 +380,8 @@ int server_microtcp(uint16_t listen_port, const char *file)
     fclose(fp);
     return -EXIT_FAILURE;
   }
+  if (sample_file && microtcp_enable_sampler(&sock, sample_file, SAMPLE_INTERVAL_US) < 0)
+    perror("microTCP sampler");
 
   printf("Receiving data...\n");
   clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
@@ -223,6 +389,7 @@ int server_microtcp(uint16_t listen_port, const char *file)
     //printf("received = %d\n", received);
     written = fwrite(buffer, sizeof(uint8_t), received, fp);
     total_bytes += received;
+    throttle_read(total_bytes, &start_time);
     if (written * sizeof(uint8_t) != received){
       printf("Failed to write to the file the amount of data received from the network.\n");
       microtcp_shutdown(&sock, SHUT_RDWR);
@@ -234,6 +401,15 @@ int server_microtcp(uint16_t listen_port, const char *file)
   }
   clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
 
+  /* microtcp_recv() returns -1 both at the FIN of the peer and on errors, only the first is the end of the stream */
+  if (sock.state != CLOSING_BY_PEER){
+    printf("The connection failed before the end of the stream.\n");
+    microtcp_shutdown(&sock, SHUT_RDWR);
+    close(sock.sd);
+    free(buffer);
+    fclose(fp);
+    return -EXIT_FAILURE;
+  }
 
   printf("\nServer: Data sent succesfully. Now we close the connection...\n");
   microtcp_shutdown(&sock, SHUT_RDWR);
@@ -245,6 +421,7 @@ int server_microtcp(uint16_t listen_port, const char *file)
   
   printf("\nStatistics:\n");
   print_statistics(total_bytes, start_time, end_time);
+  print_microtcp_statistics(&sock);
   printf("\n");
   return 0;
 }
@@ -301,19 +478,8 @@ int client_tcp(const char *serverip, uint16_t server_port, const char *file)
 
   printf("Starting sending data...\n");
   /* Start sending the data */
-  while (!feof(fp))
+  while ((read_items = fread(buffer, sizeof(uint8_t), CHUNK_SIZE, fp)) > 0)
   {
-    read_items = fread(buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
-    if (read_items < 1)
-    {
-      perror("Failed read from file");
-      shutdown(sock, SHUT_RDWR);
-      close(sock);
-      free(buffer);
-      fclose(fp);
-      return -EXIT_FAILURE;
-    }
-
     data_sent = send(sock, buffer, read_items * sizeof(uint8_t), 0);
     if (data_sent != read_items * sizeof(uint8_t))
     {
@@ -327,6 +493,16 @@ int client_tcp(const char *serverip, uint16_t server_port, const char *file)
     }
   }
 
+  if (ferror(fp))
+  {
+    perror("Failed read from file");
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+    free(buffer);
+    fclose(fp);
+    return -EXIT_FAILURE;
+  }
+
   printf("Data sent. Terminating...\n");
   shutdown(sock, SHUT_RDWR);
   close(sock);
@@ -358,7 +534,10 @@ int client_microtcp(const char *serverip, uint16_t server_port, const char *file
 		exit(1);
 	}
 
-	socket = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); /* create new socket */
+	socket = microtcp_socket(AF_INET, socket_type, IPPROTO_UDP); /* create new socket */
+  microtcp_set_checksum(&socket, checksum);
+  if (send_buffer_len > 0 && microtcp_set_send_buffer(&socket, send_buffer_len, 0) < 0)
+    perror("microTCP send buffer");
 
 	if (socket.state == INVALID){
 		perror("Error while creating socket in client_microtcp\n");
@@ -378,40 +557,602 @@ int client_microtcp(const char *serverip, uint16_t server_port, const char *file
 		perror("Error while calling connect() on client_microtcp.\n");
 		exit(1);
 	}
+  if (sample_file && microtcp_enable_sampler(&socket, sample_file, SAMPLE_INTERVAL_US) < 0)
+    perror("microTCP sampler");
 
   printf("Sending data...\n");
-  while (!feof(fp)) {
-    read_items = fread(buff, sizeof(uint8_t), CHUNK_SIZE, fp);
-    if (read_items < 1) {
-      perror("Failed read from file");
-      shutdown(&socket, SHUT_RDWR);
-      close(socket.sd);
-      free(buff);
-      fclose(fp);
-      return -EXIT_FAILURE;
-    }
-
+  /* A file that is a multiple of CHUNK_SIZE ends with an empty read, which is not an error */
+  while ((read_items = fread(buff, sizeof(uint8_t), CHUNK_SIZE, fp)) > 0) {
     data_sent = microtcp_send(&socket, buff, read_items*sizeof(uint8_t), 0);
 
     //printf("data_sent = %d   read_items = %d\n", data_sent, read_items);
     if (data_sent != read_items*sizeof(uint8_t)){
       printf("Failed to send the amount of data read from the file.\n");
-      shutdown(&socket, SHUT_RDWR);
+      microtcp_shutdown(&socket, SHUT_RDWR);
       close(socket.sd);
       free(buff);
       fclose(fp);
       return -EXIT_FAILURE;
     }
   }
+  if (ferror(fp)) {
+    perror("Failed read from file");
+    microtcp_shutdown(&socket, SHUT_RDWR);
+    close(socket.sd);
+    free(buff);
+    fclose(fp);
+    return -EXIT_FAILURE;
+  }
   printf ("\nClient: Data sent succesfully. Now we close the connection...\n");
   microtcp_shutdown(&socket, SHUT_RDWR);
   free(buff);
   close(socket.sd);
   fclose(fp);
   printf("\nShutdown is successfully executed from client side\n");
+
+  printf("\nStatistics:\n");
+  print_microtcp_statistics(&socket);
   return 0;
 }
 
+/* Helpers hiding the differences of the two protocols from the stream threads */
+static ssize_t
+stream_send(stream_ctx_t *ctx, microtcp_sock_t *msock, const void *buf, size_t len)
+{
+  if (ctx->use_microtcp)
+    return microtcp_send(msock, buf, len, 0);
+  return send(ctx->sock, buf, len, 0);
+}
+
+static ssize_t
+stream_recv(stream_ctx_t *ctx, microtcp_sock_t *msock, void *buf, size_t len)
+{
+  if (ctx->use_microtcp)
+    return microtcp_recv(msock, buf, len, 0);
+  return recv(ctx->sock, buf, len, 0);
+}
+
+static void *
+server_stream(void *arg)
+{
+  stream_ctx_t *ctx = (stream_ctx_t *)arg;
+  microtcp_sock_t msock;
+  stream_preamble_t preamble;
+  struct sockaddr_in sin;
+  struct sockaddr client_addr;
+  uint8_t *buffer;
+  ssize_t received;
+  size_t got = 0;
+  double cpu_start;
+
+  ctx->status = -1;
+  buffer = (uint8_t *)malloc(CHUNK_SIZE);
+  if (!buffer)
+  {
+    perror("Allocate stream receive buffer");
+    return NULL;
+  }
+
+  if (ctx->use_microtcp)
+  {
+    /* microTCP has no listen(), so each stream gets its own port */
+    msock = microtcp_socket(AF_INET, socket_type, IPPROTO_UDP);
+    microtcp_set_checksum(&msock, checksum);
+    if (msock.state == INVALID)
+    {
+      free(buffer);
+      return NULL;
+    }
+    memset(&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(ctx->port);
+    sin.sin_addr.s_addr = INADDR_ANY;
+    if (microtcp_bind(&msock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) == -1
+        || microtcp_accept(&msock, &client_addr, sizeof(struct sockaddr)) < 0)
+    {
+      close(msock.sd);
+      free(buffer);
+      return NULL;
+    }
+  }
+
+  /* The preamble tells at which part of the file this stream writes */
+  while (got < sizeof(stream_preamble_t))
+  {
+    received = stream_recv(ctx, &msock, (uint8_t *)&preamble + got,
+                           sizeof(stream_preamble_t) - got);
+    if (received <= 0)
+      goto out;
+    got += received;
+  }
+  ctx->offset = be64toh(preamble.offset);
+  ctx->length = be64toh(preamble.length);
+
+  cpu_start = thread_cpu_time();
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->start);
+  while (ctx->bytes < ctx->length)
+  {
+    received = stream_recv(ctx, &msock, buffer, CHUNK_SIZE);
+    if (received <= 0)
+      break;
+    if (pwrite(ctx->fd, buffer, received, ctx->offset + ctx->bytes) != received)
+    {
+      perror("Write stream data to the file");
+      break;
+    }
+    ctx->bytes += received;
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->end);
+  ctx->cpu_time = thread_cpu_time() - cpu_start;
+  ctx->status = ctx->bytes == ctx->length ? 0 : -1;
+
+out:
+  if (ctx->use_microtcp)
+  {
+    /* Wait for the FIN of the peer before closing our side */
+    while (msock.state == ESTABLISHED && microtcp_recv(&msock, buffer, CHUNK_SIZE, 0) > 0)
+      ;
+    microtcp_shutdown(&msock, SHUT_RDWR);
+    close(msock.sd);
+  }
+  else
+  {
+    shutdown(ctx->sock, SHUT_RDWR);
+    close(ctx->sock);
+  }
+  free(buffer);
+  return NULL;
+}
+
+static void *
+client_stream(void *arg)
+{
+  stream_ctx_t *ctx = (stream_ctx_t *)arg;
+  microtcp_sock_t msock;
+  stream_preamble_t preamble;
+  struct sockaddr_in sin;
+  uint8_t *buffer;
+  ssize_t read_items;
+  size_t chunk;
+  double cpu_start;
+
+  ctx->status = -1;
+  buffer = (uint8_t *)malloc(CHUNK_SIZE);
+  if (!buffer)
+  {
+    perror("Allocate stream send buffer");
+    return NULL;
+  }
+
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(ctx->port);
+  sin.sin_addr.s_addr = inet_addr(ctx->serverip);
+
+  if (ctx->use_microtcp)
+  {
+    msock = microtcp_socket(AF_INET, socket_type, IPPROTO_UDP);
+    microtcp_set_checksum(&msock, checksum);
+    if (send_buffer_len > 0)
+      microtcp_set_send_buffer(&msock, send_buffer_len, 0);
+    if (msock.state == INVALID
+        || microtcp_connect(&msock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0)
+    {
+      close(msock.sd);
+      free(buffer);
+      return NULL;
+    }
+  }
+  else
+  {
+    if ((ctx->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    {
+      perror("Opening TCP socket");
+      free(buffer);
+      return NULL;
+    }
+    if (connect(ctx->sock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) == -1)
+    {
+      perror("TCP connect");
+      close(ctx->sock);
+      free(buffer);
+      return NULL;
+    }
+  }
+
+  cpu_start = thread_cpu_time();
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->start);
+  preamble.offset = htobe64(ctx->offset);
+  preamble.length = htobe64(ctx->length);
+  if (stream_send(ctx, &msock, &preamble, sizeof(stream_preamble_t)) != sizeof(stream_preamble_t))
+    goto out;
+
+  while (ctx->bytes < ctx->length)
+  {
+    chunk = min(CHUNK_SIZE, ctx->length - ctx->bytes);
+    read_items = pread(ctx->fd, buffer, chunk, ctx->offset + ctx->bytes);
+    if (read_items < 1)
+    {
+      perror("Failed read from file");
+      break;
+    }
+    if (stream_send(ctx, &msock, buffer, read_items) != read_items)
+    {
+      printf("Stream %d: failed to send the amount of data read from the file.\n", ctx->id);
+      break;
+    }
+    ctx->bytes += read_items;
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->end);
+  ctx->cpu_time = thread_cpu_time() - cpu_start;
+  ctx->status = ctx->bytes == ctx->length ? 0 : -1;
+
+out:
+  if (ctx->use_microtcp)
+  {
+    microtcp_shutdown(&msock, SHUT_RDWR);
+    close(msock.sd);
+  }
+  else
+  {
+    shutdown(ctx->sock, SHUT_RDWR);
+    close(ctx->sock);
+  }
+  free(buffer);
+  return NULL;
+}
+
+/*
+ * Parallel mode. The server waits for n streams; TCP streams are accepted
+ * on the same port, while microTCP stream i uses port listen_port + i.
+ */
+int server_parallel(uint16_t listen_port, const char *file, int n, uint8_t use_microtcp)
+{
+  stream_ctx_t streams[MAX_STREAMS];
+  pthread_t threads[MAX_STREAMS];
+  struct sockaddr_in sin;
+  struct sockaddr client_addr;
+  socklen_t client_addr_len;
+  int exit_code = 0;
+  int listen_sock = -1;
+  int fd;
+  int i;
+
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror("Open file for writing");
+    return -EXIT_FAILURE;
+  }
+
+  if (!use_microtcp)
+  {
+    if ((listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    {
+      perror("Opening TCP socket");
+      close(fd);
+      return -EXIT_FAILURE;
+    }
+    memset(&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(listen_port);
+    sin.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listen_sock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) == -1
+        || listen(listen_sock, 1000) == -1)
+    {
+      perror("TCP bind/listen");
+      close(listen_sock);
+      close(fd);
+      return -EXIT_FAILURE;
+    }
+  }
+
+  memset(streams, 0, sizeof(streams));
+  printf("Waiting for %d streams...\n", n);
+  for (i = 0; i < n; i++)
+  {
+    streams[i].id = i;
+    streams[i].use_microtcp = use_microtcp;
+    streams[i].fd = fd;
+    streams[i].port = use_microtcp ? listen_port + i : listen_port;
+    if (!use_microtcp)
+    {
+      client_addr_len = sizeof(struct sockaddr);
+      streams[i].sock = accept(listen_sock, &client_addr, &client_addr_len);
+      if (streams[i].sock < 0)
+      {
+        perror("TCP accept");
+        n = i;
+        exit_code = -EXIT_FAILURE;
+        break;
+      }
+    }
+    pthread_create(&threads[i], NULL, server_stream, &streams[i]);
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    pthread_join(threads[i], NULL);
+    if (streams[i].status)
+      exit_code = -EXIT_FAILURE;
+  }
+
+  if (listen_sock >= 0)
+    close(listen_sock);
+  close(fd);
+
+  if (n > 0)
+  {
+    printf("\nStatistics:\n");
+    print_parallel_statistics(streams, n, process_cpu_time());
+  }
+  return exit_code;
+}
+
+int client_parallel(const char *serverip, uint16_t server_port, const char *file,
+                    int n, uint8_t use_microtcp)
+{
+  stream_ctx_t streams[MAX_STREAMS];
+  pthread_t threads[MAX_STREAMS];
+  struct stat st;
+  int exit_code = 0;
+  int fd;
+  int i;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    perror("Open file for reading");
+    return -EXIT_FAILURE;
+  }
+
+  /* Split the file into n contiguous ranges, one per stream */
+  memset(streams, 0, sizeof(streams));
+  for (i = 0; i < n; i++)
+  {
+    streams[i].id = i;
+    streams[i].use_microtcp = use_microtcp;
+    streams[i].fd = fd;
+    streams[i].serverip = serverip;
+    streams[i].port = use_microtcp ? server_port + i : server_port;
+    streams[i].offset = st.st_size * i / n;
+    streams[i].length = st.st_size * (i + 1) / n - streams[i].offset;
+  }
+
+  printf("Sending data over %d streams...\n", n);
+  for (i = 0; i < n; i++)
+    pthread_create(&threads[i], NULL, client_stream, &streams[i]);
+  for (i = 0; i < n; i++)
+  {
+    pthread_join(threads[i], NULL);
+    if (streams[i].status)
+      exit_code = -EXIT_FAILURE;
+  }
+  close(fd);
+
+  printf("\nStatistics:\n");
+  print_parallel_statistics(streams, n, process_cpu_time());
+  return exit_code;
+}
+
+/*
+ * Multiplexed mode (-x). The n ranges of the file go over n streams of a
+ * single microTCP connection instead of n connections.
+ */
+int server_multiplexed(uint16_t listen_port, const char *file, int n)
+{
+  stream_ctx_t streams[MAX_STREAMS];
+  stream_preamble_t preambles[MAX_STREAMS];
+  size_t got[MAX_STREAMS];
+  microtcp_sock_t msock;
+  struct sockaddr_in sin;
+  struct sockaddr client_addr;
+  stream_ctx_t *ctx;
+  uint8_t *buffer;
+  uint8_t *data;
+  ssize_t received;
+  size_t take;
+  int exit_code = 0;
+  int stream;
+  int done = 0;
+  int fd;
+  int i;
+
+  buffer = (uint8_t *)malloc(CHUNK_SIZE);
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (!buffer || fd < 0)
+  {
+    perror("Open file for writing");
+    free(buffer);
+    return -EXIT_FAILURE;
+  }
+
+  msock = microtcp_socket(AF_INET, socket_type, IPPROTO_UDP);
+  microtcp_set_checksum(&msock, checksum);
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (msock.state == INVALID || microtcp_set_streams(&msock) < 0
+      || microtcp_bind(&msock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) == -1
+      || microtcp_accept(&msock, &client_addr, sizeof(struct sockaddr)) < 0)
+  {
+    close(msock.sd);
+    close(fd);
+    free(buffer);
+    return -EXIT_FAILURE;
+  }
+  if (sample_file && microtcp_enable_sampler(&msock, sample_file, SAMPLE_INTERVAL_US) < 0)
+    perror("microTCP sampler");
+
+  memset(streams, 0, sizeof(streams));
+  memset(got, 0, sizeof(got));
+  for (i = 0; i < n; i++)
+  {
+    streams[i].id = i;
+    streams[i].status = -1;
+  }
+
+  printf("Receiving %d streams over one connection...\n", n);
+  while (done < n)
+  {
+    stream = MICROTCP_ANY_STREAM;
+    received = microtcp_recv_stream(&msock, &stream, buffer, CHUNK_SIZE);
+    if (received <= 0)
+      break;
+    if (stream >= n)
+    {
+      printf("Data on unexpected stream %d\n", stream);
+      break;
+    }
+    ctx = &streams[stream];
+    data = buffer;
+
+    /* Every stream starts with its preamble, like a connection of the parallel mode */
+    if (got[stream] < sizeof(stream_preamble_t))
+    {
+      take = min((size_t)received, sizeof(stream_preamble_t) - got[stream]);
+      memcpy((uint8_t *)&preambles[stream] + got[stream], data, take);
+      got[stream] += take;
+      data += take;
+      received -= take;
+      if (got[stream] < sizeof(stream_preamble_t))
+        continue;
+      ctx->offset = be64toh(preambles[stream].offset);
+      ctx->length = be64toh(preambles[stream].length);
+      clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->start);
+    }
+    if (received > 0 && pwrite(fd, data, received, ctx->offset + ctx->bytes) != received)
+    {
+      perror("Write stream data to the file");
+      break;
+    }
+    ctx->bytes += received;
+    if (ctx->bytes == ctx->length && ctx->status != 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->end);
+      ctx->status = 0;
+      done++;
+    }
+  }
+  if (done < n)
+    exit_code = -EXIT_FAILURE;
+
+  /* Wait for the FIN of the peer before closing our side */
+  while (msock.state == ESTABLISHED && microtcp_recv(&msock, buffer, CHUNK_SIZE, 0) > 0)
+    ;
+  microtcp_shutdown(&msock, SHUT_RDWR);
+  close(msock.sd);
+  close(fd);
+  free(buffer);
+
+  printf("\nStatistics:\n");
+  print_parallel_statistics(streams, n, process_cpu_time());
+  print_microtcp_statistics(&msock);
+  return exit_code;
+}
+
+int client_multiplexed(const char *serverip, uint16_t server_port, const char *file, int n)
+{
+  stream_ctx_t streams[MAX_STREAMS];
+  stream_preamble_t preamble;
+  microtcp_sock_t msock;
+  struct sockaddr_in sin;
+  struct stat st;
+  stream_ctx_t *ctx;
+  uint8_t *buffer;
+  ssize_t read_items;
+  size_t chunk;
+  int exit_code = 0;
+  int active = n;
+  int fd;
+  int i;
+
+  buffer = (uint8_t *)malloc(CHUNK_SIZE);
+  fd = open(file, O_RDONLY);
+  if (!buffer || fd < 0 || fstat(fd, &st) < 0)
+  {
+    perror("Open file for reading");
+    free(buffer);
+    return -EXIT_FAILURE;
+  }
+
+  msock = microtcp_socket(AF_INET, socket_type, IPPROTO_UDP);
+  microtcp_set_checksum(&msock, checksum);
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(server_port);
+  sin.sin_addr.s_addr = inet_addr(serverip);
+  if (msock.state == INVALID || microtcp_set_streams(&msock) < 0
+      || microtcp_connect(&msock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0)
+  {
+    close(msock.sd);
+    close(fd);
+    free(buffer);
+    return -EXIT_FAILURE;
+  }
+  if (sample_file && microtcp_enable_sampler(&msock, sample_file, SAMPLE_INTERVAL_US) < 0)
+    perror("microTCP sampler");
+
+  /* The same ranges as the parallel mode, each starts with its preamble */
+  memset(streams, 0, sizeof(streams));
+  printf("Sending data over %d streams of one connection...\n", n);
+  for (i = 0; i < n; i++)
+  {
+    ctx = &streams[i];
+    ctx->id = i;
+    ctx->status = -1;
+    ctx->offset = st.st_size * i / n;
+    ctx->length = st.st_size * (i + 1) / n - ctx->offset;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->start);
+    preamble.offset = htobe64(ctx->offset);
+    preamble.length = htobe64(ctx->length);
+    if (microtcp_send_stream(&msock, i, &preamble, sizeof(stream_preamble_t)) != sizeof(stream_preamble_t))
+      active = 0;
+  }
+
+  /* A chunk of each unfinished stream in turn */
+  while (active > 0)
+  {
+    for (i = 0; i < n; i++)
+    {
+      ctx = &streams[i];
+      if (ctx->status == 0)
+        continue;
+      chunk = min(CHUNK_SIZE, ctx->length - ctx->bytes);
+      read_items = chunk > 0 ? pread(fd, buffer, chunk, ctx->offset + ctx->bytes) : 0;
+      if (read_items < (ssize_t)chunk
+          || (chunk > 0 && microtcp_send_stream(&msock, i, buffer, chunk) != (ssize_t)chunk))
+      {
+        printf("Stream %d: failed to send the data read from the file.\n", i);
+        active = 0;
+        break;
+      }
+      ctx->bytes += chunk;
+      if (ctx->bytes == ctx->length)
+      {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ctx->end);
+        ctx->status = 0;
+        active--;
+      }
+    }
+  }
+  for (i = 0; i < n; i++)
+    if (streams[i].status)
+      exit_code = -EXIT_FAILURE;
+
+  /* The shutdown sends what the streams still hold */
+  microtcp_shutdown(&msock, SHUT_RDWR);
+  close(msock.sd);
+  close(fd);
+  free(buffer);
+
+  printf("\nStatistics:\n");
+  print_parallel_statistics(streams, n, process_cpu_time());
+  print_microtcp_statistics(&msock);
+  return exit_code;
+}
+
 int main(int argc, char **argv)
 {
   int opt;
@@ -421,9 +1162,17 @@ int main(int argc, char **argv)
   char *ipstr = NULL;
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
+  int streams = 1;
+  uint8_t multiplex = 0;
+  char *capture_path = NULL;
+  size_t snaplen = 0;
+  size_t capture_file_size = 0;
+  int capture_files = 0;
+  uint64_t captured;
+  uint64_t capture_dropped;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt(argc, argv, "hsmf:p:a:")) != -1)
+  while ((opt = getopt(argc, argv, "hsmf:p:a:n:t:T:P:L:C:W:v:c:b:ur:x")) != -1)
   {
     switch (opt)
     {
@@ -447,6 +1196,61 @@ int main(int argc, char **argv)
     case 'a':
       ipstr = strdup(optarg);
       break;
+    case 'n':
+      streams = atoi(optarg);
+      if (streams < 1 || streams > MAX_STREAMS)
+      {
+        printf("The number of streams should be between 1 and %d\n", MAX_STREAMS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      sample_file = optarg;
+      break;
+    case 'T':
+      if (microtcp_trace_start(optarg, 0) < 0)
+      {
+        perror("Start the microTCP trace");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'P':
+      capture_path = optarg;
+      break;
+    case 'L':
+      snaplen = atoi(optarg);
+      break;
+    case 'C':
+      capture_file_size = atoi(optarg) * 1000000UL;
+      break;
+    case 'W':
+      capture_files = atoi(optarg);
+      break;
+    case 'v':
+      log_level = atoi(optarg);
+      break;
+    case 'c':
+      for (checksum = 0; checksum < MICROTCP_CHECKSUM_COUNT; checksum++)
+        if (strcmp(optarg, checksum_names[checksum]) == 0)
+          break;
+      if (checksum == MICROTCP_CHECKSUM_COUNT)
+      {
+        printf("Unknown checksum %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'b':
+      send_buffer_len = atoi(optarg) * 1024;
+      break;
+    case 'u':
+      socket_type |= MICROTCP_SOCK_URING;
+      break;
+    case 'r':
+      read_rate = atof(optarg) * 1024;
+      break;
+    case 'x':
+      multiplex = 1;
+      break;
 
     default:
       printf(
@@ -458,15 +1262,60 @@ int main(int argc, char **argv)
           "                       If not, is the source file at the client side that will be sent to the server.\n"
           "   -p <int>            The listening port of the server\n"
           "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+          "   -n <int>            Splits the file into n ranges and transfers them over n parallel connections.\n"
+          "                       With microTCP, stream i uses port + i.\n"
+          "   -x                  With -n and -m, the n ranges go over n streams of a single microTCP connection.\n"
+          "   -t <string>         Writes a CSV time series of the microTCP connection (cwnd, RTT, ...) to this file.\n"
+          "   -T <string>         Records the binary event trace of microTCP to this file, see trace_decode.\n"
+          "   -P <string>         Captures the microTCP segments to this pcap file, for Wireshark or tcpdump.\n"
+          "   -L <int>            Bytes of each segment the capture keeps, header included (default 96).\n"
+          "   -C <int>            Starts the next capture file every this many MB, files <file>.0, <file>.1, ...\n"
+          "   -W <int>            With -C, the number of capture files kept, the oldest is overwritten (default 8).\n"
+          "   -v <int>            Log and trace level, 1 errors only up to 5 every packet (default 5).\n"
+          "   -c <string>         The checksum microTCP asks for: crc32 (default), crc32c, hash64 or none.\n"
+          "                       Both sides must ask for the same one, otherwise crc32 is used.\n"
+          "   -b <int>            The client gives microTCP a send buffer of this many KiB, so reading the\n"
+          "                       file overlaps with sending it (default 0, microtcp_send() sends itself).\n"
+          "   -u                  microTCP does its socket I/O through io_uring where the kernel allows it.\n"
+          "   -r <int>            The microTCP server reads at most this many KiB per second, like a slow\n"
+          "                       application, which flow control has to hold the client back for.\n"
           "   -h                  prints this help\n");
       exit(EXIT_FAILURE);
     }
   }
 
+  if (capture_path && microtcp_capture_start(capture_path, snaplen, capture_file_size, capture_files) < 0)
+  {
+    perror("Start the microTCP capture");
+    exit(EXIT_FAILURE);
+  }
+
   /*
    * Depending the use arguments execute the appropriate functions
    */
-  if (is_server)
+  if (streams > 1 && multiplex && use_microtcp)
+  {
+    if (is_server)
+    {
+      exit_code = server_multiplexed(port, filestr, streams);
+    }
+    else
+    {
+      exit_code = client_multiplexed(ipstr, port, filestr, streams);
+    }
+  }
+  else if (streams > 1)
+  {
+    if (is_server)
+    {
+      exit_code = server_parallel(port, filestr, streams, use_microtcp);
+    }
+    else
+    {
+      exit_code = client_parallel(ipstr, port, filestr, streams, use_microtcp);
+    }
+  }
+  else if (is_server)
   {
 
     if (use_microtcp)
@@ -490,6 +1339,13 @@ int main(int argc, char **argv)
     }
   }
 
+  if (capture_path)
+  {
+    microtcp_capture_stop();
+    microtcp_capture_stats(&captured, &capture_dropped);
+    printf("Captured segments: %lu (%lu dropped)\n", captured, capture_dropped);
+  }
+
   free(filestr);
   free(ipstr);
   return exit_code;
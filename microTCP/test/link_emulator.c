@@ -0,0 +1,459 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+/*
+ * A UDP proxy that sits between two microTCP peers and emulates an
+ * imperfect link. The client connects to the listening port of the
+ * emulator, which forwards everything to the server and back.
+ *
+ * Each direction of the link applies, in order:
+ *   - loss, either Bernoulli or Gilbert-Elliott
+ *   - a token bucket rate limit with a bounded queue
+ *   - a fixed delay plus uniform jitter
+ *   - reordering, by holding back some datagrams for an extra delay
+ *   - duplication
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../utils/log.h"
+
+#define MAX_DATAGRAM 65536
+#define MAX_PENDING 65536
+
+typedef struct
+{
+  double loss;                  /* Bernoulli loss probability */
+  int gilbert;                  /* If set, use the Gilbert-Elliott model */
+  double p_gb;                  /* P(good -> bad) per datagram */
+  double p_bg;                  /* P(bad -> good) per datagram */
+  double loss_good;             /* Loss probability in the good state */
+  double loss_bad;              /* Loss probability in the bad state */
+  uint64_t delay_us;
+  uint64_t jitter_us;
+  double reorder;               /* Probability to hold back a datagram */
+  uint64_t reorder_us;          /* How long it is held back */
+  double duplicate;
+  uint64_t rate_bps;            /* 0 means unlimited */
+  uint64_t burst_bytes;
+  uint64_t queue_bytes;         /* Datagrams waiting longer than this for tokens are dropped */
+} link_params_t;
+
+typedef struct
+{
+  /* Gilbert-Elliott state */
+  int bad;
+  /* Token bucket, kept as the theoretical arrival time of GCRA */
+  uint64_t tat_us;
+
+  uint64_t forwarded;
+  uint64_t forwarded_bytes;
+  uint64_t lost;
+  uint64_t queue_drops;
+  uint64_t reordered;
+  uint64_t duplicated;
+} link_dir_t;
+
+typedef struct
+{
+  uint64_t release_us;
+  uint64_t order;               /* Keeps the heap stable for equal release times */
+  int to_server;
+  size_t len;
+  uint8_t *data;
+} pending_t;
+
+static pending_t *heap[MAX_PENDING];
+static size_t heap_len;
+static uint64_t heap_order;
+
+static link_params_t params;
+static link_dir_t dirs[2];      /* 0: client to server, 1: server to client */
+static unsigned short rng[3];
+static volatile sig_atomic_t running = 1;
+
+static void
+sig_handler(int signal)
+{
+  if (signal == SIGINT || signal == SIGTERM) {
+    running = 0;
+  }
+}
+
+static inline uint64_t
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline int
+heap_less(const pending_t *a, const pending_t *b)
+{
+  if (a->release_us != b->release_us)
+    return a->release_us < b->release_us;
+  return a->order < b->order;
+}
+
+static int
+heap_push(pending_t *p)
+{
+  size_t i;
+  size_t parent;
+
+  if (heap_len == MAX_PENDING) {
+    return -1;
+  }
+  p->order = heap_order++;
+  i = heap_len++;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (!heap_less(p, heap[parent]))
+      break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = p;
+  return 0;
+}
+
+static pending_t *
+heap_pop(void)
+{
+  pending_t *top = heap[0];
+  pending_t *last = heap[--heap_len];
+  size_t i = 0;
+  size_t child;
+
+  while ((child = 2 * i + 1) < heap_len) {
+    if (child + 1 < heap_len && heap_less(heap[child + 1], heap[child]))
+      child++;
+    if (!heap_less(heap[child], last))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+static int
+is_lost(link_dir_t *dir)
+{
+  if (!params.gilbert) {
+    return erand48(rng) < params.loss;
+  }
+  if (dir->bad) {
+    if (erand48(rng) < params.p_bg)
+      dir->bad = 0;
+  }
+  else if (erand48(rng) < params.p_gb) {
+    dir->bad = 1;
+  }
+  return erand48(rng) < (dir->bad ? params.loss_bad : params.loss_good);
+}
+
+/*
+ * Returns the time the datagram leaves the token bucket or 0 if it
+ * does not fit in the queue.
+ */
+static uint64_t
+shape(link_dir_t *dir, size_t len, uint64_t now)
+{
+  uint64_t tau;
+  uint64_t depart;
+
+  if (params.rate_bps == 0) {
+    return now;
+  }
+  tau = params.burst_bytes * 8 * 1000000ULL / params.rate_bps;
+  depart = dir->tat_us > now + tau ? dir->tat_us - tau : now;
+  if (depart - now > params.queue_bytes * 8 * 1000000ULL / params.rate_bps) {
+    dir->queue_drops++;
+    return 0;
+  }
+  dir->tat_us = (dir->tat_us > now ? dir->tat_us : now) + len * 8 * 1000000ULL / params.rate_bps;
+  return depart;
+}
+
+static void
+schedule(const uint8_t *data, size_t len, int to_server, uint64_t release)
+{
+  pending_t *p = (pending_t *)malloc(sizeof(pending_t) + len);
+  if (!p) {
+    return;
+  }
+  p->data = (uint8_t *)(p + 1);
+  memcpy(p->data, data, len);
+  p->len = len;
+  p->to_server = to_server;
+  p->release_us = release;
+  if (heap_push(p) < 0) {
+    dirs[!to_server].queue_drops++;
+    free(p);
+  }
+}
+
+static void
+impair(const uint8_t *data, size_t len, int to_server)
+{
+  link_dir_t *dir = &dirs[!to_server];
+  uint64_t now = now_us();
+  uint64_t release;
+  int64_t jitter = 0;
+
+  if (is_lost(dir)) {
+    dir->lost++;
+    return;
+  }
+  release = shape(dir, len, now);
+  if (release == 0) {
+    return;
+  }
+
+  if (params.jitter_us) {
+    jitter = (int64_t)(erand48(rng) * (2 * params.jitter_us + 1)) - (int64_t)params.jitter_us;
+  }
+  if ((int64_t)params.delay_us + jitter > 0) {
+    release += params.delay_us + jitter;
+  }
+  if (params.reorder > 0 && erand48(rng) < params.reorder) {
+    release += params.reorder_us;
+    dir->reordered++;
+  }
+  schedule(data, len, to_server, release);
+
+  if (params.duplicate > 0 && erand48(rng) < params.duplicate) {
+    schedule(data, len, to_server, release);
+    dir->duplicated++;
+  }
+}
+
+static void
+print_dir(const char *name, const link_dir_t *dir)
+{
+  printf("%s: forwarded %lu datagrams (%lu bytes), lost %lu, queue drops %lu, "
+         "reordered %lu, duplicated %lu\n", name, dir->forwarded, dir->forwarded_bytes,
+         dir->lost, dir->queue_drops, dir->reordered, dir->duplicated);
+}
+
+int
+main(int argc, char **argv)
+{
+  int opt;
+  int ret;
+  int listen_port = 0;
+  int server_port = 0;
+  int client_known = 0;
+  int client_sd;
+  int server_sd;
+  long seed = 0;
+  char *serverip = NULL;
+  ssize_t len;
+  uint64_t now;
+  uint8_t *buf;
+  pending_t *p;
+  struct pollfd fds[2];
+  struct timespec timeout;
+  struct sockaddr_in sin;
+  struct sockaddr_in server_addr;
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
+
+  memset(&params, 0, sizeof(link_params_t));
+  params.loss_bad = 1.0;
+  params.burst_bytes = 16 * 1024;
+  params.queue_bytes = 256 * 1024;
+  params.reorder_us = 5000;
+
+  while ((opt = getopt(argc, argv, "hl:a:p:L:G:d:j:r:R:D:b:B:q:s:")) != -1) {
+    switch (opt) {
+    case 'l':
+      listen_port = atoi(optarg);
+      break;
+    case 'a':
+      serverip = optarg;
+      break;
+    case 'p':
+      server_port = atoi(optarg);
+      break;
+    case 'L':
+      params.loss = atof(optarg);
+      break;
+    case 'G':
+      params.gilbert = 1;
+      sscanf(optarg, "%lf,%lf,%lf,%lf", &params.p_gb, &params.p_bg,
+             &params.loss_bad, &params.loss_good);
+      break;
+    case 'd':
+      params.delay_us = atof(optarg) * 1000;
+      break;
+    case 'j':
+      params.jitter_us = atof(optarg) * 1000;
+      break;
+    case 'r':
+      params.reorder = atof(optarg);
+      break;
+    case 'R':
+      params.reorder_us = atof(optarg) * 1000;
+      break;
+    case 'D':
+      params.duplicate = atof(optarg);
+      break;
+    case 'b':
+      params.rate_bps = atof(optarg) * 1000 * 1000;
+      break;
+    case 'B':
+      params.burst_bytes = atol(optarg);
+      break;
+    case 'q':
+      params.queue_bytes = atol(optarg);
+      break;
+    case 's':
+      seed = atol(optarg);
+      break;
+    default:
+      printf(
+          "Usage: link_emulator -l port -a server_ip -p server_port [options]\n"
+          "Options:\n"
+          "   -l <int>            the port the emulator waits for the client\n"
+          "   -a <string>         the IP address of the server\n"
+          "   -p <int>            the port of the server\n"
+          "   -L <double>         Bernoulli loss probability\n"
+          "   -G <p,r[,h[,k]]>    Gilbert-Elliott loss: P(good->bad), P(bad->good),\n"
+          "                       loss in the bad state (default 1), loss in the good state (default 0)\n"
+          "   -d <double>         one way delay in milliseconds\n"
+          "   -j <double>         uniform jitter in milliseconds (+/-)\n"
+          "   -r <double>         probability to reorder a datagram\n"
+          "   -R <double>         extra delay in milliseconds of reordered datagrams (default 5)\n"
+          "   -D <double>         duplication probability\n"
+          "   -b <double>         rate limit in Mbit/s (default unlimited)\n"
+          "   -B <int>            token bucket size in bytes (default 16384)\n"
+          "   -q <int>            queue size in bytes of the rate limiter (default 262144)\n"
+          "   -s <int>            seed of the random generator\n"
+          "   -h                  prints this help\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (!listen_port || !server_port || !serverip) {
+    LOG_ERROR("The listening port, the server address and port are mandatory");
+    exit(EXIT_FAILURE);
+  }
+
+  rng[0] = 0x330E;
+  rng[1] = seed & 0xFFFF;
+  rng[2] = (seed >> 16) & 0xFFFF;
+
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  client_sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  server_sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (client_sd < 0 || server_sd < 0) {
+    perror("Opening UDP socket");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (bind(client_sd, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) == -1) {
+    perror("Bind listening port");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&server_addr, 0, sizeof(struct sockaddr_in));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+  server_addr.sin_addr.s_addr = inet_addr(serverip);
+
+  buf = (uint8_t *)malloc(MAX_DATAGRAM);
+  if (!buf) {
+    perror("Allocate datagram buffer");
+    exit(EXIT_FAILURE);
+  }
+
+  LOG_INFO("Emulating link between port %d and %s:%d", listen_port, serverip, server_port);
+
+  fds[0].fd = client_sd;
+  fds[0].events = POLLIN;
+  fds[1].fd = server_sd;
+  fds[1].events = POLLIN;
+  while (running) {
+    /* Sleep until the next datagram is due or new traffic arrives */
+    now = now_us();
+    if (heap_len) {
+      uint64_t wait = heap[0]->release_us > now ? heap[0]->release_us - now : 0;
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_nsec = (wait % 1000000) * 1000;
+    }
+    else {
+      timeout.tv_sec = 1;
+      timeout.tv_nsec = 0;
+    }
+    ret = ppoll(fds, 2, &timeout, NULL);
+    if (ret < 0 && errno != EINTR) {
+      perror("ppoll");
+      break;
+    }
+
+    if (ret > 0 && (fds[0].revents & POLLIN)) {
+      client_addr_len = sizeof(struct sockaddr_in);
+      len = recvfrom(client_sd, buf, MAX_DATAGRAM, 0, (struct sockaddr *)&client_addr,
+                     &client_addr_len);
+      if (len >= 0) {
+        client_known = 1;
+        impair(buf, len, 1);
+      }
+    }
+    if (ret > 0 && (fds[1].revents & POLLIN)) {
+      len = recvfrom(server_sd, buf, MAX_DATAGRAM, 0, NULL, NULL);
+      if (len >= 0) {
+        impair(buf, len, 0);
+      }
+    }
+
+    now = now_us();
+    while (heap_len && heap[0]->release_us <= now) {
+      p = heap_pop();
+      if (p->to_server) {
+        sendto(server_sd, p->data, p->len, 0, (struct sockaddr *)&server_addr,
+               sizeof(struct sockaddr_in));
+      }
+      else if (client_known) {
+        sendto(client_sd, p->data, p->len, 0, (struct sockaddr *)&client_addr,
+               sizeof(struct sockaddr_in));
+      }
+      dirs[!p->to_server].forwarded++;
+      dirs[!p->to_server].forwarded_bytes += p->len;
+      free(p);
+    }
+  }
+
+  print_dir("client -> server", &dirs[0]);
+  print_dir("server -> client", &dirs[1]);
+
+  while (heap_len) {
+    free(heap_pop());
+  }
+  free(buf);
+  close(client_sd);
+  close(server_sd);
+  return 0;
+}
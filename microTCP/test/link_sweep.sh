@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Georgios Gerasimos Leventopoulos csd4152
+# Konstantinos Anemozalis csd4149
+# Theofanis Tsesmetzis csd4142
+
+#
+# Sweeps the link_emulator parameters and records the goodput of a
+# microTCP bandwidth_test transfer through it, one CSV line per run.
+#
+# Usage: link_sweep.sh <directory with link_emulator and bandwidth_test>
+#
+# The sweep is controlled by the environment:
+#   LOSSES   Bernoulli loss probabilities      (default "0 0.001 0.01 0.05")
+#   DELAYS   one way delays in ms              (default "0 5 25")
+#   RATES    rate limits in Mbit/s, 0 is none  (default "0 100")
+#   JITTER   jitter in ms                      (default 0)
+#   REORDER  reordering probability            (default 0)
+#   SIZE_MB  size of the transferred file      (default 16)
+#   TIMEOUT  seconds before a run is aborted   (default 60)
+#   PORT     base port                         (default 17000)
+#   OUT      CSV output file                   (default link_sweep.csv)
+#
+
+BIN=${1:-.}
+LOSSES=${LOSSES:-"0 0.001 0.01 0.05"}
+DELAYS=${DELAYS:-"0 5 25"}
+RATES=${RATES:-"0 100"}
+JITTER=${JITTER:-0}
+REORDER=${REORDER:-0}
+SIZE_MB=${SIZE_MB:-16}
+TIMEOUT=${TIMEOUT:-60}
+PORT=${PORT:-17000}
+OUT=${OUT:-link_sweep.csv}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+head -c $((SIZE_MB * 1048576)) /dev/urandom > "$WORK/in.bin"
+echo "loss,delay_ms,rate_mbit,jitter_ms,reorder,throughput_MBps,transfer_sec,intact" > "$OUT"
+
+for loss in $LOSSES; do
+  for delay in $DELAYS; do
+    for rate in $RATES; do
+      server_port=$PORT
+      emu_port=$((PORT + 1))
+      PORT=$((PORT + 2))
+
+      "$BIN/link_emulator" -l "$emu_port" -a 127.0.0.1 -p "$server_port" \
+        -L "$loss" -d "$delay" -j "$JITTER" -r "$REORDER" -b "$rate" -s 1 \
+        > "$WORK/emu.log" 2>&1 &
+      emu=$!
+      timeout "$TIMEOUT" "$BIN/bandwidth_test" -s -m -p "$server_port" -f "$WORK/out.bin" \
+        > "$WORK/server.log" 2>&1 &
+      server=$!
+      sleep 0.2
+      timeout "$TIMEOUT" "$BIN/bandwidth_test" -m -a 127.0.0.1 -p "$emu_port" \
+        -f "$WORK/in.bin" > "$WORK/client.log" 2>&1
+      wait "$server"
+      server_status=$?
+      kill -INT "$emu" 2>/dev/null
+      wait "$emu"
+
+      throughput=$(sed -n 's/^Throughput achieved: \([0-9.]*\).*/\1/p' "$WORK/server.log")
+      seconds=$(sed -n 's/^Transfer time: \([0-9.]*\).*/\1/p' "$WORK/server.log")
+      # The server fails unless the stream ended with the FIN of the client
+      if [ "$server_status" -eq 0 ] && cmp -s "$WORK/in.bin" "$WORK/out.bin"; then
+        intact=1
+      else
+        intact=0
+      fi
+      echo "$loss,$delay,$rate,$JITTER,$REORDER,${throughput:-0},${seconds:-$TIMEOUT},$intact" | tee -a "$OUT"
+      rm -f "$WORK/out.bin"
+    done
+  done
+done
@@ -0,0 +1,403 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+/*
+ * Microbenchmarks for the per-packet hot paths of microTCP.
+ *
+ * Each benchmark runs a number of warm-up batches, then measures a number
+ * of batches of ops and reports the per-op cost distribution over the
+ * batches, together with the packet and byte rate derived from the mean.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.c"
+
+#define BULK_LEN (64 * 1024)
+#define PING_LEN 64
+
+typedef struct
+{
+  const char *name;
+  void (*setup)(void);
+  void (*prepare)(void);        /* Runs before each batch, not measured */
+  void (*op)(void);
+  void (*teardown)(void);
+  size_t bytes_per_op;          /* Payload bytes moved by one op */
+  size_t packets_per_op;        /* Segments handled by one op */
+  size_t ops_per_batch;
+} bench_t;
+
+static size_t warmup_batches = 10;
+static size_t batches = 100;
+static FILE *csv;
+
+/* Keeps the compiler from optimizing the measured work away */
+static volatile uint32_t sink;
+
+static uint8_t segment[MICROTCP_MSS + sizeof(microtcp_header_t)];
+static uint8_t payload[BULK_LEN];
+
+/* A connected pair of microTCP sockets over the loopback */
+static microtcp_sock_t client;
+static microtcp_sock_t server;
+static struct sockaddr_in client_addr;
+static struct sockaddr_in server_addr;
+static pthread_t peer;
+static int peer_started;
+static volatile int peer_running;
+
+static inline uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void
+run_bench(const bench_t *b)
+{
+  double *samples;
+  double mean = 0.0;
+  uint64_t start;
+  size_t i;
+  size_t j;
+
+  samples = (double *)malloc(batches * sizeof(double));
+  if (!samples) {
+    perror("Allocate samples");
+    exit(EXIT_FAILURE);
+  }
+
+  if (b->setup)
+    b->setup();
+  for (i = 0; i < warmup_batches; i++) {
+    if (b->prepare)
+      b->prepare();
+    for (j = 0; j < b->ops_per_batch; j++)
+      b->op();
+  }
+
+  for (i = 0; i < batches; i++) {
+    if (b->prepare)
+      b->prepare();
+    start = now_ns();
+    for (j = 0; j < b->ops_per_batch; j++)
+      b->op();
+    samples[i] = (double)(now_ns() - start) / b->ops_per_batch;
+    mean += samples[i];
+  }
+  if (b->teardown)
+    b->teardown();
+
+  mean /= batches;
+  qsort(samples, batches, sizeof(double), cmp_double);
+
+  printf("%-22s %10.1f %10.1f %10.1f %10.1f %10.1f %14.0f %12.2f\n",
+         b->name, samples[0], samples[batches / 2],
+         samples[batches * 90 / 100], samples[batches * 99 / 100],
+         samples[batches - 1],
+         b->packets_per_op * 1e9 / mean,
+         b->bytes_per_op * 1e9 / mean / (1024.0 * 1024.0));
+  if (csv) {
+    fprintf(csv, "%s,%f,%f,%f,%f,%f,%f,%f\n", b->name, samples[0],
+            samples[batches / 2], samples[batches * 90 / 100],
+            samples[batches * 99 / 100], samples[batches - 1],
+            b->packets_per_op * 1e9 / mean, b->bytes_per_op * 1e9 / mean);
+  }
+  free(samples);
+}
+
+/* ---------------- Header and checksum ---------------- */
+
+/* The segments take the checksum of the engine, a constant with MICROTCP_FIXED_CHECKSUM */
+
+static void
+op_header(void)
+{
+  microtcp_header_t h;
+  initializeHeader(&h, htonl(sink), htonl(1), ACK, htons(MICROTCP_WIN_SIZE),
+                   htonl(MICROTCP_MSS), 0, 0, 0);
+  insertToBuffer(segment, &h, sizeof(microtcp_header_t), payload, 0, MICROTCP_MSS,
+                 SOCKET_CHECKSUM(&client));
+  sink += h.checksum;
+}
+
+static void
+op_crc32(void)
+{
+  sink += crc32(segment, sizeof(segment));
+}
+
+static void
+op_crc32c(void)
+{
+  sink += crc32c(segment, sizeof(segment));
+}
+
+static void
+op_hash64(void)
+{
+  sink += hash64(segment, sizeof(segment), 0);
+}
+
+static void
+op_valid_checksum(void)
+{
+  sink += hasValidCheckSum(segment, sizeof(segment), SOCKET_CHECKSUM(&client));
+}
+
+/* ---------------- Loopback fixture ---------------- */
+
+static void
+open_pair(void)
+{
+  socklen_t len = sizeof(struct sockaddr_in);
+
+  client = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  server = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (client.state == INVALID || server.state == INVALID) {
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&client_addr, 0, sizeof(struct sockaddr_in));
+  client_addr.sin_family = AF_INET;
+  client_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server_addr = client_addr;
+  if (microtcp_bind(&client, (struct sockaddr *)&client_addr, len) < 0
+      || microtcp_bind(&server, (struct sockaddr *)&server_addr, len) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  getsockname(client.sd, (struct sockaddr *)&client_addr, &len);
+  getsockname(server.sd, (struct sockaddr *)&server_addr, &len);
+
+  /*
+   * Skip the handshake, the benchmarks measure the data path only.
+   * Both ends start from the same sequence numbers.
+   */
+  client.address = (struct sockaddr *)&server_addr;
+  client.size = len;
+  client.state = ESTABLISHED;
+  client.seq_number = client.ack_number = 0;
+  server.address = (struct sockaddr *)&client_addr;
+  server.size = len;
+  server.state = ESTABLISHED;
+  server.seq_number = server.ack_number = 0;
+  client.recvbuf = malloc(MICROTCP_RECVBUF_LEN);
+  server.recvbuf = malloc(MICROTCP_RECVBUF_LEN);
+}
+
+static void
+close_pair(void)
+{
+  microtcp_header_t fin;
+
+  peer_running = 0;
+  if (peer_started) {
+    /* A FIN wakes up the peer if it is blocked on recvfrom() */
+    initializeHeader(&fin, htonl(server.ack_number), 0, FIN_ACK, 0, 0, 0, 0, 0);
+    insertToBuffer(segment, &fin, sizeof(microtcp_header_t), NULL, 0, 0,
+                   SOCKET_CHECKSUM(&client));
+    sendto(client.sd, segment, sizeof(microtcp_header_t), 0,
+           (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in));
+    pthread_join(peer, NULL);
+    peer_started = 0;
+  }
+  close(client.sd);
+  close(server.sd);
+  free(client.recvbuf);
+  free(server.recvbuf);
+}
+
+/* ---------------- Bulk send ---------------- */
+
+static void *
+sink_peer(void *arg)
+{
+  static uint8_t buf[BULK_LEN];
+
+  (void)arg;
+  while (peer_running)
+    microtcp_recv(&server, buf, sizeof(buf), 0);
+  return NULL;
+}
+
+static void
+setup_send(void)
+{
+  open_pair();
+  peer_running = 1;
+  peer_started = 1;
+  pthread_create(&peer, NULL, sink_peer, NULL);
+}
+
+static void
+op_send(void)
+{
+  sink += microtcp_send(&client, payload, BULK_LEN, 0);
+}
+
+/* ---------------- Receive ---------------- */
+
+/*
+ * Segments are injected straight into the UDP socket of the receiver,
+ * so the benchmark measures the processing of already queued segments
+ * and not the wakeup of a blocked receiver.
+ */
+#define RECV_QUEUE_DEPTH 64
+
+static void
+prepare_recv(void)
+{
+  microtcp_header_t h;
+  size_t i;
+
+  for (i = 0; i < RECV_QUEUE_DEPTH; i++) {
+    initializeHeader(&h, htonl(client.seq_number), htonl(client.ack_number), ACK,
+                     htons(MICROTCP_WIN_SIZE), htonl(MICROTCP_MSS), 0, 0, 0);
+    insertToBuffer(segment, &h, sizeof(microtcp_header_t), payload, 0, MICROTCP_MSS,
+                   SOCKET_CHECKSUM(&client));
+    sendto(client.sd, segment, sizeof(segment), 0,
+           (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in));
+    client.seq_number += MICROTCP_MSS;
+  }
+}
+
+static void
+setup_recv(void)
+{
+  int rcvbuf = 4 * 1024 * 1024;
+  open_pair();
+  setsockopt(server.sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+static void
+op_recv(void)
+{
+  static uint8_t buf[MICROTCP_MSS];
+  sink += microtcp_recv(&server, buf, sizeof(buf), 0);
+}
+
+/* ---------------- Ping-pong ---------------- */
+
+static void *
+echo_peer(void *arg)
+{
+  uint8_t buf[MICROTCP_MSS];
+  ssize_t ret;
+
+  (void)arg;
+  while (peer_running) {
+    ret = microtcp_recv(&server, buf, PING_LEN, 0);
+    if (ret <= 0 || !peer_running)
+      break;
+    microtcp_send(&server, buf, ret, 0);
+  }
+  return NULL;
+}
+
+static void
+setup_pingpong(void)
+{
+  open_pair();
+  peer_running = 1;
+  peer_started = 1;
+  pthread_create(&peer, NULL, echo_peer, NULL);
+}
+
+static void
+op_pingpong(void)
+{
+  uint8_t buf[MICROTCP_MSS];
+  microtcp_send(&client, payload, PING_LEN, 0);
+  sink += microtcp_recv(&client, buf, PING_LEN, 0);
+}
+
+static const bench_t benches[] = {
+  { "header+serialize", NULL, NULL, op_header, NULL, MICROTCP_MSS, 1, 1000 },
+  { "crc32", NULL, NULL, op_crc32, NULL, sizeof(segment), 1, 1000 },
+  { "crc32c", NULL, NULL, op_crc32c, NULL, sizeof(segment), 1, 1000 },
+  { "hash64", NULL, NULL, op_hash64, NULL, sizeof(segment), 1, 1000 },
+  { "hasValidCheckSum", NULL, NULL, op_valid_checksum, NULL, sizeof(segment), 1, 1000 },
+  { "send-segmentation", setup_send, NULL, op_send, close_pair, BULK_LEN,
+    (BULK_LEN + MICROTCP_MSS - 1) / MICROTCP_MSS, 16 },
+  { "recv-reassembly", setup_recv, prepare_recv, op_recv, close_pair, MICROTCP_MSS, 1,
+    RECV_QUEUE_DEPTH },
+  { "loopback-pingpong", setup_pingpong, NULL, op_pingpong, close_pair, 2 * PING_LEN, 2, 100 },
+};
+
+int
+main(int argc, char **argv)
+{
+  int opt;
+  size_t i;
+  const char *filter = NULL;
+
+  while ((opt = getopt(argc, argv, "hw:b:f:c:")) != -1) {
+    switch (opt) {
+    case 'w':
+      warmup_batches = atoi(optarg);
+      break;
+    case 'b':
+      batches = atoi(optarg);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'c':
+      csv = fopen(optarg, "w");
+      if (!csv) {
+        perror("Open CSV file");
+        exit(EXIT_FAILURE);
+      }
+      fprintf(csv, "benchmark,min_ns,p50_ns,p90_ns,p99_ns,max_ns,packets_per_sec,bytes_per_sec\n");
+      break;
+    default:
+      printf(
+          "Usage: microtcp_bench [-w batches] [-b batches] [-f name] [-c file]\n"
+          "Options:\n"
+          "   -w <int>            number of warm-up batches (default 10)\n"
+          "   -b <int>            number of measured batches (default 100)\n"
+          "   -f <string>         run only the benchmarks whose name contains the string\n"
+          "   -c <string>         also write the results as CSV to this file\n"
+          "   -h                  prints this help\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (batches < 1) {
+    batches = 1;
+  }
+
+  memset(payload, 0xA5, sizeof(payload));
+  printf("%-22s %10s %10s %10s %10s %10s %14s %12s\n", "benchmark (ns/op)",
+         "min", "p50", "p90", "p99", "max", "packets/s", "MB/s");
+  for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (filter && !strstr(benches[i].name, filter))
+      continue;
+    run_bench(&benches[i]);
+  }
+  if (csv)
+    fclose(csv);
+  return 0;
+}
@@ -0,0 +1,413 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+/*
+ * Runs many microTCP transfers at once inside the simulated network of
+ * microtcp_sim.h and reports the goodput of every flow and how fairly
+ * the bottleneck was shared. All the times are virtual, so the results
+ * depend only on the parameters and the seed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+#include "../lib/microtcp_sim.h"
+#include "../lib/microtcp_capture.h"
+
+#define MAX_CHUNK_SIZE (1024 * 1024)
+#define BASE_PORT 5000
+
+typedef struct
+{
+  int id;
+  uint16_t port;
+  uint64_t bytes;
+  uint64_t start_delay_us;
+
+  uint64_t sent;                /* Bytes microtcp_send() accepted */
+  uint64_t received;
+  uint64_t expired;
+  uint64_t retransmissions;
+  uint64_t repairs;
+  uint64_t recovered;
+  size_t recvbuf_len;           /* The largest the receive buffer of the server grew */
+  size_t mss;
+  int warm_start;               /* The client started from the metrics of earlier flows */
+  size_t initial_cwnd;          /* The cwnd of the client right after the handshake */
+  int closed;                   /* Sides whose microtcp_shutdown() succeeded, 2 for a clean close */
+  uint64_t start_us;
+  uint64_t end_us;
+} flow_t;
+
+/* The size of every microtcp_send() and microtcp_recv() */
+static size_t chunk_size = 4096;
+
+/* Message mode and the lifetime of the messages, see microtcp_set_message_mode() */
+static int message_mode = 0;
+static uint64_t lifetime_us = 0;
+
+/* Messages per repair segment, see microtcp_set_fec() */
+static int fec_block = 0;
+
+/* Budget of the receive buffers, see microtcp_set_memory_limit(), and their peak */
+static size_t memory_limit = 0;
+static size_t memory_peak = 0;
+
+static void *
+server_task(void *arg)
+{
+  flow_t *flow = (flow_t *)arg;
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  struct sockaddr client_addr;
+  static uint8_t buffer[MAX_CHUNK_SIZE]; /* Only one task runs at a time */
+  ssize_t received;
+
+  sock = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(flow->port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (message_mode)
+    microtcp_set_message_mode(&sock, lifetime_us);
+  if (fec_block)
+    microtcp_set_fec(&sock, fec_block);
+  if (microtcp_bind(&sock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0
+      || microtcp_accept(&sock, &client_addr, sizeof(struct sockaddr)) < 0) {
+    sim_close(sock.sd);
+    return NULL;
+  }
+
+  flow->start_us = sim_now_us();
+  while (flow->received < flow->bytes) {
+    received = microtcp_recv(&sock, buffer, chunk_size, 0);
+    if (received <= 0)
+      break;
+    flow->received += received;
+    flow->end_us = sim_now_us();
+    /* The simulation runs one task at a time, no lock needed */
+    memory_peak = microtcp_memory_used() > memory_peak ? microtcp_memory_used() : memory_peak;
+    flow->recvbuf_len = sock.recvbuf_len > flow->recvbuf_len ? sock.recvbuf_len : flow->recvbuf_len;
+  }
+  while (sock.state == ESTABLISHED && microtcp_recv(&sock, buffer, chunk_size, 0) > 0)
+    ;
+  if (microtcp_shutdown(&sock, SHUT_RDWR) == 0)
+    flow->closed++;
+  flow->recovered = sock.fec_recovered;
+  sim_close(sock.sd);
+  return NULL;
+}
+
+static void *
+client_task(void *arg)
+{
+  flow_t *flow = (flow_t *)arg;
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  uint8_t *buffer;
+  uint64_t sent = 0;
+  size_t chunk;
+  size_t size = chunk_size;
+  microtcp_stats_t stats;
+
+  sim_sleep_us(flow->start_delay_us);
+  buffer = (uint8_t *)malloc(chunk_size);
+  if (!buffer)
+    return NULL;
+  memset(buffer, flow->id, chunk_size);
+  sock = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(flow->port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (message_mode)
+    microtcp_set_message_mode(&sock, lifetime_us);
+  if (fec_block)
+    microtcp_set_fec(&sock, fec_block);
+  if (microtcp_connect(&sock, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0) {
+    sim_close(sock.sd);
+    free(buffer);
+    return NULL;
+  }
+
+  /* A message must fit in a segment */
+  microtcp_get_stats(&sock, &stats);
+  flow->initial_cwnd = stats.cwnd;
+  if ((message_mode || fec_block) && size > stats.mss)
+    size = stats.mss;
+  while (sent < flow->bytes) {
+    chunk = flow->bytes - sent < size ? flow->bytes - sent : size;
+    if (microtcp_send(&sock, buffer, chunk, 0) != (ssize_t)chunk)
+      break;
+    sent += chunk;
+  }
+  flow->sent = sent;
+  if (microtcp_shutdown(&sock, SHUT_RDWR) == 0)
+    flow->closed++;
+  microtcp_get_stats(&sock, &stats);
+  flow->expired = stats.messages_expired;
+  flow->retransmissions = stats.retransmissions;
+  flow->repairs = stats.fec_repairs;
+  flow->mss = stats.mss;
+  flow->warm_start = stats.warm_start;
+  sim_close(sock.sd);
+  free(buffer);
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  int opt;
+  int i;
+  int n = 1;
+  int completed = 0;
+  int expired = 0;
+  int unclean = 0;
+  int over_budget;
+  uint64_t bytes = 1024 * 1024;
+  uint64_t stagger_us = 0;
+  uint64_t until_us = 3600ULL * 1000000;
+  uint64_t seed = 1;
+  uint64_t virtual_us;
+  uint64_t retransmissions = 0;
+  uint64_t repairs = 0;
+  uint64_t recovered = 0;
+  size_t recvbuf_max = 0;
+  int warm_starts = 0;
+  int warm_larger = 0;
+  int check_warm = 0;
+  size_t cold_cwnd = SIZE_MAX;
+  const char *capture_path = NULL;
+  uint64_t captured;
+  uint64_t capture_dropped;
+  double goodput;
+  double aggregate = 0.0;
+  uint64_t total_received = 0;
+  uint64_t first_start = UINT64_MAX;
+  uint64_t last_end = 0;
+  double sum = 0.0;
+  double sum_sq = 0.0;
+  double wall;
+  flow_t *flows;
+  sim_link_t link;
+  sim_stats_t stats;
+  struct timespec wall_start;
+  struct timespec wall_end;
+
+  memset(&link, 0, sizeof(sim_link_t));
+  link.delay_us = 10000;
+  link.rate_bps = 100 * 1000 * 1000;
+  link.queue_bytes = 256 * 1024;
+
+  while ((opt = getopt(argc, argv, "hn:s:d:j:l:b:q:i:t:S:M:F:B:c:u:U:P:W")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = atoi(optarg);
+      break;
+    case 's':
+      bytes = atoll(optarg);
+      break;
+    case 'd':
+      link.delay_us = atof(optarg) * 1000;
+      break;
+    case 'j':
+      link.jitter_us = atof(optarg) * 1000;
+      break;
+    case 'l':
+      link.loss = atof(optarg);
+      break;
+    case 'b':
+      link.rate_bps = atof(optarg) * 1000 * 1000;
+      break;
+    case 'q':
+      link.queue_bytes = atoll(optarg);
+      break;
+    case 'i':
+      stagger_us = atof(optarg) * 1000;
+      break;
+    case 't':
+      until_us = atof(optarg) * 1000000;
+      break;
+    case 'S':
+      seed = atoll(optarg);
+      break;
+    case 'M':
+      message_mode = 1;
+      lifetime_us = atof(optarg) * 1000;
+      break;
+    case 'F':
+      fec_block = atoi(optarg);
+      if (fec_block < 0 || fec_block > MICROTCP_FEC_MAX_BLOCK) {
+        printf("The FEC block should be between 0 and %d messages\n", MICROTCP_FEC_MAX_BLOCK);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'B':
+      memory_limit = atoll(optarg);
+      if (microtcp_set_memory_limit(memory_limit) < 0)
+        exit(EXIT_FAILURE);
+      break;
+    case 'c':
+      chunk_size = atoll(optarg);
+      if (chunk_size < 1 || chunk_size > MAX_CHUNK_SIZE) {
+        printf("The chunk size should be between 1 and %d\n", MAX_CHUNK_SIZE);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'u':
+      link.mtu = atoi(optarg);
+      break;
+    case 'U':
+      link.interface_mtu = atoi(optarg);
+      break;
+    case 'P':
+      capture_path = optarg;
+      break;
+    case 'W':
+      check_warm = 1;
+      break;
+    default:
+      printf(
+          "Usage: sim_transfer [options]\n"
+          "Options:\n"
+          "   -n <int>            number of concurrent flows (default 1)\n"
+          "   -s <int>            bytes transferred by each flow (default 1 MiB)\n"
+          "   -d <double>         one way delay in milliseconds (default 10)\n"
+          "   -j <double>         jitter in milliseconds (default 0)\n"
+          "   -l <double>         loss probability at the bottleneck (default 0)\n"
+          "   -b <double>         bottleneck rate in Mbit/s, 0 for infinite (default 100)\n"
+          "   -q <int>            bottleneck queue in bytes (default 262144)\n"
+          "   -i <double>         milliseconds between the starts of the flows (default 0)\n"
+          "   -t <double>         stop after this many virtual seconds (default 3600)\n"
+          "   -S <int>            seed of the simulation (default 1)\n"
+          "   -M <double>         sends messages of up to one segment that are abandoned\n"
+          "                       after this many milliseconds, 0 never abandons them\n"
+          "   -F <int>            sends a repair segment per this many messages (FEC, implies message mode)\n"
+          "   -B <int>            budget of the receive buffers of all the flows in bytes (default 64 MiB)\n"
+          "   -c <int>            bytes per microtcp_send() and microtcp_recv() (default 4096)\n"
+          "   -u <int>            MTU of the bottleneck, larger datagrams vanish (default none)\n"
+          "   -U <int>            MTU of the interfaces of the endpoints (default 65535)\n"
+          "   -P <string>         captures the segments of all the flows to this pcap file, in virtual time\n"
+          "   -W                  fails unless every flow after the first starts from its metrics with a\n"
+          "                       larger cwnd, give them a stagger with -i\n"
+          "   -h                  prints this help\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (n < 1 || n > 65535 - BASE_PORT) {
+    printf("Invalid number of flows\n");
+    exit(EXIT_FAILURE);
+  }
+
+  flows = (flow_t *)calloc(n, sizeof(flow_t));
+  if (!flows) {
+    perror("Allocate flows");
+    exit(EXIT_FAILURE);
+  }
+
+  sim_init(seed, &link);
+  if (capture_path && microtcp_capture_start(capture_path, 0, 0, 0) < 0) {
+    perror("Start the microTCP capture");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++) {
+    flows[i].id = i;
+    flows[i].port = BASE_PORT + i;
+    flows[i].bytes = bytes;
+    flows[i].start_delay_us = i * stagger_us;
+    if (sim_spawn(SIM_RIGHT, server_task, &flows[i]) < 0
+        || sim_spawn(SIM_LEFT, client_task, &flows[i]) < 0) {
+      printf("Failed to create the tasks of flow %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+  virtual_us = sim_run(until_us);
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  microtcp_capture_stop();
+  wall = wall_end.tv_sec - wall_start.tv_sec + (wall_end.tv_nsec - wall_start.tv_nsec) * 1e-9;
+
+  printf("flow,bytes,received,expired,mss,start_s,end_s,goodput_mbps\n");
+  for (i = 0; i < n; i++) {
+    goodput = 0.0;
+    if (flows[i].end_us > flows[i].start_us)
+      goodput = flows[i].received * 8.0 / (flows[i].end_us - flows[i].start_us);
+    if (flows[i].received == flows[i].bytes)
+      completed++;
+    else if (flows[i].sent == flows[i].bytes && flows[i].expired > 0)
+      expired++; /* Every byte was sent, the missing ones were messages abandoned on purpose */
+    if (flows[i].closed < 2)
+      unclean++;
+    total_received += flows[i].received;
+    if (flows[i].received > 0 && flows[i].start_us < first_start)
+      first_start = flows[i].start_us;
+    if (flows[i].end_us > last_end)
+      last_end = flows[i].end_us;
+    sum += goodput;
+    sum_sq += goodput * goodput;
+    retransmissions += flows[i].retransmissions;
+    repairs += flows[i].repairs;
+    recovered += flows[i].recovered;
+    warm_starts += flows[i].warm_start;
+    if (!flows[i].warm_start && flows[i].initial_cwnd < cold_cwnd)
+      cold_cwnd = flows[i].initial_cwnd;
+    if (flows[i].recvbuf_len > recvbuf_max)
+      recvbuf_max = flows[i].recvbuf_len;
+    printf("%d,%lu,%lu,%lu,%zu,%f,%f,%f\n", i, flows[i].bytes, flows[i].received, flows[i].expired,
+           flows[i].mss, flows[i].start_us * 1e-6, flows[i].end_us * 1e-6, goodput);
+  }
+
+  /* All the bytes over the time from the first start to the last end, not the sum of the rates */
+  if (last_end > first_start && first_start != UINT64_MAX)
+    aggregate = total_received * 8.0 / (last_end - first_start);
+
+  sim_get_stats(&stats);
+  printf("\nFlows completed: %d of %d\n", completed, n);
+  if (expired)
+    printf("Flows short of abandoned messages: %d of %d\n", expired, n);
+  if (unclean)
+    printf("Flows not closed cleanly: %d of %d\n", unclean, n);
+  printf("Aggregate goodput: %f Mbit/s\n", aggregate);
+  printf("Jain's fairness index: %f\n", sum_sq > 0 ? sum * sum / (n * sum_sq) : 0.0);
+  printf("Datagrams: %lu sent, %lu delivered, %lu lost, %lu queue drops, %lu too big\n",
+         stats.sent, stats.delivered, stats.lost, stats.queue_drops, stats.mtu_drops);
+  if (fec_block)
+    printf("FEC: %lu repair segments, %lu messages rebuilt, %lu retransmissions\n",
+           repairs, recovered, retransmissions);
+  for (i = 0; i < n; i++)
+    warm_larger += flows[i].warm_start && flows[i].initial_cwnd > cold_cwnd;
+  if (warm_starts)
+    printf("Warm starts: %d of %d flows began from the metrics of earlier ones, %d with a larger cwnd\n",
+           warm_starts, n, warm_larger);
+  /* The first flow starts cold, every later one should start warm and faster */
+  if (check_warm && (warm_larger != n - 1 || n < 2)) {
+    fprintf(stderr, "Only %d of the %d later flows started with a larger cwnd than a cold one\n", warm_larger, n - 1);
+    check_warm = -1;
+  }
+  if (capture_path) {
+    microtcp_capture_stats(&captured, &capture_dropped);
+    printf("Captured segments: %lu (%lu dropped)\n", captured, capture_dropped);
+  }
+  if (memory_limit)
+    printf("Receive buffers: peak %zu bytes of a %zu byte budget, the largest %zu bytes\n",
+           memory_peak, memory_limit, recvbuf_max);
+  /* Each of the 2 * n sockets may hold its smallest buffer beyond the budget */
+  over_budget = memory_limit && memory_peak > memory_limit + 2 * (size_t)n * MICROTCP_RECVBUF_LEN;
+  if (over_budget)
+    fprintf(stderr, "The receive buffers went %zu bytes over their budget\n", memory_peak - memory_limit);
+  printf("Simulated %f seconds in %f seconds of wall time (%lu events)\n",
+         virtual_us * 1e-6, wall, stats.events);
+  free(flows);
+  return completed + expired == n && unclean == 0 && !over_budget && check_warm >= 0 ? 0 : EXIT_FAILURE;
+}
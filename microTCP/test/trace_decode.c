@@ -0,0 +1,212 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+/*
+ * Decodes a trace written by microtcp_trace_start() into text or CSV,
+ * with the events of all the threads merged in time order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../lib/microtcp.h"
+#include "../lib/microtcp_trace.h"
+
+static const char *state_names[] = {
+  "UNKNOWN", "LISTEN", "ESTABLISHED", "CLOSING_BY_PEER",
+  "CLOSING_BY_HOST", "CLOSED", "INVALID"
+};
+
+static const char *type_names[] = {
+  "?", "SENT", "RECEIVED", "ACK", "RETRANSMIT", "CWND", "STATE", "ERROR", "DROPPED", "MSS"
+};
+
+static const char *
+state_name(uint32_t state)
+{
+  return state < sizeof(state_names) / sizeof(state_names[0]) ? state_names[state] : "?";
+}
+
+static const char *
+type_name(uint16_t type)
+{
+  return type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[type] : "?";
+}
+
+/* The control field in host order, as recorded by the library */
+static const char *
+control_name(uint32_t control, char *buf)
+{
+  buf[0] = '\0';
+  if (control & 0x4000)
+    strcat(buf, "SYN|");
+  if (control & 0x8000)
+    strcat(buf, "FIN|");
+  if (control & 0x2000)
+    strcat(buf, "RST|");
+  if (control & 0x1000)
+    strcat(buf, "ACK|");
+  if (buf[0] != '\0')
+    buf[strlen(buf) - 1] = '\0';
+  else
+    strcpy(buf, "-");
+  return buf;
+}
+
+static microtcp_trace_event_t *events = NULL;
+
+/* Sorts indices into events, so events of the same time keep the file order */
+static int
+compare_time(const void *a, const void *b)
+{
+  size_t i = *(const size_t *)a;
+  size_t j = *(const size_t *)b;
+
+  if (events[i].time_ns != events[j].time_ns)
+    return events[i].time_ns < events[j].time_ns ? -1 : 1;
+  return i < j ? -1 : i > j;
+}
+
+static void
+print_text(const microtcp_trace_event_t *ev, uint64_t start_ns)
+{
+  char flags[32];
+
+  printf("%14.9f t%-3u sd %-3d %-10s ", (ev->time_ns - start_ns) * 1e-9,
+         ev->thread, ev->sd, type_name(ev->type));
+  switch (ev->type) {
+  case TRACE_SEGMENT_SENT:
+  case TRACE_SEGMENT_RECEIVED:
+    printf("seq %u ack %u len %u %s\n", ev->seq, ev->ack, ev->len,
+           control_name(ev->arg, flags));
+    break;
+  case TRACE_ACK:
+    printf("una %u ack %u acked %u dupacks %u\n", ev->seq, ev->ack, ev->len, ev->arg);
+    break;
+  case TRACE_RETRANSMIT:
+    if (ev->arg == 2)
+      printf("from %u, %u bytes (tail loss probe)\n", ev->seq, ev->len);
+    else
+      printf("from %u, %u bytes in flight (%s)\n", ev->seq, ev->len,
+             ev->arg ? "fast retransmit" : "timeout");
+    break;
+  case TRACE_CWND:
+    printf("una %u cwnd %u ssthresh %u\n", ev->seq, ev->arg, ev->len);
+    break;
+  case TRACE_STATE:
+    printf("%s -> %s (seq %u ack %u)\n", state_name(ev->len), state_name(ev->arg),
+           ev->seq, ev->ack);
+    break;
+  case TRACE_ERROR:
+    printf("at microtcp.c:%u: %s\n", ev->len, strerror(ev->arg));
+    break;
+  case TRACE_DROPPED:
+    printf("%u events lost, the ring was full\n", ev->arg);
+    break;
+  case TRACE_MSS:
+    printf("una %u segment size %u -> %u\n", ev->seq, ev->len, ev->arg);
+    break;
+  default:
+    printf("seq %u ack %u len %u arg %u\n", ev->seq, ev->ack, ev->len, ev->arg);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int opt;
+  int csv = 0;
+  int filter_sd = -1;
+  FILE *fp;
+  size_t n = 0;
+  size_t cap = 0;
+  size_t i;
+  microtcp_trace_file_header_t header;
+  microtcp_trace_event_t *tmp;
+  microtcp_trace_event_t *ev;
+  size_t *order;
+
+  while ((opt = getopt(argc, argv, "hcs:")) != -1) {
+    switch (opt) {
+    case 'c':
+      csv = 1;
+      break;
+    case 's':
+      filter_sd = atoi(optarg);
+      break;
+    default:
+      printf(
+          "Usage: trace_decode [-c] [-s sd] trace_file\n"
+          "Options:\n"
+          "   -c                  prints CSV instead of text\n"
+          "   -s <int>            prints only the events of this socket descriptor\n"
+          "   -h                  prints this help\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    printf("The trace file is missing\n");
+    exit(EXIT_FAILURE);
+  }
+
+  fp = fopen(argv[optind], "r");
+  if (!fp) {
+    perror("Open trace file");
+    exit(EXIT_FAILURE);
+  }
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || memcmp(header.magic, MICROTCP_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    printf("%s is not a microTCP trace\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  if (header.version != MICROTCP_TRACE_VERSION
+      || header.event_size != sizeof(microtcp_trace_event_t)) {
+    printf("Unsupported trace version %u\n", header.version);
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    if (n == cap) {
+      cap = cap ? 2 * cap : 4096;
+      tmp = (microtcp_trace_event_t *)realloc(events, cap * sizeof(microtcp_trace_event_t));
+      if (!tmp) {
+        perror("Allocate events");
+        exit(EXIT_FAILURE);
+      }
+      events = tmp;
+    }
+    if (fread(&events[n], sizeof(microtcp_trace_event_t), 1, fp) != 1)
+      break;
+    if (filter_sd < 0 || events[n].sd == filter_sd || events[n].type == TRACE_DROPPED)
+      n++;
+  }
+  fclose(fp);
+
+  /* Each thread wrote its own events in order, merge them */
+  order = (size_t *)malloc((n + 1) * sizeof(size_t));
+  if (!order) {
+    perror("Allocate events");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  qsort(order, n, sizeof(size_t), compare_time);
+
+  if (csv)
+    printf("time_ns,thread,sd,event,seq,ack,len,arg\n");
+  for (i = 0; i < n; i++) {
+    ev = &events[order[i]];
+    if (csv)
+      printf("%lu,%u,%d,%s,%u,%u,%u,%u\n", ev->time_ns, ev->thread, ev->sd,
+             type_name(ev->type), ev->seq, ev->ack, ev->len, ev->arg);
+    else
+      print_text(ev, events[order[0]].time_ns);
+  }
+  free(order);
+  free(events);
+  return 0;
+}
@@ -18,134 +18,433 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Open-loop traffic generator. It waits for n traffic_generator_client
+ * connections, on ports port to port + n - 1, and then sends messages to
+ * all of them at a target aggregate rate. Every message has an intended
+ * send time on an absolute schedule. A send that takes long does not
+ * delay the schedule, the messages that became due meanwhile are sent
+ * right after it, so the offered load stays the same no matter how slow
+ * microTCP gets (no coordinated omission). The achieved load and how far
+ * behind the schedule the sends were are reported periodically and at the
+ * end.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <random>
-#include <chrono>
 #include <thread>
+#include <atomic>
+#include <vector>
 
+#include "../lib/microtcp.hpp"
 extern "C" {
-#include "../lib/microtcp.h"
 #include "../utils/log.h"
+#include "../utils/hdr_histogram.h"
 }
+#include "traffic_generator.h"
 
 #define BUF_LEN 2048
+#define MAX_BUF_LEN 65536
+#define MAX_CONNECTIONS 256
+#define SPIN_NS 50000           /* Busy wait the last part of a gap, sleeps are not that precise */
+#define HIGHEST_LAG_NS (60 * 1000000000LL)
+
+enum arrival_model
+{
+  ARRIVAL_POISSON,
+  ARRIVAL_CONSTANT,
+  ARRIVAL_BURSTY
+};
+
+/* The I/O of the sockets is picked once, -u runs the generator with uring_socket */
+typedef microtcp::connection<> syscall_socket;
+typedef microtcp::connection<microtcp::warm_start, microtcp::crc32, microtcp::uring_io> uring_socket;
 
-static bool stop_traffic = false;
+template <class Socket>
+struct connection
+{
+  int id;
+  Socket sock;                          /* In a slot of the connection table */
+  struct sockaddr client_addr;
+  std::atomic<uint64_t> next_intended;  /* Intended send time of the next message */
+  std::atomic<uint64_t> sent;
+  std::atomic<uint64_t> bytes;
+  hdr_histogram_t lag;                  /* Actual minus intended send time */
+  bool failed;
+
+  connection (int id, microtcp_table_t *table)
+      : id (id), sock (table), client_addr (), next_intended (0), sent (0), bytes (0),
+        lag (), failed (false)
+  {
+  }
+};
+
+static std::atomic<bool> stop_traffic(false);
+
+/* Shared by all the connections, set before they start */
+static enum arrival_model model = ARRIVAL_POISSON;
+static double conn_rate;                /* Messages per second of each connection */
+static int burst_len = 16;
+static size_t msg_len = BUF_LEN;
+static bool coalesce = false;           /* MICROTCP_MSG_MORE while the next message is already due */
+static uint64_t start_ns;
+static uint64_t end_ns;
+static int64_t realtime_offset_ns;      /* CLOCK_REALTIME minus CLOCK_MONOTONIC */
 
 
 void
 sig_handler(int signal)
 {
   if(signal == SIGINT) {
-    LOG_INFO("Stopping traffic generator...");
     stop_traffic = true;
   }
 }
 
-int
-main (int argc, char **argv)
+static inline uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleeps until the absolute time t of CLOCK_MONOTONIC, with microsecond precision */
+static void
+wait_until (uint64_t t)
+{
+  struct timespec ts;
+  uint64_t now = monotonic_ns ();
+
+  if (now + SPIN_NS < t) {
+    ts.tv_sec = (t - SPIN_NS) / 1000000000ULL;
+    ts.tv_nsec = (t - SPIN_NS) % 1000000000ULL;
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+  while (monotonic_ns () < t && !stop_traffic)
+    ;
+}
+
+/*
+ * The time from one intended send to the next. The bursty model sends
+ * bursts of burst_len messages back to back, with Poisson arrivals of the
+ * bursts, so its average rate is the same.
+ */
+static uint64_t
+next_gap (std::mt19937_64 &gen, uint64_t n)
+{
+  switch (model) {
+  case ARRIVAL_CONSTANT:
+    return 1e9 / conn_rate;
+  case ARRIVAL_BURSTY:
+    if ((n + 1) % burst_len != 0)
+      return 0;
+    return std::exponential_distribution<double> (conn_rate / burst_len) (gen) * 1e9;
+  case ARRIVAL_POISSON:
+  default:
+    return std::exponential_distribution<double> (conn_rate) (gen) * 1e9;
+  }
+}
+
+template <class Socket>
+static void
+sender (struct connection<Socket> *c)
+{
+  std::mt19937_64 gen (std::random_device {} () + c->id);
+  std::vector<char> buffer (msg_len, 0);
+  uint64_t intended = start_ns + next_gap (gen, 0);
+  uint64_t now;
+  uint64_t next;
+  uint64_t n = 0;
+
+  c->next_intended = intended;
+  while (!stop_traffic && c->sock.state () == ESTABLISHED
+      && (end_ns == 0 || intended < end_ns)) {
+    wait_until (intended);
+    if (stop_traffic)
+      break;
+    now = monotonic_ns ();
+    hdr_record (&c->lag, now > intended ? now - intended : 0);
+    traffic_message_fill (buffer.data (), msg_len, n, intended + realtime_offset_ns,
+                          now + realtime_offset_ns);
+    /* The schedule does not depend on how long the send took */
+    next = intended + next_gap (gen, n++);
+    if (c->sock.send (buffer.data (), msg_len,
+                      coalesce && next <= monotonic_ns () ? MICROTCP_MSG_MORE : 0)
+        != (ssize_t) msg_len) {
+      c->failed = true;
+      break;
+    }
+    c->sent++;
+    c->bytes += msg_len;
+    intended = next;
+    c->next_intended = intended;
+  }
+}
+
+/* How far the connection that is most behind its schedule is, in seconds */
+template <class Socket>
+static double
+behind_schedule (std::vector<struct connection<Socket> *> &conns, uint64_t now)
+{
+  uint64_t next;
+  uint64_t worst = 0;
+
+  for (struct connection<Socket> *c : conns) {
+    next = c->next_intended;
+    if (now > next && now - next > worst)
+      worst = now - next;
+  }
+  return worst * 1e-9;
+}
+
+/* Accepts the n connections, sends their traffic and reports on it */
+template <class Socket>
+static int
+generate (int port, int n, double rate, double duration)
 {
-  int                   opt;
   int                   ret;
-  int                   port;
-  int                   mean_inter;
-  microtcp_sock_t       sock;
+  double                elapsed;
+  uint64_t              sent;
+  uint64_t              bytes;
+  uint64_t              last_sent = 0;
+  uint64_t              last_ns;
+  uint64_t              now;
   struct sockaddr_in    sin;
-  struct sockaddr       client_addr;
   socklen_t             client_addr_len;
   struct sockaddr_in    *addr_in;
   char                  ip_addr[INET_ADDRSTRLEN];
-  char                  buffer[BUF_LEN];
+  struct timespec       rt;
+  hdr_histogram_t       lag;
+  microtcp_table_t      *table;
+  std::vector<struct connection<Socket> *> conns;
+  std::vector<std::thread> threads;
+
+  /* The state of all the connections sits together, aligned to cache lines */
+  table = microtcp_table_create (n);
+  if (!table) {
+    LOG_ERROR("Failed to allocate the connection table");
+    return -EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < n && !stop_traffic; i++) {
+    struct connection<Socket> *c = new struct connection<Socket> (i, table);
+    if (hdr_init (&c->lag, HIGHEST_LAG_NS, 3) < 0) {
+      LOG_ERROR("Failed to allocate the histograms");
+      return -EXIT_FAILURE;
+    }
+
+    /* The microtcp socket was created with the connection */
+    if (!c->sock.valid ()) {
+      LOG_ERROR("Failed to create socket %d", i);
+      return -EXIT_FAILURE;
+    }
+
+    memset (&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (port + i);
+    /* Bind to all available network interfaces */
+    sin.sin_addr.s_addr = INADDR_ANY;
+
+    if (c->sock.bind ((struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
+      LOG_ERROR("Failed to bind");
+      return -EXIT_FAILURE;
+    }
+
+    /*
+     * Normally, using the original TCP, we would have to set the socket
+     * in listening mode with listen(). MicroTCP does not provide such function
+     * so we proceed using the equivalent TCP accept()
+     */
+
+    /* Block waiting for a connection */
+    client_addr_len = sizeof(struct sockaddr);
+    ret = c->sock.accept (&c->client_addr, client_addr_len);
+    if(ret != 0) {
+      LOG_ERROR("Failed to accept connection");
+      return -EXIT_FAILURE;
+    }
+
+    addr_in = (struct sockaddr_in *) &c->client_addr;
+    inet_ntop(AF_INET, &(addr_in->sin_addr), ip_addr, INET_ADDRSTRLEN);
+    LOG_INFO("Peer %s connected on port %d.", ip_addr, port + i);
+    conns.push_back (c);
+  }
+
+  std::this_thread::sleep_for (std::chrono::seconds(1));
+  LOG_INFO("Start generating traffic...");
+
+  /* The schedules of all the connections start together */
+  clock_gettime (CLOCK_REALTIME, &rt);
+  start_ns = monotonic_ns ();
+  realtime_offset_ns = rt.tv_sec * 1000000000LL + rt.tv_nsec - (int64_t) start_ns;
+  end_ns = duration > 0 ? start_ns + duration * 1e9 : 0;
+  for (struct connection<Socket> *c : conns)
+    threads.push_back (std::thread (sender<Socket>, c));
+
+  last_ns = start_ns;
+  while (!stop_traffic && (end_ns == 0 || monotonic_ns () < end_ns)) {
+    std::this_thread::sleep_for (std::chrono::seconds(1));
+    now = monotonic_ns ();
+    sent = 0;
+    for (struct connection<Socket> *c : conns)
+      sent += c->sent;
+    printf ("[%8.2f s] offered %10.1f msg/s  achieved %10.1f msg/s  %8.3f MB/s  behind %.6f s\n",
+            (now - start_ns) * 1e-9, rate, (sent - last_sent) / ((now - last_ns) * 1e-9),
+            (sent - last_sent) * msg_len / ((now - last_ns) * 1e-3),
+            behind_schedule (conns, now));
+    last_sent = sent;
+    last_ns = now;
+  }
+  stop_traffic = true;
+  for (std::thread &t : threads)
+    t.join ();
+  now = monotonic_ns ();
+  elapsed = (now - start_ns) * 1e-9;
+
+  hdr_init (&lag, HIGHEST_LAG_NS, 3);
+  sent = 0;
+  bytes = 0;
+  for (struct connection<Socket> *c : conns) {
+    sent += c->sent;
+    bytes += c->bytes;
+    hdr_add (&lag, &c->lag);
+    if (c->failed)
+      LOG_WARN("Connection %d failed", c->id);
+  }
+  printf ("\nOffered load:  %10.1f msg/s  %8.3f MB/s\n", rate, rate * msg_len / 1e6);
+  printf ("Achieved load: %10.1f msg/s  %8.3f MB/s  (%" PRIu64 " messages in %f s)\n",
+          sent / elapsed, bytes / elapsed / 1e6, sent, elapsed);
+  printf ("Send lag behind the schedule: p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+          hdr_value_at_percentile (&lag, 50.0) / 1000.0,
+          hdr_value_at_percentile (&lag, 99.0) / 1000.0,
+          hdr_value_at_percentile (&lag, 99.9) / 1000.0, lag.max / 1000.0);
+
+  LOG_INFO("Going to terminate microtcp connection...");
+
+  /* Deleting a connection shuts it down and closes its socket */
+  for (struct connection<Socket> *c : conns) {
+    hdr_free (&c->lag);
+    delete c;
+  }
+  hdr_free (&lag);
+  microtcp_table_destroy (table);
+  return 0;
+}
 
-  /* Create the random generator */
-  std::random_device rd;
-  std::mt19937 gen(rd());
+int
+main (int argc, char **argv)
+{
+  int                   opt;
+  int                   port = 0;
+  int                   n = 1;
+  double                mean_inter = 0;
+  double                rate = 0;
+  double                byte_rate = 0;
+  double                duration = 0;
+  bool                  uring = false;
+  struct sigaction      sa;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hp:i:")) != -1) {
+  while ((opt = getopt (argc, argv, "hp:n:i:r:R:s:m:b:d:cu")) != -1) {
     switch (opt)
       {
       case 'p':
         port = atoi (optarg);
         /* To check or not to check? */
         break;
+      case 'n':
+        n = atoi (optarg);
+        break;
       case 'i':
         /*
          * Set the mean of the poisson distribution for the interarrivals
-         * in milliseconds (ms)
+         * in milliseconds (ms), of all the connections together
          */
-        mean_inter = atoi (optarg);
+        mean_inter = atof (optarg);
+        break;
+      case 'r':
+        rate = atof (optarg);
+        break;
+      case 'R':
+        byte_rate = atof (optarg);
+        break;
+      case 's':
+        msg_len = atoi (optarg);
+        break;
+      case 'm':
+        if (strcmp (optarg, "poisson") == 0)
+          model = ARRIVAL_POISSON;
+        else if (strcmp (optarg, "constant") == 0)
+          model = ARRIVAL_CONSTANT;
+        else if (strcmp (optarg, "bursty") == 0)
+          model = ARRIVAL_BURSTY;
+        else {
+          printf ("Unknown arrival model %s\n", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'b':
+        burst_len = atoi (optarg);
+        break;
+      case 'd':
+        duration = atof (optarg);
+        break;
+      case 'c':
+        coalesce = true;
+        break;
+      case 'u':
+        uring = true;
         break;
       default:
         printf (
-            "Usage: bandwidth_test -p port -i packet inter-arrival ms"
+            "Usage: traffic_generator -p port [-n connections] [-r rate | -R rate | -i ms] [options]\n"
             "Options:\n"
-            "   -p <int>            the port to wait for a peer"
-            "   -i <int>            the mean inter-arrival time in milliseconds of the poisson distribution"
+            "   -p <int>            the port to wait for the first peer, peer i connects to port + i\n"
+            "   -n <int>            the number of connections (default 1)\n"
+            "   -r <double>         aggregate rate in messages per second\n"
+            "   -R <double>         aggregate rate in bytes per second\n"
+            "   -i <double>         mean inter-arrival time of all the connections in milliseconds\n"
+            "   -s <int>            message size in bytes (default 2048)\n"
+            "   -m <string>         arrival model: poisson, constant or bursty (default poisson)\n"
+            "   -b <int>            messages per burst of the bursty model (default 16)\n"
+            "   -d <double>         seconds to generate traffic, 0 until Ctrl+C (default 0)\n"
+            "   -c                  coalesces the messages that are already due into full segments\n"
+            "   -u                  does the socket I/O through io_uring where the kernel allows it\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
   }
-  std::poisson_distribution<int> dpoisson(mean_inter);
-  LOG_INFO("Creating traffic generator on port %d", port);
-  LOG_INFO("Poisson distribution inter-arrivals with mean %u ms", mean_inter);
-
-  /*
-   * Register a signal handler so we can terminate the generator with
-   * Ctrl+C
-   */
-  signal(SIGINT, sig_handler);
-
-  /* Create a microtcp socket */
-  sock = microtcp_socket (AF_INET, 0, 0);
- /* TODO: some error checking here ??? */
-
-  memset (&sin, 0, sizeof(struct sockaddr_in));
-  sin.sin_family = AF_INET;
-  sin.sin_port = htons (port);
-  /* Bind to all available network interfaces */
-  sin.sin_addr.s_addr = INADDR_ANY;
-
-  if (microtcp_bind (&sock, (struct sockaddr *) &sin,
-                     sizeof(struct sockaddr_in)) == -1) {
-    LOG_ERROR("Failed to bind");
+  if (byte_rate > 0)
+    rate = byte_rate / msg_len;
+  else if (rate <= 0 && mean_inter > 0)
+    rate = 1000.0 / mean_inter;
+  if (rate <= 0 || n < 1 || n > MAX_CONNECTIONS || burst_len < 1
+      || msg_len < sizeof(traffic_message_t) || msg_len > MAX_BUF_LEN) {
+    LOG_ERROR("Invalid arguments, see -h");
     return -EXIT_FAILURE;
   }
+  conn_rate = rate / n;
+  LOG_INFO("Creating traffic generator on ports %d to %d", port, port + n - 1);
+  LOG_INFO("Offered load %.1f messages/s, %.3f MB/s", rate, rate * msg_len / 1e6);
 
   /*
-   * Normally, using the original TCP, we would have to set the socket
-   * in listening mode with listen(). MicroTCP does not provide such function
-   * so we proceed using the equivalent TCP accept()
+   * Register a signal handler so we can terminate the generator with
+   * Ctrl+C
    */
+  memset (&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = sig_handler;
+  sigaction (SIGINT, &sa, NULL);
 
-  /* Block waiting for a connection */
-  client_addr_len = sizeof(struct sockaddr);
-  ret = microtcp_accept(&sock, &client_addr, client_addr_len);
-  if(ret != 0) {
-    LOG_ERROR("Failed to accept connection");
-    return -EXIT_FAILURE;
-  }
-
-  addr_in = (struct sockaddr_in *) &client_addr;
-  inet_ntop(AF_INET, &(addr_in->sin_addr), ip_addr, INET_ADDRSTRLEN);
-  LOG_INFO("Peer %s connected.", ip_addr);
-  std::this_thread::sleep_for (std::chrono::seconds(1));
-  LOG_INFO("Start generating traffic...");
-
-  while(stop_traffic == false) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
-    microtcp_send(&sock, buffer, BUF_LEN, 0);
-  }
-
-  LOG_INFO("Going to terminate microtcp connection...");
-
-  /* SHUT_RDWR can be omitted internally */
-  microtcp_shutdown(&sock, SHUT_RDWR);
-
+  /* The only place the type of the sockets is decided at run time */
+  if (uring)
+    return generate<uring_socket> (port, n, rate, duration);
+  return generate<syscall_socket> (port, n, rate, duration);
 }
@@ -0,0 +1,53 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef TEST_TRAFFIC_GENERATOR_H_
+#define TEST_TRAFFIC_GENERATOR_H_
+
+/*
+ * The messages that traffic_generator sends and traffic_generator_client
+ * receives. Every message starts with this header, in network byte order,
+ * followed by padding up to its length.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <endian.h>
+
+#define TRAFFIC_MAGIC 0x6d544350      /* "mTCP" */
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t length;              /* Of the whole message, header included */
+  uint64_t seq;                 /* Message number within the connection */
+  uint64_t intended_ns;         /* When the schedule of the sender said to send it */
+  uint64_t timestamp_ns;        /* When the sender actually sent it */
+} traffic_message_t;
+
+/*
+ * Both timestamps are CLOCK_REALTIME, so one-way latencies are meaningful
+ * on the same host or across hosts with synchronized clocks.
+ */
+static inline uint64_t
+traffic_now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+traffic_message_fill (void *buf, uint32_t length, uint64_t seq, uint64_t intended_ns,
+                      uint64_t timestamp_ns)
+{
+  traffic_message_t *m = (traffic_message_t *) buf;
+  m->magic = htobe32 (TRAFFIC_MAGIC);
+  m->length = htobe32 (length);
+  m->seq = htobe64 (seq);
+  m->intended_ns = htobe64 (intended_ns);
+  m->timestamp_ns = htobe64 (timestamp_ns);
+}
+
+#endif /* TEST_TRAFFIC_GENERATOR_H_ */
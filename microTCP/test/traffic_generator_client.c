@@ -18,9 +18,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Receives the messages of traffic_generator and measures the one-way
+ * latency of each one and the time between consecutive messages.
+ * The latency is measured from the time the schedule of the generator
+ * meant to send the message, so a generator that falls behind cannot hide
+ * the delay (coordinated omission). The latency from the actual send is
+ * reported separately as the network latency. Percentiles of both are printed
+ * periodically and the whole distributions on Ctrl+C or when the generator
+ * closes the connection.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -28,37 +41,271 @@
 
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
+#include "../utils/hdr_histogram.h"
+#include "traffic_generator.h"
 
-static char running = 1;
+#define MAX_MESSAGE_LEN 65536
+#define HIGHEST_LATENCY_NS (60 * 1000000000LL)
+
+static volatile sig_atomic_t running = 1;
 
 static void
 sig_handler(int signal)
 {
   if(signal == SIGINT) {
-    LOG_INFO("Stopping traffic generator client...");
     running = 0;
   }
 }
 
+typedef struct
+{
+  hdr_histogram_t total;
+  hdr_histogram_t interval;
+} latency_t;
+
+static int
+latency_init(latency_t *l)
+{
+  if (hdr_init(&l->total, HIGHEST_LATENCY_NS, 3) < 0)
+    return -1;
+  return hdr_init(&l->interval, HIGHEST_LATENCY_NS, 3);
+}
+
+static void
+latency_record(latency_t *l, int64_t ns)
+{
+  hdr_record(&l->total, ns);
+  hdr_record(&l->interval, ns);
+}
+
+/* One line with the percentiles in microseconds */
+static void
+print_percentiles(const char *name, const hdr_histogram_t *h)
+{
+  printf("%-13s p50 %10.1f  p99 %10.1f  p99.9 %10.1f  max %10.1f us\n", name,
+         hdr_value_at_percentile(h, 50.0) / 1000.0,
+         hdr_value_at_percentile(h, 99.0) / 1000.0,
+         hdr_value_at_percentile(h, 99.9) / 1000.0,
+         h->max / 1000.0);
+}
+
 int
 main(int argc, char **argv) {
-  uint16_t port;
+  int opt;
+  uint16_t port = 0;
+  const char *ip = "127.0.0.1";
+  const char *dump_file = NULL;
+  int dump = 0;                 /* The full distributions, not just the percentiles */
+  double report_sec = 1.0;
+  int busy_poll_us = 0;
+  int kernel_busy_poll_us = 0;
+  int fec_block = 0;
+  microtcp_stats_t stats;
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  struct sigaction sa;
+  uint8_t *buffer;
+  size_t fill = 0;
+  ssize_t received;
+  traffic_message_t *msg;
+  uint32_t length;
+  uint64_t now;
+  uint64_t start;
+  uint64_t next_report;
+  uint64_t last_arrival = 0;
+  uint64_t messages = 0;
+  uint64_t interval_messages = 0;
+  uint64_t bytes = 0;
+  uint64_t expected_seq = 0;
+  uint64_t seq_gaps = 0;
+  int64_t one_way;
+  uint64_t intended;
+  latency_t latency;
+  latency_t network;
+  latency_t inter_arrival;
+  FILE *fp;
+
+  while ((opt = getopt(argc, argv, "ha:p:i:do:P:K:F:")) != -1) {
+    switch (opt) {
+    case 'a':
+      ip = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'i':
+      report_sec = atof(optarg);
+      break;
+    case 'd':
+      dump = 1;
+      break;
+    case 'o':
+      dump_file = optarg;
+      dump = 1;
+      break;
+    case 'P':
+      busy_poll_us = atoi(optarg);
+      break;
+    case 'K':
+      kernel_busy_poll_us = atoi(optarg);
+      break;
+    case 'F':
+      fec_block = atoi(optarg);
+      break;
+    default:
+      printf(
+          "Usage: traffic_generator_client -a address -p port [-i seconds] [-d] [-o file] [-P us] [-K us] [-F messages]\n"
+          "Options:\n"
+          "   -a <string>         the address of the traffic generator (default 127.0.0.1)\n"
+          "   -p <int>            the port of the traffic generator\n"
+          "   -i <double>         seconds between the periodic reports (default 1)\n"
+          "   -d                  prints the full latency distributions, not only their percentiles\n"
+          "   -o <string>         writes the full latency distributions to this file\n"
+          "   -P <int>            spins on the socket for up to this many microseconds before blocking\n"
+          "   -K <int>            sets SO_BUSY_POLL to this many microseconds\n"
+          "   -F <int>            asks for a repair segment per this many messages (FEC, message mode)\n"
+          "   -h                  prints this help\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  buffer = (uint8_t *) malloc(MAX_MESSAGE_LEN);
+  if (!buffer || latency_init(&latency) < 0 || latency_init(&network) < 0
+      || latency_init(&inter_arrival) < 0) {
+    LOG_ERROR("Failed to allocate the buffers");
+    exit(EXIT_FAILURE);
+  }
 
   /*
    * Register a signal handler so we can terminate the client with
-   * Ctrl+C
+   * Ctrl+C. Without SA_RESTART, so a blocked microtcp_recv() returns.
    */
-  signal(SIGINT, sig_handler);
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = sig_handler;
+  sigaction(SIGINT, &sa, NULL);
+
+  sock = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock.state == INVALID) {
+    LOG_ERROR("Failed to create the socket");
+    exit(EXIT_FAILURE);
+  }
+  if ((busy_poll_us > 0 && microtcp_setsockopt(&sock, MICROTCP_BUSY_POLL, busy_poll_us) < 0)
+      || (kernel_busy_poll_us > 0
+          && microtcp_setsockopt(&sock, MICROTCP_KERNEL_BUSY_POLL, kernel_busy_poll_us) < 0)) {
+    LOG_ERROR("Failed to enable busy polling");
+    exit(EXIT_FAILURE);
+  }
+  if (fec_block > 0 && microtcp_set_fec(&sock, fec_block) < 0) {
+    LOG_ERROR("Failed to enable FEC");
+    exit(EXIT_FAILURE);
+  }
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  if (inet_pton(AF_INET, ip, &sin.sin_addr) != 1) {
+    LOG_ERROR("Invalid address %s", ip);
+    exit(EXIT_FAILURE);
+  }
+  if (microtcp_connect(&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) < 0) {
+    LOG_ERROR("Failed to connect to %s:%u", ip, port);
+    exit(EXIT_FAILURE);
+  }
 
   LOG_INFO("Start receiving traffic from port %u", port);
-  /*TODO: Connect using microtcp_connect() */
+  start = traffic_now_ns();
+  next_report = start + report_sec * 1e9;
   while(running) {
-    /* TODO: Measure time */
-    /* TODO: Receive using microtcp_recv()*/
-    /* TODO: Measure time */
-    /* TODO: Do other stuff... */
+    received = microtcp_recv(&sock, buffer + fill, MAX_MESSAGE_LEN - fill, 0);
+    if (received <= 0)
+      break;
+    now = traffic_now_ns();
+    fill += received;
+    bytes += received;
+
+    /* The stream may split or merge messages, take out the complete ones */
+    while (fill >= sizeof(traffic_message_t)) {
+      msg = (traffic_message_t *) buffer;
+      length = be32toh(msg->length);
+      if (be32toh(msg->magic) != TRAFFIC_MAGIC || length < sizeof(traffic_message_t)
+          || length > MAX_MESSAGE_LEN) {
+        LOG_ERROR("Corrupted message stream after %" PRIu64 " messages", messages);
+        running = 0;
+        break;
+      }
+      if (fill < length)
+        break;
+
+      intended = be64toh(msg->intended_ns);
+      one_way = now - (intended ? intended : be64toh(msg->timestamp_ns));
+      latency_record(&latency, one_way > 0 ? one_way : 0);
+      one_way = now - be64toh(msg->timestamp_ns);
+      latency_record(&network, one_way > 0 ? one_way : 0);
+      if (messages > 0)
+        latency_record(&inter_arrival, now - last_arrival);
+      if (be64toh(msg->seq) != expected_seq)
+        seq_gaps++;
+      expected_seq = be64toh(msg->seq) + 1;
+      last_arrival = now;
+      messages++;
+      interval_messages++;
+
+      fill -= length;
+      memmove(buffer, buffer + length, fill);
+    }
+
+    if (now >= next_report) {
+      printf("[%8.2f s] %" PRIu64 " messages\n", (now - start) * 1e-9, interval_messages);
+      print_percentiles("one-way", &latency.interval);
+      print_percentiles("network", &network.interval);
+      print_percentiles("inter-arrival", &inter_arrival.interval);
+      hdr_reset(&latency.interval);
+      hdr_reset(&network.interval);
+      hdr_reset(&inter_arrival.interval);
+      interval_messages = 0;
+      next_report = now + report_sec * 1e9;
+    }
   }
 
-  /* Ctrl+C pressed! Store properly time measurements for plotting */
-}
+  /* Ctrl+C pressed or the generator finished! Store the time measurements for plotting */
+  now = traffic_now_ns();
+  printf("\nReceived %" PRIu64 " messages, %" PRIu64 " bytes in %f seconds (%" PRIu64 " sequence gaps)\n",
+         messages, bytes, (now - start) * 1e-9, seq_gaps);
+  print_percentiles("one-way", &latency.total);
+  print_percentiles("network", &network.total);
+  print_percentiles("inter-arrival", &inter_arrival.total);
+  if (busy_poll_us > 0) {
+    microtcp_get_stats(&sock, &stats);
+    printf("Busy polling: %" PRIu64 " hits, %" PRIu64 " misses, %.3f s CPU (%.1f%% of the run)\n",
+           stats.busy_poll_hits, stats.busy_poll_misses, stats.busy_poll_cpu_us * 1e-6,
+           100.0 * stats.busy_poll_cpu_us / ((now - start) * 1e-3));
+  }
+  if (fec_block > 0)
+    printf("FEC: %" PRIu64 " lost messages rebuilt from the repair segments\n", sock.fec_recovered);
+
+  if (dump) {
+    fp = dump_file ? fopen(dump_file, "w") : stdout;
+    if (!fp) {
+      perror("Open the distribution file");
+      fp = stdout;
+    }
+    fprintf(fp, "\nOne-way latency (us):\n");
+    hdr_print_percentiles(&latency.total, fp, 1000.0);
+    fprintf(fp, "\nNetwork latency (us):\n");
+    hdr_print_percentiles(&network.total, fp, 1000.0);
+    fprintf(fp, "\nInter-arrival time (us):\n");
+    hdr_print_percentiles(&inter_arrival.total, fp, 1000.0);
+    if (fp != stdout)
+      fclose(fp);
+  }
 
+  if (sock.state == ESTABLISHED || sock.state == CLOSING_BY_PEER)
+    microtcp_shutdown(&sock, SHUT_RDWR);
+  hdr_free(&latency.total);
+  hdr_free(&latency.interval);
+  hdr_free(&network.total);
+  hdr_free(&network.interval);
+  hdr_free(&inter_arrival.total);
+  hdr_free(&inter_arrival.interval);
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,121 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef UTILS_CRC32C_H_
+#define UTILS_CRC32C_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * CRC-32C (Castagnoli, polynomial 0x1EDC6F41), the CRC of iSCSI and SCTP.
+ * Uses the CRC32 instructions of SSE 4.2 or ARMv8 when the CPU has them
+ * and a lookup table otherwise.
+ */
+
+#define CRC32C_POLY_REFLECTED 0x82F63B78
+
+static inline uint32_t
+update_crc32c_sw (uint32_t crc, const uint8_t *data, size_t len)
+{
+  static uint32_t lut[256];
+  static int lut_ready = 0;
+  uint32_t c;
+  int i, j;
+
+  if (!lut_ready) {
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c >> 1) ^ (c & 1 ? CRC32C_POLY_REFLECTED : 0);
+      lut[i] = c;
+    }
+    lut_ready = 1;
+  }
+  while (len--)
+    crc = (crc >> 8) ^ lut[(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target ("sse4.2")))
+static inline uint32_t
+update_crc32c_hw (uint32_t crc, const uint8_t *data, size_t len)
+{
+  uint64_t c = crc;
+  uint64_t word;
+
+  for (; len >= 8; len -= 8, data += 8) {
+    memcpy (&word, data, sizeof(word));
+    c = __builtin_ia32_crc32di (c, word);
+  }
+  crc = (uint32_t) c;
+  for (; len > 0; len--)
+    crc = __builtin_ia32_crc32qi (crc, *data++);
+  return crc;
+}
+
+static inline int
+crc32c_has_hw (void)
+{
+  return __builtin_cpu_supports ("sse4.2");
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+#include <arm_acle.h>
+
+static inline uint32_t
+update_crc32c_hw (uint32_t crc, const uint8_t *data, size_t len)
+{
+  uint64_t word;
+
+  for (; len >= 8; len -= 8, data += 8) {
+    memcpy (&word, data, sizeof(word));
+    crc = __crc32cd (crc, word);
+  }
+  for (; len > 0; len--)
+    crc = __crc32cb (crc, *data++);
+  return crc;
+}
+
+static inline int
+crc32c_has_hw (void)
+{
+  return 1;
+}
+
+#else
+
+#define update_crc32c_hw update_crc32c_sw
+
+static inline int
+crc32c_has_hw (void)
+{
+  return 0;
+}
+
+#endif
+
+/**
+ * Calculates the CRC-32C of the buffer buf.
+ * @param buf The buffer containing the data
+ * @param len the size of the buffer
+ * @return the CRC-32C of the buffer
+ */
+static inline uint32_t
+crc32c (const uint8_t *buf, size_t len)
+{
+  static int hw = -1;
+
+  if (hw < 0)
+    hw = crc32c_has_hw ();
+  if (hw)
+    return update_crc32c_hw (0xffffffff, buf, len) ^ 0xffffffff;
+  return update_crc32c_sw (0xffffffff, buf, len) ^ 0xffffffff;
+}
+
+#endif /* UTILS_CRC32C_H_ */
@@ -0,0 +1,60 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef UTILS_HASH64_H_
+#define UTILS_HASH64_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * A fast 64-bit non-cryptographic hash. It reads the data 8 bytes at a
+ * time with one multiplication per word and mixes the result with the
+ * finalizer of MurmurHash3, so every input bit affects every output bit.
+ * It detects corruption about as well as a CRC of the same width, but it
+ * gives no guarantees for short burst errors.
+ */
+
+#define HASH64_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t
+hash64_rotl (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * @param buf The buffer containing the data
+ * @param len the size of the buffer
+ * @param seed the initial feed
+ * @return the 64-bit hash of the buffer
+ */
+static inline uint64_t
+hash64 (const uint8_t *buf, size_t len, uint64_t seed)
+{
+  uint64_t h = seed ^ (len * HASH64_PRIME1);
+  uint64_t word;
+
+  for (; len >= 8; len -= 8, buf += 8) {
+    memcpy (&word, buf, sizeof(word));
+    h ^= hash64_rotl (word * HASH64_PRIME2, 31) * HASH64_PRIME1;
+    h = hash64_rotl (h, 27) * HASH64_PRIME1 + HASH64_PRIME2;
+  }
+  if (len > 0) {
+    word = 0;
+    memcpy (&word, buf, len);
+    h ^= hash64_rotl (word * HASH64_PRIME2, 31) * HASH64_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+#endif /* UTILS_HASH64_H_ */
@@ -0,0 +1,223 @@
+/* Georgios Gerasimos Leventopoulos csd4152
+   Konstantinos Anemozalis csd4149
+   Theofanis Tsesmetzis csd4142             */
+
+#ifndef UTILS_HDR_HISTOGRAM_H_
+#define UTILS_HDR_HISTOGRAM_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * A histogram in the style of HdrHistogram. Values from 1 up to a highest
+ * trackable value are recorded with a fixed number of significant decimal
+ * digits, in constant time and without allocations. The buckets grow in
+ * powers of two, each one split into the same number of linear sub-buckets.
+ */
+typedef struct
+{
+  int64_t highest;              /* Larger values are recorded as this one */
+  int sub_bucket_half_magnitude;
+  int64_t sub_bucket_half_count;
+  int64_t sub_bucket_mask;
+  size_t counts_len;
+  uint64_t *counts;
+  uint64_t total;
+  int64_t min;
+  int64_t max;
+  double sum;
+} hdr_histogram_t;
+
+/**
+ * @param highest the highest value that will be tracked precisely
+ * @param significant_digits 1 to 5
+ * @return 0 on success or -1 on failure
+ */
+static inline int
+hdr_init (hdr_histogram_t *h, int64_t highest, int significant_digits)
+{
+  int64_t largest_single_unit = 2;
+  int64_t smallest_untrackable;
+  int magnitude = 0;
+  int bucket_count = 1;
+
+  if (significant_digits < 1 || significant_digits > 5 || highest < 2)
+    return -1;
+  while (significant_digits-- > 0)
+    largest_single_unit *= 10;
+  while ((1LL << magnitude) < largest_single_unit)
+    magnitude++;
+
+  memset (h, 0, sizeof(hdr_histogram_t));
+  h->highest = highest;
+  h->sub_bucket_half_magnitude = magnitude - 1;
+  h->sub_bucket_half_count = 1LL << (magnitude - 1);
+  h->sub_bucket_mask = (1LL << magnitude) - 1;
+
+  smallest_untrackable = 1LL << magnitude;
+  while (smallest_untrackable <= highest) {
+    if (smallest_untrackable > INT64_MAX / 2) {
+      bucket_count++;
+      break;
+    }
+    smallest_untrackable <<= 1;
+    bucket_count++;
+  }
+  h->counts_len = (bucket_count + 1) * h->sub_bucket_half_count;
+  h->counts = (uint64_t *) calloc (h->counts_len, sizeof(uint64_t));
+  h->min = INT64_MAX;
+  return h->counts ? 0 : -1;
+}
+
+static inline void
+hdr_free (hdr_histogram_t *h)
+{
+  free (h->counts);
+  h->counts = NULL;
+}
+
+static inline void
+hdr_reset (hdr_histogram_t *h)
+{
+  memset (h->counts, 0, h->counts_len * sizeof(uint64_t));
+  h->total = 0;
+  h->min = INT64_MAX;
+  h->max = 0;
+  h->sum = 0.0;
+}
+
+static inline size_t
+hdr_index (const hdr_histogram_t *h, int64_t value)
+{
+  int bucket = 64 - __builtin_clzll (value | h->sub_bucket_mask)
+      - (h->sub_bucket_half_magnitude + 1);
+  int64_t sub_bucket = value >> bucket;
+  return ((size_t)(bucket + 1) << h->sub_bucket_half_magnitude)
+      + (sub_bucket - h->sub_bucket_half_count);
+}
+
+/* The lowest and the highest value that are recorded at index i */
+static inline int64_t
+hdr_lowest_at (const hdr_histogram_t *h, size_t i, int64_t *highest)
+{
+  int bucket = (int)(i >> h->sub_bucket_half_magnitude) - 1;
+  int64_t sub_bucket = (i & (h->sub_bucket_half_count - 1)) + h->sub_bucket_half_count;
+
+  if (bucket < 0) {
+    sub_bucket -= h->sub_bucket_half_count;
+    bucket = 0;
+  }
+  if (highest)
+    *highest = (sub_bucket << bucket) + (1LL << bucket) - 1;
+  return sub_bucket << bucket;
+}
+
+static inline void
+hdr_record_n (hdr_histogram_t *h, int64_t value, uint64_t n)
+{
+  if (value < 0)
+    value = 0;
+  if (value > h->highest)
+    value = h->highest;
+  h->counts[hdr_index (h, value)] += n;
+  h->total += n;
+  h->sum += (double) value * n;
+  if (value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+static inline void
+hdr_record (hdr_histogram_t *h, int64_t value)
+{
+  hdr_record_n (h, value, 1);
+}
+
+/* Adds the counts of src, which must have been created with the same parameters */
+static inline void
+hdr_add (hdr_histogram_t *dst, const hdr_histogram_t *src)
+{
+  size_t i;
+
+  for (i = 0; i < dst->counts_len; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->total && src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+static inline double
+hdr_mean (const hdr_histogram_t *h)
+{
+  return h->total ? h->sum / h->total : 0.0;
+}
+
+/**
+ * @param percentile 0 to 100
+ * @return the highest value of the bucket that holds the percentile
+ */
+static inline int64_t
+hdr_value_at_percentile (const hdr_histogram_t *h, double percentile)
+{
+  uint64_t target;
+  uint64_t seen = 0;
+  int64_t highest;
+  size_t i;
+
+  if (h->total == 0)
+    return 0;
+  if (percentile >= 100.0)
+    return h->max;
+  target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+  if (target < 1)
+    target = 1;
+  for (i = 0; i < h->counts_len; i++) {
+    seen += h->counts[i];
+    if (seen >= target) {
+      hdr_lowest_at (h, i, &highest);
+      return highest < h->max ? highest : h->max;
+    }
+  }
+  return h->max;
+}
+
+/**
+ * Prints the whole distribution in the percentile format of HdrHistogram,
+ * which its plotting tools understand. Values are divided by scale.
+ */
+static inline void
+hdr_print_percentiles (const hdr_histogram_t *h, FILE *fp, double scale)
+{
+  uint64_t seen = 0;
+  int64_t highest;
+  double percentile;
+  size_t i;
+
+  fprintf (fp, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+           "1/(1-Percentile)");
+  for (i = 0; i < h->counts_len; i++) {
+    if (h->counts[i] == 0)
+      continue;
+    seen += h->counts[i];
+    hdr_lowest_at (h, i, &highest);
+    percentile = (double) seen / h->total;
+    if (percentile < 1.0)
+      fprintf (fp, "%12.3f %2.12f %10lu %14.2f\n", highest / scale, percentile,
+               (unsigned long) seen, 1.0 / (1.0 - percentile));
+    else
+      fprintf (fp, "%12.3f %2.12f %10lu\n", h->max / scale, percentile,
+               (unsigned long) seen);
+  }
+  fprintf (fp, "#[Mean    = %12.3f, Total count    = %12lu]\n", hdr_mean (h) / scale,
+           (unsigned long) h->total);
+  fprintf (fp, "#[Max     = %12.3f, Min            = %12.3f]\n", h->max / scale,
+           h->total ? h->min / scale : 0.0);
+}
+
+#endif /* UTILS_HDR_HISTOGRAM_H_ */
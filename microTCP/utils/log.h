@@ -26,28 +26,51 @@
 #include <string.h>
 #include <sys/syscall.h>
 
+/*
+ * Verbosity levels. A message is printed only if its level is enabled both
+ * at compile time (LOG_MAX_LEVEL) and at runtime (log_level).
+ */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5       /* Per packet events, see lib/microtcp_trace.h */
+
 /* Set to 0 to disable debug messages at compile time ;) */
 #define ENABLE_DEBUG_MSG 1
 
+/* Everything above this level is compiled out. Override with -DLOG_MAX_LEVEL=n */
+#ifndef LOG_MAX_LEVEL
 #if ENABLE_DEBUG_MSG
-#define LOG_INFO(M, ...)                                                        \
-                fprintf(stderr, "[INFO]: %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-
+#define LOG_MAX_LEVEL LOG_LEVEL_TRACE
 #else
-#define LOG_INFO(M, ...)
+#define LOG_MAX_LEVEL LOG_LEVEL_WARN
 #endif
+#endif
+
+/*
+ * The runtime level, shared by every file that includes this header.
+ * It is a weak symbol so the header needs no source file of its own.
+ */
+int log_level __attribute__((weak)) = LOG_MAX_LEVEL;
 
-#define LOG_ERROR(M, ...)                                                       \
-        fprintf(stderr, "[ERROR] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+/* Constant folds to 0 for the levels that are compiled out */
+#define LOG_ENABLED(level)                                                      \
+        ((level) <= LOG_MAX_LEVEL && (level) <= log_level)
 
-#define LOG_WARN(M, ...)                                                                \
-        fprintf(stderr, "[WARNING] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#define LOG_PRINT(level, tag, M, ...)                                           \
+        do {                                                                    \
+          if (LOG_ENABLED(level))                                               \
+            fprintf(stderr, tag " %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+        } while (0)
 
-#if ENABLE_DEBUG_MSG
-#define LOG_DEBUG(M, ...)                                                       \
-        fprintf(stderr, "[DEBUG]: %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-#else
-#define LOG_DEBUG(M, ...)
-#endif
+#define LOG_INFO(M, ...) LOG_PRINT(LOG_LEVEL_INFO, "[INFO]:", M, ##__VA_ARGS__)
+
+#define LOG_ERROR(M, ...) LOG_PRINT(LOG_LEVEL_ERROR, "[ERROR]", M, ##__VA_ARGS__)
+
+#define LOG_WARN(M, ...) LOG_PRINT(LOG_LEVEL_WARN, "[WARNING]", M, ##__VA_ARGS__)
+
+#define LOG_DEBUG(M, ...) LOG_PRINT(LOG_LEVEL_DEBUG, "[DEBUG]:", M, ##__VA_ARGS__)
 
 #endif /* UTILS_LOG_H_ */